@@ -0,0 +1,406 @@
+#pragma once
+#include "keywords.h"
+#include "packet.h"
+#include "packet_sink.h"
+#include "packet_source.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdint.h>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Captures from AF_PACKET sockets with TPACKET_V3 receive rings.
+//
+// The kernel fills the mapped ring a block at a time and hands over whole
+// blocks, which are walked without a system call per packet; a partly
+// filled block is handed over after `block_timeout_ms`. Packets are cut to
+// the snaplen by a socket filter, so the rest is never copied.
+//
+// With more than one thread, each thread gets its own socket and ring in
+// a PACKET_FANOUT group that spreads the packets by flow hash. The sink is
+// still called from one thread at a time, a block per lock, so packets of
+// different flows may reach it slightly out of timestamp order.
+//
+// On loopback, every packet is seen both leaving and arriving; only
+// the arriving copy is kept, without a direction.
+//
+// VLAN tags that the NIC or the kernel stripped are put back in front of
+// the ethertype, as libpcap does, in headroom reserved before each frame.
+struct af_packet_source final
+	: packet_source
+{
+	static constexpr size_t block_size = 1 << 20;
+	static constexpr size_t block_count = 64;
+	static constexpr unsigned block_timeout_ms = 100;
+
+	// Captures on the named interface, or on all of them if `ifname` is empty.
+	af_packet_source(std::shared_ptr<packet_sink> sink, size_t snaplen, capture_selection selection, std::string const & ifname = {}, size_t threads = 1)
+		: _sink(std::move(sink)), _snaplen(snaplen), _selection(selection)
+	{
+		unsigned ifindex = 0;
+		if (!ifname.empty())
+		{
+			ifindex = if_nametoindex(ifname.c_str());
+			if (ifindex == 0)
+				throw std::system_error(errno, std::system_category(), ifname);
+		}
+
+		_stop_fd.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (_stop_fd.fd < 0)
+			throw std::system_error(errno, std::system_category());
+
+		// The group id only has to be unique among the running captures.
+		int fanout_id = threads > 1? (int)(getpid() & 0xffff): -1;
+		for (size_t i = 0; i != (threads ? threads : 1); ++i)
+			_rings.push_back(std::make_unique<_ring_t>(ifindex, snaplen, fanout_id));
+	}
+
+	af_packet_source(af_packet_source const &) = delete;
+	af_packet_source & operator=(af_packet_source const &) = delete;
+
+	void run() override
+	{
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < _rings.size(); ++i)
+			threads.emplace_back([this, i] { this->_run_ring(*_rings[i]); });
+
+		this->_run_ring(*_rings[0]);
+		for (auto & t: threads)
+			t.join();
+	}
+
+	void stop() override
+	{
+		_stopping = true;
+
+		uint64_t one = 1;
+		(void)!::write(_stop_fd.fd, &one, sizeof one);
+	}
+
+	std::vector<std::string> warnings() const override
+	{
+		uint64_t dropped = 0;
+		for (auto const & ring: _rings)
+		{
+			tpacket_stats_v3 st = {};
+			socklen_t len = sizeof st;
+			if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+				dropped += st.tp_drops;
+		}
+
+		std::vector<std::string> r;
+		if (dropped != 0)
+			r.push_back("the kernel dropped " + std::to_string(dropped) + " packets");
+		if (_unsupported != 0)
+			r.push_back("skipped " + std::to_string(_unsupported) + " packets of interfaces with unsupported link types");
+		return r;
+	}
+
+private:
+	static constexpr size_t _vlan_tag_size = 4;
+
+	// Closes the descriptor, including when the constructor throws.
+	struct _fd_t
+	{
+		_fd_t() = default;
+
+		~_fd_t()
+		{
+			if (fd >= 0)
+				::close(fd);
+		}
+
+		_fd_t(_fd_t const &) = delete;
+		_fd_t & operator=(_fd_t const &) = delete;
+
+		int fd = -1;
+	};
+
+	struct _ring_t
+	{
+		_ring_t(unsigned ifindex, size_t snaplen, int fanout_id)
+		{
+			fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+			if (fd < 0)
+				throw std::system_error(errno, std::system_category());
+
+			try
+			{
+				int version = TPACKET_V3;
+				_setsockopt(PACKET_VERSION, version);
+
+				unsigned reserve = _vlan_tag_size;
+				_setsockopt(PACKET_RESERVE, reserve);
+
+				tpacket_req3 req = {};
+				req.tp_block_size = block_size;
+				req.tp_block_nr = block_count;
+				// Packets aren't stored in fixed frames in TPACKET_V3,
+				// but the frame geometry must still be valid.
+				req.tp_frame_size = 2048;
+				req.tp_frame_nr = block_size / req.tp_frame_size * block_count;
+				req.tp_retire_blk_tov = block_timeout_ms;
+				_setsockopt(PACKET_RX_RING, req);
+
+				void * p = mmap(nullptr, block_size * block_count, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (p == MAP_FAILED)
+					throw std::system_error(errno, std::system_category());
+				map = (std::byte *)p;
+
+				// Returning the snaplen from the filter truncates the copy.
+				sock_filter truncate = BPF_STMT(BPF_RET | BPF_K, (uint32_t)snaplen);
+				sock_fprog prog = { .len = 1, .filter = &truncate };
+				if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof prog) != 0)
+					throw std::system_error(errno, std::system_category());
+
+				sockaddr_ll addr = {};
+				addr.sll_family = AF_PACKET;
+				addr.sll_protocol = htons(ETH_P_ALL);
+				addr.sll_ifindex = (int)ifindex;
+				if (bind(fd, (sockaddr const *)&addr, sizeof addr) != 0)
+					throw std::system_error(errno, std::system_category());
+
+				if (fanout_id >= 0)
+				{
+					int fanout = fanout_id | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+					_setsockopt(PACKET_FANOUT, fanout);
+				}
+			}
+			catch (...)
+			{
+				this->_close();
+				throw;
+			}
+		}
+
+		~_ring_t()
+		{
+			this->_close();
+		}
+
+		_ring_t(_ring_t const &) = delete;
+		_ring_t & operator=(_ring_t const &) = delete;
+
+		tpacket_block_desc * block(size_t i) const noexcept
+		{
+			return (tpacket_block_desc *)(map + i * block_size);
+		}
+
+		int fd = -1;
+		std::byte * map = nullptr;
+
+	private:
+		template <typename T>
+		void _setsockopt(int opt, T const & value)
+		{
+			if (setsockopt(fd, SOL_PACKET, opt, &value, sizeof value) != 0)
+				throw std::system_error(errno, std::system_category());
+		}
+
+		void _close() noexcept
+		{
+			if (map)
+				munmap(map, block_size * block_count);
+			if (fd >= 0)
+				::close(fd);
+		}
+	};
+
+	// Walks the blocks of the ring in order, waiting for the kernel
+	// to hand each one over.
+	void _run_ring(_ring_t & ring)
+	{
+		try
+		{
+			pollfd fds[2] = {};
+			fds[0].fd = ring.fd;
+			fds[0].events = POLLIN | POLLERR;
+			fds[1].fd = _stop_fd.fd;
+			fds[1].events = POLLIN;
+
+			for (size_t cur = 0; !_stopping; cur = (cur + 1) % block_count)
+			{
+				tpacket_block_desc * block = ring.block(cur);
+				std::atomic_ref<uint32_t> status(block->hdr.bh1.block_status);
+				while ((status.load(std::memory_order_acquire) & TP_STATUS_USER) == 0)
+				{
+					if (poll(fds, 2, tick_interval_ms) < 0 && errno != EINTR)
+						throw std::system_error(errno, std::system_category());
+					if (_stopping)
+						return;
+
+					std::lock_guard<std::mutex> lock(_mutex);
+					this->_tick_if_due();
+				}
+
+				this->_deliver(block);
+				status.store(TP_STATUS_KERNEL, std::memory_order_release);
+			}
+		}
+		catch (std::exception const & e)
+		{
+			this->stop();
+			fprintf(stderr, "error: %s\n", e.what());
+		}
+	}
+
+	void _deliver(tpacket_block_desc * block)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		auto const & bh = block->hdr.bh1;
+		std::byte * p = (std::byte *)block + bh.offset_to_first_pkt;
+		for (uint32_t i = 0; i != bh.num_pkts; ++i)
+		{
+			tpacket3_hdr const * hdr = (tpacket3_hdr const *)p;
+			sockaddr_ll const * ll = (sockaddr_ll const *)(p + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+
+			std::span<std::byte const> data(p + hdr->tp_mac, hdr->tp_snaplen);
+			size_t full_length = hdr->tp_len;
+			bool tagged = (hdr->tp_status & TP_STATUS_VLAN_VALID) || hdr->hv1.tp_vlan_tci != 0;
+			if (tagged && data.size() >= 12)
+			{
+				data = _insert_vlan_tag(hdr, p + hdr->tp_mac);
+				full_length += _vlan_tag_size;
+				if (data.size() > _snaplen)
+					data = data.first(_snaplen);
+			}
+
+			this->_deliver_packet(hdr, ll, data, full_length);
+			p += hdr->tp_next_offset;
+		}
+
+		this->_tick_if_due();
+	}
+
+	// Ticks the sink once `tick_interval_ms` have passed since the last tick,
+	// whichever thread gets here first; `_mutex` must be held.
+	void _tick_if_due()
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (now < _next_tick)
+			return;
+
+		_next_tick = now + std::chrono::milliseconds(tick_interval_ms);
+		_sink->tick();
+	}
+
+	// Moves the MAC addresses into the headroom and puts the tag after them.
+	static std::span<std::byte const> _insert_vlan_tag(tpacket3_hdr const * hdr, std::byte * mac) noexcept
+	{
+		uint16_t tpid = hdr->tp_status & TP_STATUS_VLAN_TPID_VALID? hdr->hv1.tp_vlan_tpid: ETH_P_8021Q;
+		uint16_t tci = hdr->hv1.tp_vlan_tci;
+
+		std::byte * start = mac - _vlan_tag_size;
+		memmove(start, mac, 12);
+		start[12] = (std::byte)(tpid >> 8);
+		start[13] = (std::byte)tpid;
+		start[14] = (std::byte)(tci >> 8);
+		start[15] = (std::byte)tci;
+		return { start, hdr->tp_snaplen + _vlan_tag_size };
+	}
+
+	void _deliver_packet(tpacket3_hdr const * hdr, sockaddr_ll const * ll, std::span<std::byte const> data, size_t full_length)
+	{
+		uint32_t flags = 0;
+		if (ll->sll_hatype == ARPHRD_LOOPBACK)
+		{
+			if (ll->sll_pkttype == PACKET_OUTGOING)
+				return;
+		}
+		else if (ll->sll_pkttype == PACKET_OUTGOING)
+		{
+			if (!_selection.outbound)
+				return;
+			flags = epb_outbound;
+		}
+		else
+		{
+			if (!_selection.inbound)
+				return;
+			flags = epb_inbound;
+		}
+
+		auto it = _intfs.find(ll->sll_ifindex);
+		if (it == _intfs.end())
+			it = _intfs.emplace(ll->sll_ifindex, this->_add_interface(ll)).first;
+
+		if (it->second == _unsupported_intf)
+		{
+			++_unsupported;
+			return;
+		}
+
+		_sink->add_packet(it->second, (uint64_t)hdr->tp_sec * 1'000'000 + hdr->tp_nsec / 1'000,
+			data, full_length, flags);
+	}
+
+	uint32_t _add_interface(sockaddr_ll const * ll)
+	{
+		// Loopback frames carry an Ethernet header with zero addresses.
+		if (ll->sll_hatype != ARPHRD_ETHER && ll->sll_hatype != ARPHRD_LOOPBACK)
+			return _unsupported_intf;
+
+		char name[IF_NAMESIZE] = {};
+		if_indextoname((unsigned)ll->sll_ifindex, name);
+
+		return _sink->add_interface({
+			.index = (uint32_t)ll->sll_ifindex,
+			.link_type = if_type_ethernet,
+			.name = name,
+			.desc = name,
+			.snaplen = _snaplen,
+			});
+	}
+
+	static constexpr uint32_t _unsupported_intf = ~(uint32_t)0;
+
+	std::shared_ptr<packet_sink> _sink;
+	size_t _snaplen;
+	capture_selection _selection;
+
+	std::vector<std::unique_ptr<_ring_t>> _rings;
+	_fd_t _stop_fd;
+	std::atomic<bool> _stopping = false;
+
+	// Guards the sink and the interfaces.
+	std::mutex _mutex;
+	std::map<int, uint32_t> _intfs;
+	uint64_t _unsupported = 0;
+	std::chrono::steady_clock::time_point _next_tick;
+};
+
+// Prints the interfaces that can be given to `-i`.
+inline void print_capture_interfaces()
+{
+	struct if_nameindex * names = if_nameindex();
+	if (!names)
+		throw std::system_error(errno, std::system_category());
+
+	for (struct if_nameindex const * cur = names; cur->if_index != 0; ++cur)
+		printf("[%u] %s\n", cur->if_index, cur->if_name);
+	if_freenameindex(names);
+}
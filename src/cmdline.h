@@ -5,11 +5,19 @@
 #include <string>
 #include <string_view>
 #include <system_error>
+#include <utility>
 
+#ifdef _WIN32
 #include <windows.h>
+#endif
 
 struct command_line_reader
 {
+#ifdef _WIN32
+	// The arguments are taken from the UTF-16 command line,
+	// rather than from `argv` in the ANSI code page.
+	using char_type = wchar_t;
+
 	command_line_reader()
 		: command_line_reader(::GetCommandLineW())
 	{
@@ -33,6 +41,15 @@ struct command_line_reader
 
 		_arg0 = this->pop_path();
 	}
+#else
+	using char_type = char;
+
+	command_line_reader(int argc, char const * const argv[])
+		: _argc(argc), _argv(argv)
+	{
+		_arg0 = this->pop_path();
+	}
+#endif
 
 	std::filesystem::path const & arg0() const noexcept
 	{
@@ -54,7 +71,7 @@ struct command_line_reader
 			if (*_short_opts == '=')
 			{
 				_forced_arg = _short_opts + 1;
-				_short_opts = L"";
+				_short_opts = _no_short_opts;
 			}
 			return true;
 		}
@@ -62,7 +79,7 @@ struct command_line_reader
 		if (_idx >= _argc)
 			return false;
 
-		wchar_t const * cur = _argv[_idx++];
+		char_type const * cur = _argv[_idx++];
 		if (_parse_opts && cur[0] == '-' && cur[1] != 0 && cur[1] != '=')
 		{
 			if (cur[1] == '-')
@@ -131,9 +148,9 @@ struct command_line_reader
 	}
 
 private:
-	void _apply_long_arg(wchar_t const * arg)
+	void _apply_long_arg(char_type const * arg)
 	{
-		wchar_t const * p = arg + 2;
+		char_type const * p = arg + 2;
 		for (;;)
 		{
 			switch (*p)
@@ -152,6 +169,12 @@ private:
 		}
 	}
 
+	static constexpr char_type _no_short_opts[1] = {};
+
+	int _argc;
+	int _idx = 0;
+
+#ifdef _WIN32
 	struct _win32_local_deleter
 	{
 		void operator()(void const * p)
@@ -161,13 +184,14 @@ private:
 		}
 	};
 
-	int _argc;
-	int _idx = 0;
 	std::unique_ptr<wchar_t const * const[], _win32_local_deleter> _argv;
+#else
+	char const * const * _argv;
+#endif
 
 	bool _parse_opts = true;
-	wchar_t const * _short_opts = L"";
-	wchar_t const * _forced_arg = nullptr;
+	char_type const * _short_opts = _no_short_opts;
+	char_type const * _forced_arg = nullptr;
 
 	std::string _opt;
 	std::filesystem::path _arg0;
@@ -0,0 +1,323 @@
+#pragma once
+#include "output.h"
+#include "packet.h"
+#include "packet_sink.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <stdint.h>
+#include <vector>
+
+// A column-oriented export of the decoded packet headers.
+//
+// The file starts with a `column_file_header` and a `column_desc` for each
+// column, followed by chunks. A chunk is a `column_chunk_header`, then
+// a `column_chunk_entry` for each column, then the column data, each column
+// starting at an 8-byte boundary. All values are little-endian with a fixed
+// width per column. Timestamps are in microseconds since the epoch.
+// Addresses are stored as 16 bytes; IPv4 addresses are
+// mapped into IPv6 (::ffff:a.b.c.d) and missing fields are zero.
+//
+// The chunk entries carry the minimum and maximum value of the column in the
+// chunk, so that a reader can skip chunks without touching their data.
+// Integer columns are ordered numerically, byte columns lexicographically.
+struct column_file_header
+{
+	static constexpr uint32_t magic_value = 0x4c4f434e; // "NCOL"
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t column_count;
+	uint32_t reserved;
+};
+
+struct column_desc
+{
+	enum: uint8_t
+	{
+		type_uint = 0,
+		type_bytes = 1,
+	};
+
+	uint8_t type;
+	uint8_t width;
+	char name[14];
+};
+
+struct column_chunk_header
+{
+	static constexpr uint32_t magic_value = 0x4b4e4843; // "CHNK"
+
+	uint32_t magic;
+	uint32_t row_count;
+
+	// The size of the whole chunk, including this header.
+	uint64_t size;
+};
+
+struct column_chunk_entry
+{
+	// From the start of the chunk.
+	uint64_t offset;
+	uint64_t size;
+	std::array<uint8_t, 16> min;
+	std::array<uint8_t, 16> max;
+};
+
+// Collects the header fields of each packet into column buffers and writes
+// them out a chunk at a time from a background thread.
+struct column_writer final
+	: packet_sink
+{
+	static constexpr size_t default_chunk_rows = 64 * 1024;
+
+	enum: size_t
+	{
+		col_timestamp,
+		col_interface,
+		col_src_mac,
+		col_dst_mac,
+		col_vlan,
+		col_ethertype,
+		col_ip_version,
+		col_ip_proto,
+		col_src_ip,
+		col_dst_ip,
+		col_src_port,
+		col_dst_port,
+		col_tcp_flags,
+		col_captured_length,
+		col_packet_length,
+		column_count,
+	};
+
+	static constexpr column_desc columns[column_count] = {
+		{ column_desc::type_uint, 8, "timestamp" },
+		{ column_desc::type_uint, 4, "interface" },
+		{ column_desc::type_bytes, 6, "src_mac" },
+		{ column_desc::type_bytes, 6, "dst_mac" },
+		{ column_desc::type_uint, 2, "vlan" },
+		{ column_desc::type_uint, 2, "ethertype" },
+		{ column_desc::type_uint, 1, "ip_version" },
+		{ column_desc::type_uint, 1, "ip_proto" },
+		{ column_desc::type_bytes, 16, "src_ip" },
+		{ column_desc::type_bytes, 16, "dst_ip" },
+		{ column_desc::type_uint, 2, "src_port" },
+		{ column_desc::type_uint, 2, "dst_port" },
+		{ column_desc::type_uint, 1, "tcp_flags" },
+		{ column_desc::type_uint, 4, "captured_len" },
+		{ column_desc::type_uint, 4, "packet_len" },
+	};
+
+	explicit column_writer(std::filesystem::path const & path, size_t chunk_rows = default_chunk_rows)
+		: column_writer(std::make_shared<file_output>(path), chunk_rows)
+	{
+	}
+
+	explicit column_writer(std::shared_ptr<byte_output> out, size_t chunk_rows = default_chunk_rows)
+		: _chunk_rows(chunk_rows ? chunk_rows : default_chunk_rows), _io(out)
+	{
+		for (size_t i = 0; i != column_count; ++i)
+			_columns[i].resize(_chunk_rows * columns[i].width);
+
+		if (out->initial_offset() == 0)
+		{
+			column_file_header hdr = {
+				.magic = column_file_header::magic_value,
+				.version = 1,
+				.column_count = column_count,
+				.reserved = 0,
+			};
+
+			_append(std::as_bytes(std::span(&hdr, 1)));
+			_append(std::as_bytes(std::span(columns)));
+		}
+	}
+
+	~column_writer()
+	{
+		try
+		{
+			this->flush();
+		}
+		catch (...)
+		{
+		}
+	}
+
+	column_writer(column_writer const &) = delete;
+	column_writer & operator=(column_writer const &) = delete;
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		_if_types.push_back(intf.link_type);
+		_if_indexes.push_back(intf.index);
+		return (uint32_t)(_if_types.size() - 1);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t /*flags*/) override
+	{
+		decode_packet(_if_types[ifidx], payload, _pkt);
+
+		std::array<uint8_t, 16> src_ip = {}, dst_ip = {};
+		if (_pkt.ip_version == 4)
+		{
+			src_ip[10] = src_ip[11] = dst_ip[10] = dst_ip[11] = 0xff;
+			memcpy(src_ip.data() + 12, _pkt.src_ip.data(), 4);
+			memcpy(dst_ip.data() + 12, _pkt.dst_ip.data(), 4);
+		}
+		else if (_pkt.ip_version == 6)
+		{
+			src_ip = _pkt.src_ip;
+			dst_ip = _pkt.dst_ip;
+		}
+
+		this->_set(col_timestamp, timestamp);
+		this->_set(col_interface, (uint32_t)_if_indexes[ifidx]);
+		this->_set(col_src_mac, _pkt.src_mac);
+		this->_set(col_dst_mac, _pkt.dst_mac);
+		this->_set(col_vlan, _pkt.vlan_id);
+		this->_set(col_ethertype, _pkt.ethertype);
+		this->_set(col_ip_version, _pkt.ip_version);
+		this->_set(col_ip_proto, _pkt.ip_proto);
+		this->_set(col_src_ip, src_ip);
+		this->_set(col_dst_ip, dst_ip);
+		this->_set(col_src_port, _pkt.src_port);
+		this->_set(col_dst_port, _pkt.dst_port);
+		this->_set(col_tcp_flags, _pkt.tcp_flags);
+		this->_set(col_captured_length, (uint32_t)payload.size());
+		this->_set(col_packet_length, (uint32_t)full_length);
+
+		if (++_rows == _chunk_rows)
+			this->_end_chunk();
+	}
+
+	void flush() override
+	{
+		this->_end_chunk();
+		if (_size != 0)
+		{
+			_buf = _io.submit(std::move(_buf), _size);
+			_size = 0;
+		}
+		_io.wait();
+	}
+
+private:
+	static constexpr size_t _align(size_t n) noexcept
+	{
+		return (n + 7) & ~(size_t)7;
+	}
+
+	template <typename T>
+	void _set(size_t col, T const & value) noexcept
+	{
+		memcpy(_columns[col].data() + _rows * columns[col].width, &value, columns[col].width);
+	}
+
+	void _append(std::span<std::byte const> data)
+	{
+		if (_buf.size() < _size + data.size())
+			_buf.resize(_size + data.size());
+		memcpy(_buf.data() + _size, data.data(), data.size());
+		_size += data.size();
+	}
+
+	// The minimum and maximum of a column, with the values compared as
+	// numbers or as byte strings depending on the column type.
+	void _stats(size_t col, column_chunk_entry & e) const noexcept
+	{
+		column_desc const & desc = columns[col];
+		std::byte const * data = _columns[col].data();
+
+		if (desc.type == column_desc::type_uint)
+		{
+			uint64_t lo = ~(uint64_t)0, hi = 0;
+			for (size_t i = 0; i != _rows; ++i)
+			{
+				uint64_t v = 0;
+				memcpy(&v, data + i * desc.width, desc.width);
+				lo = (std::min)(lo, v);
+				hi = (std::max)(hi, v);
+			}
+
+			memcpy(e.min.data(), &lo, desc.width);
+			memcpy(e.max.data(), &hi, desc.width);
+			return;
+		}
+
+		std::byte const * lo = data;
+		std::byte const * hi = data;
+		for (size_t i = 1; i != _rows; ++i)
+		{
+			std::byte const * v = data + i * desc.width;
+			if (memcmp(v, lo, desc.width) < 0)
+				lo = v;
+			if (memcmp(v, hi, desc.width) > 0)
+				hi = v;
+		}
+
+		memcpy(e.min.data(), lo, desc.width);
+		memcpy(e.max.data(), hi, desc.width);
+	}
+
+	void _end_chunk()
+	{
+		if (_rows == 0)
+			return;
+
+		size_t offset = _align(sizeof(column_chunk_header) + sizeof(column_chunk_entry) * column_count);
+		std::array<column_chunk_entry, column_count> entries = {};
+		for (size_t i = 0; i != column_count; ++i)
+		{
+			entries[i].offset = offset;
+			entries[i].size = _rows * columns[i].width;
+			this->_stats(i, entries[i]);
+			offset += _align(entries[i].size);
+		}
+
+		column_chunk_header hdr = {
+			.magic = column_chunk_header::magic_value,
+			.row_count = (uint32_t)_rows,
+			.size = offset,
+		};
+
+		// A chunk is submitted whole; it is large enough to make for
+		// a good sequential write on its own.
+		size_t start = _size;
+		if (_buf.size() < _size + offset)
+			_buf.resize(_size + offset);
+
+		memcpy(_buf.data() + start, &hdr, sizeof hdr);
+		memcpy(_buf.data() + start + sizeof hdr, entries.data(), sizeof entries);
+		for (size_t i = 0; i != column_count; ++i)
+		{
+			std::byte * p = _buf.data() + start + entries[i].offset;
+			memcpy(p, _columns[i].data(), entries[i].size);
+			memset(p + entries[i].size, 0, _align(entries[i].size) - entries[i].size);
+		}
+
+		size_t header_end = start + sizeof hdr + sizeof entries;
+		memset(_buf.data() + header_end, 0, start + entries[0].offset - header_end);
+
+		_buf = _io.submit(std::move(_buf), start + offset);
+		_size = 0;
+		_rows = 0;
+	}
+
+	size_t _chunk_rows;
+	size_t _rows = 0;
+	std::array<std::vector<std::byte>, column_count> _columns;
+
+	std::vector<std::byte> _buf;
+	size_t _size = 0;
+	write_behind _io;
+
+	std::vector<uint16_t> _if_types;
+	std::vector<uint32_t> _if_indexes;
+	decoded_packet _pkt;
+};
@@ -0,0 +1,509 @@
+#pragma once
+#include "packet.h"
+#include "packet_sink.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Teddy is built on any x86-64 target and picked at run time. GCC and Clang
+// only allow the SSSE3 intrinsics in functions compiled for SSSE3, which
+// `_content_ssse3` marks, unless the whole build targets it anyway.
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSSE3__)
+#define _content_teddy 1
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(_content_teddy) && defined(__GNUC__) && !defined(__SSSE3__)
+#define _content_ssse3 __attribute__((target("ssse3")))
+#else
+#define _content_ssse3
+#endif
+
+// Parses a content pattern: literal bytes, with `\xHH` for any byte
+// and `\\` for a backslash.
+inline std::string parse_content_pattern(std::string_view s)
+{
+	auto hex = [&](char c) -> int {
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		return -1;
+	};
+
+	std::string r;
+	for (size_t i = 0; i != s.size(); ++i)
+	{
+		if (s[i] != '\\')
+		{
+			r.push_back(s[i]);
+			continue;
+		}
+
+		if (i + 1 != s.size() && s[i + 1] == '\\')
+		{
+			r.push_back('\\');
+			++i;
+			continue;
+		}
+
+		if (i + 3 >= s.size() || s[i + 1] != 'x' || hex(s[i + 2]) < 0 || hex(s[i + 3]) < 0)
+			throw std::runtime_error("invalid escape in content pattern, expected \\xHH or \\\\");
+
+		r.push_back((char)(hex(s[i + 2]) * 16 + hex(s[i + 3])));
+		i += 3;
+	}
+
+	if (r.empty())
+		throw std::runtime_error("empty content pattern");
+	return r;
+}
+
+// Finds whether a buffer contains any of a set of byte strings.
+//
+// The patterns are compiled into an Aho-Corasick automaton, stored as
+// a DFA over the classes of bytes that occur in the patterns. The states
+// are numbered so that the accepting ones come last; since only the first
+// match matters, the scan is a table lookup and a compare per byte.
+//
+// On CPUs with SSSE3, a Teddy prefilter runs in front of the automaton:
+// the first (up to) three bytes of the patterns, spread over eight buckets,
+// are turned into nibble masks, and `pshufb` tests sixteen positions at once
+// for a byte sequence that could start a pattern of some bucket. The automaton
+// then only runs from the candidate positions, for at most the length of the
+// longest pattern. When the masks would let through too many positions,
+// as with many short or diverse patterns, the prefilter is left out.
+struct content_matcher
+{
+	content_matcher() = default;
+
+	explicit content_matcher(std::vector<std::string> const & patterns, bool use_prefilter = true)
+	{
+		if (patterns.empty())
+			return;
+
+		this->_build_automaton(patterns);
+		this->_build_prefilter(patterns);
+		_use_teddy = use_prefilter && _has_ssse3() && this->_prefilter_pays();
+	}
+
+	bool empty() const noexcept
+	{
+		return _delta.empty();
+	}
+
+	// Whether the Teddy prefilter is used.
+	bool prefiltered() const noexcept
+	{
+		return _use_teddy;
+	}
+
+	bool match(std::span<std::byte const> data) const noexcept
+	{
+		if (_delta.empty())
+			return false;
+
+#ifdef _content_teddy
+		if (_use_teddy)
+		{
+			switch (_teddy_len)
+			{
+			case 1:
+				return this->_teddy<1>(data);
+			case 2:
+				return this->_teddy<2>(data);
+			default:
+				return this->_teddy<3>(data);
+			}
+		}
+#endif
+
+		return this->_scan((uint8_t const *)data.data(), data.size());
+	}
+
+private:
+	static constexpr uint32_t _none = ~(uint32_t)0;
+	static constexpr size_t _buckets = 8;
+
+	static bool _has_ssse3() noexcept
+	{
+#if defined(__SSSE3__)
+		return true;
+#elif defined(_M_X64)
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 9)) != 0;
+#elif defined(_content_teddy)
+		return __builtin_cpu_supports("ssse3");
+#else
+		return false;
+#endif
+	}
+
+	void _build_automaton(std::vector<std::string> const & patterns)
+	{
+		// Bytes that don't occur in any pattern share class zero.
+		_classes = {};
+		_class_count = 1;
+		for (auto const & p: patterns)
+		{
+			for (char ch: p)
+			{
+				uint8_t & c = _classes[(uint8_t)ch];
+				if (c == 0 && _class_count != 256)
+					c = (uint8_t)_class_count++;
+			}
+		}
+
+		// The trie, with the missing transitions left at `_none`.
+		size_t nc = _class_count;
+		std::vector<uint32_t> delta(nc, _none);
+		std::vector<uint8_t> accepting(1, 0);
+		for (auto const & p: patterns)
+		{
+			uint32_t s = 0;
+			for (char ch: p)
+			{
+				uint32_t & t = delta[s * nc + _classes[(uint8_t)ch]];
+				if (t == _none)
+				{
+					t = (uint32_t)accepting.size();
+					accepting.push_back(0);
+					delta.resize(delta.size() + nc, _none);
+				}
+				s = delta[s * nc + _classes[(uint8_t)ch]];
+			}
+
+			accepting[s] = 1;
+			_max_len = (std::max)(_max_len, p.size());
+		}
+
+		// Fill in the failure transitions breadth-first.
+		std::vector<uint32_t> fail(accepting.size(), 0);
+		std::deque<uint32_t> queue;
+		for (size_t c = 0; c != nc; ++c)
+		{
+			uint32_t & t = delta[c];
+			if (t == _none)
+				t = 0;
+			else
+				queue.push_back(t);
+		}
+
+		while (!queue.empty())
+		{
+			uint32_t s = queue.front();
+			queue.pop_front();
+			accepting[s] |= accepting[fail[s]];
+
+			for (size_t c = 0; c != nc; ++c)
+			{
+				uint32_t & t = delta[s * nc + c];
+				uint32_t via_fail = delta[fail[s] * nc + c];
+				if (t == _none)
+				{
+					t = via_fail;
+				}
+				else
+				{
+					fail[t] = via_fail;
+					queue.push_back(t);
+				}
+			}
+		}
+
+		// Renumber the states with the accepting ones last, and drop their
+		// rows, since the scan stops as soon as it reaches one. The entries
+		// are premultiplied by the row size.
+		std::vector<uint32_t> order(accepting.size());
+		uint32_t next = 0;
+		for (uint32_t s = 0; s != accepting.size(); ++s)
+		{
+			if (!accepting[s])
+				order[s] = next++;
+		}
+
+		uint32_t rows = next;
+		for (uint32_t s = 0; s != accepting.size(); ++s)
+		{
+			if (accepting[s])
+				order[s] = next++;
+		}
+
+		_accept = (uint32_t)(rows * nc);
+		_delta.resize(rows * nc);
+		for (uint32_t s = 0; s != accepting.size(); ++s)
+		{
+			if (accepting[s])
+				continue;
+
+			for (size_t c = 0; c != nc; ++c)
+				_delta[order[s] * nc + c] = (uint32_t)(order[delta[s * nc + c]] * nc);
+		}
+	}
+
+	void _build_prefilter(std::vector<std::string> const & patterns)
+	{
+		_teddy_len = 3;
+		for (auto const & p: patterns)
+			_teddy_len = (std::min)(_teddy_len, p.size());
+
+		// Patterns with similar prefixes go to the same bucket, so that
+		// they don't spread their nibbles over all of them.
+		std::vector<std::string const *> sorted;
+		for (auto const & p: patterns)
+			sorted.push_back(&p);
+		std::sort(sorted.begin(), sorted.end(), [](auto a, auto b) { return *a < *b; });
+
+		_lo = {};
+		_hi = {};
+		for (size_t i = 0; i != sorted.size(); ++i)
+		{
+			uint8_t bucket = (uint8_t)(1 << (i * _buckets / sorted.size()));
+			for (size_t j = 0; j != _teddy_len; ++j)
+			{
+				uint8_t b = (uint8_t)(*sorted[i])[j];
+				_lo[j][b & 0xf] |= bucket;
+				_hi[j][b >> 4] |= bucket;
+			}
+		}
+	}
+
+	// Whether the expected work of running the automaton from the candidate
+	// positions of random data stays well under a step per byte.
+	bool _prefilter_pays() const noexcept
+	{
+		double candidates = 0;
+		for (size_t bucket = 0; bucket != _buckets; ++bucket)
+		{
+			double p = 1;
+			for (size_t j = 0; j != _teddy_len; ++j)
+			{
+				size_t pass = 0;
+				for (size_t b = 0; b != 256; ++b)
+					pass += ((_lo[j][b & 0xf] & _hi[j][b >> 4]) >> bucket) & 1;
+				p *= pass / 256.0;
+			}
+			candidates += p;
+		}
+
+		return candidates * (double)_max_len < 0.25;
+	}
+
+	bool _scan(uint8_t const * p, size_t n) const noexcept
+	{
+		uint32_t s = 0;
+		for (size_t i = 0; i != n; ++i)
+		{
+			s = _delta[s + _classes[p[i]]];
+			if (s >= _accept)
+				return true;
+		}
+		return false;
+	}
+
+	// Whether a pattern starts at or shortly after `pos`.
+	bool _verify(uint8_t const * p, size_t n, size_t pos) const noexcept
+	{
+		return this->_scan(p + pos, (std::min)(n - pos, _max_len));
+	}
+
+#ifdef _content_teddy
+	template <size_t K>
+	_content_ssse3 bool _teddy(std::span<std::byte const> data) const noexcept
+	{
+		uint8_t const * p = (uint8_t const *)data.data();
+		size_t n = data.size();
+
+		__m128i const low_nibbles = _mm_set1_epi8(0x0f);
+		__m128i lo[K], hi[K];
+		for (size_t j = 0; j != K; ++j)
+		{
+			lo[j] = _mm_loadu_si128((__m128i const *)_lo[j].data());
+			hi[j] = _mm_loadu_si128((__m128i const *)_hi[j].data());
+		}
+
+		size_t i = 0;
+		for (; i + 16 + K - 1 <= n; i += 16)
+		{
+			// A byte of `res` keeps the buckets whose first K bytes
+			// could start at that position.
+			__m128i res = _mm_set1_epi8(-1);
+			for (size_t j = 0; j != K; ++j)
+			{
+				__m128i v = _mm_loadu_si128((__m128i const *)(p + i + j));
+				__m128i l = _mm_shuffle_epi8(lo[j], _mm_and_si128(v, low_nibbles));
+				__m128i h = _mm_shuffle_epi8(hi[j], _mm_and_si128(_mm_srli_epi16(v, 4), low_nibbles));
+				res = _mm_and_si128(res, _mm_and_si128(l, h));
+			}
+
+			unsigned candidates = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(res, _mm_setzero_si128())) & 0xffff;
+			while (candidates != 0)
+			{
+				if (this->_verify(p, n, i + std::countr_zero(candidates)))
+					return true;
+				candidates &= candidates - 1;
+			}
+		}
+
+		for (; i + K <= n; ++i)
+		{
+			uint8_t m = 0xff;
+			for (size_t j = 0; j != K; ++j)
+				m &= _lo[j][p[i + j] & 0xf] & _hi[j][p[i + j] >> 4];
+
+			if (m != 0 && this->_verify(p, n, i))
+				return true;
+		}
+
+		return false;
+	}
+#endif
+
+	std::array<uint8_t, 256> _classes = {};
+	size_t _class_count = 0;
+	std::vector<uint32_t> _delta;
+	uint32_t _accept = 0;
+	size_t _max_len = 0;
+
+	bool _use_teddy = false;
+	size_t _teddy_len = 0;
+	std::array<std::array<uint8_t, 16>, 3> _lo = {};
+	std::array<std::array<uint8_t, 16>, 3> _hi = {};
+};
+
+// Only passes on the packets whose payload contains one of the patterns.
+//
+// The L4 payload is searched, or the whole packet if its headers can't be
+// decoded. With `whole_flows`, a match lets through the rest of the flow
+// in both directions as well, until it has been idle for a minute; the
+// packets of the flow before the match are not recovered.
+struct content_filter final
+	: packet_sink
+{
+	static constexpr uint64_t flow_idle_timeout = 60'000'000;
+
+	content_filter(std::shared_ptr<packet_sink> sink, content_matcher matcher, bool whole_flows)
+		: _sink(std::move(sink)), _matcher(std::move(matcher)), _whole_flows(whole_flows)
+	{
+	}
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		_if_types.push_back(intf.link_type);
+		return _sink->add_interface(intf);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) override
+	{
+		decode_packet(_if_types[ifidx], payload, _pkt);
+
+		_flow_key key;
+		bool is_flow = _whole_flows && _pkt.ip_version != 0 && !_pkt.ip_fragment && _pkt.l4_offset != decoded_packet::npos;
+		if (is_flow)
+		{
+			if (timestamp >= _next_expiry)
+				this->_expire(timestamp);
+
+			key = _flow_key::of(_pkt);
+			auto it = _flows.find(key);
+			if (it != _flows.end())
+			{
+				it->second = timestamp;
+				_sink->add_packet(ifidx, timestamp, payload, full_length, flags);
+				return;
+			}
+		}
+
+		std::span<std::byte const> content = _pkt.payload_offset != decoded_packet::npos? _pkt.payload(): payload;
+		if (!_matcher.match(content))
+			return;
+
+		if (is_flow)
+			_flows.emplace(key, timestamp);
+		_sink->add_packet(ifidx, timestamp, payload, full_length, flags);
+	}
+
+	void flush() override
+	{
+		_sink->flush();
+	}
+
+	void tick() override
+	{
+		_sink->tick();
+	}
+
+private:
+	// The addresses and ports of both directions of a flow, in a fixed
+	// order. The layout has no padding, so the bytes can be hashed.
+	struct _flow_key
+	{
+		std::array<uint8_t, 16> ip_a = {};
+		std::array<uint8_t, 16> ip_b = {};
+		uint16_t port_a = 0;
+		uint16_t port_b = 0;
+		uint8_t ip_version = 0;
+		uint8_t ip_proto = 0;
+		uint16_t reserved = 0;
+
+		static _flow_key of(decoded_packet const & pkt) noexcept
+		{
+			_flow_key r;
+			r.ip_version = pkt.ip_version;
+			r.ip_proto = pkt.ip_proto;
+
+			int cmp = memcmp(pkt.src_ip.data(), pkt.dst_ip.data(), pkt.src_ip.size());
+			bool swap = cmp > 0 || (cmp == 0 && pkt.src_port > pkt.dst_port);
+			r.ip_a = swap? pkt.dst_ip: pkt.src_ip;
+			r.ip_b = swap? pkt.src_ip: pkt.dst_ip;
+			r.port_a = swap? pkt.dst_port: pkt.src_port;
+			r.port_b = swap? pkt.src_port: pkt.dst_port;
+			return r;
+		}
+
+		bool operator==(_flow_key const &) const = default;
+	};
+
+	struct _key_hash
+	{
+		size_t operator()(_flow_key const & key) const noexcept
+		{
+			return std::hash<std::string_view>()({ (char const *)&key, sizeof key });
+		}
+	};
+
+	void _expire(uint64_t timestamp)
+	{
+		_next_expiry = timestamp + 1'000'000;
+		std::erase_if(_flows, [&](auto const & flow) { return timestamp - flow.second >= flow_idle_timeout; });
+	}
+
+	std::shared_ptr<packet_sink> _sink;
+	content_matcher _matcher;
+	bool _whole_flows;
+
+	// The matched flows, with the time they were last seen.
+	std::unordered_map<_flow_key, uint64_t, _key_hash> _flows;
+	uint64_t _next_expiry = 0;
+
+	std::vector<uint16_t> _if_types;
+	decoded_packet _pkt;
+};
@@ -0,0 +1,54 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <windows.h>
+
+// Calls the callback on a background thread every time
+// the named event is set, e.g. by another process.
+struct named_event_listener
+{
+	named_event_listener(std::wstring const & name, std::function<void()> cb)
+		: _cb(std::move(cb))
+	{
+		_event = CreateEventW(nullptr, FALSE, FALSE, name.c_str());
+		if (!_event)
+			throw std::system_error(GetLastError(), std::system_category());
+
+		_stop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		if (!_stop)
+		{
+			DWORD err = GetLastError();
+			CloseHandle(_event);
+			throw std::system_error(err, std::system_category());
+		}
+
+		_thread = std::thread([this] { this->_run(); });
+	}
+
+	~named_event_listener()
+	{
+		SetEvent(_stop);
+		_thread.join();
+		CloseHandle(_stop);
+		CloseHandle(_event);
+	}
+
+	named_event_listener(named_event_listener const &) = delete;
+	named_event_listener & operator=(named_event_listener const &) = delete;
+
+private:
+	void _run()
+	{
+		HANDLE handles[] = { _stop, _event };
+		while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+			_cb();
+	}
+
+	std::function<void()> _cb;
+	HANDLE _event;
+	HANDLE _stop;
+	std::thread _thread;
+};
@@ -0,0 +1,94 @@
+#pragma once
+#include "filter.h"
+#include "packet.h"
+#include "packet_sink.h"
+
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <vector>
+
+// One of the outputs of a `packet_fanout`.
+struct fanout_output
+{
+	std::shared_ptr<packet_sink> sink;
+
+	// Only the packets matching the filter are passed on.
+	packet_filter filter = {};
+
+	// Packets are truncated to the snaplen. With `headers_only`, they
+	// are also truncated to the end of the last decoded header.
+	size_t snaplen = ~(size_t)0;
+	bool headers_only = false;
+};
+
+// Passes each packet to several outputs.
+//
+// The packet is decoded once and the decoded headers are matched against
+// the filters of all outputs. The outputs get views of the same payload;
+// nothing is copied. Packets not matching the capture filter are dropped
+// before any output sees them.
+struct packet_fanout final
+	: packet_sink
+{
+	packet_fanout(packet_filter capture_filter, std::vector<fanout_output> outputs)
+		: _filter(std::move(capture_filter)), _outputs(std::move(outputs))
+	{
+	}
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		std::vector<uint32_t> ifidxs;
+		for (auto & out: _outputs)
+		{
+			capture_interface local = intf;
+			local.snaplen = (std::min)(intf.snaplen, out.snaplen);
+			ifidxs.push_back(out.sink->add_interface(local));
+		}
+
+		_if_types.push_back(intf.link_type);
+		_ifidxs.push_back(std::move(ifidxs));
+		return (uint32_t)(_if_types.size() - 1);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) override
+	{
+		decode_packet(_if_types[ifidx], payload, _pkt);
+		if (!_filter.empty() && !_filter.match(_pkt, full_length))
+			return;
+
+		std::vector<uint32_t> const & ifidxs = _ifidxs[ifidx];
+		for (size_t i = 0; i != _outputs.size(); ++i)
+		{
+			fanout_output & out = _outputs[i];
+			if (!out.filter.empty() && !out.filter.match(_pkt, full_length))
+				continue;
+
+			size_t len = (std::min)(payload.size(), out.snaplen);
+			if (out.headers_only)
+				len = (std::min)(len, _pkt.header_length());
+
+			out.sink->add_packet(ifidxs[i], timestamp, payload.first(len), full_length, flags);
+		}
+	}
+
+	void flush() override
+	{
+		for (auto & out: _outputs)
+			out.sink->flush();
+	}
+
+	void tick() override
+	{
+		for (auto & out: _outputs)
+			out.sink->tick();
+	}
+
+private:
+	packet_filter _filter;
+	std::vector<fanout_output> _outputs;
+
+	std::vector<uint16_t> _if_types;
+	std::vector<std::vector<uint32_t>> _ifidxs;
+	decoded_packet _pkt;
+};
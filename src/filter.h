@@ -0,0 +1,1162 @@
+#pragma once
+#include "packet.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <span>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Parses an IPv4 or IPv6 address literal. Returns the number
+// of address bytes (4 or 16), or 0 if `s` isn't an address.
+inline size_t parse_ip_address(std::string_view s, std::array<uint8_t, 16> & out) noexcept
+{
+	out = {};
+
+	if (s.find(':') == std::string_view::npos)
+	{
+		size_t i = 0;
+		for (size_t part = 0; part != 4; ++part)
+		{
+			if (part != 0)
+			{
+				if (i == s.size() || s[i] != '.')
+					return 0;
+				++i;
+			}
+
+			uint32_t v = 0;
+			size_t digits = 0;
+			while (i != s.size() && s[i] >= '0' && s[i] <= '9' && digits < 4)
+			{
+				v = v * 10 + (s[i++] - '0');
+				++digits;
+			}
+
+			if (digits == 0 || v > 255)
+				return 0;
+			out[part] = (uint8_t)v;
+		}
+
+		return i == s.size()? 4: 0;
+	}
+
+	std::array<uint16_t, 8> groups = {};
+	size_t count = 0;
+	size_t gap = ~(size_t)0;
+
+	size_t i = 0;
+	if (s.starts_with("::"))
+	{
+		gap = 0;
+		i = 2;
+	}
+
+	while (i != s.size())
+	{
+		if (count == 8)
+			return 0;
+
+		// An embedded IPv4 address at the end.
+		std::string_view rest = s.substr(i);
+		if (rest.find(':') == std::string_view::npos && rest.find('.') != std::string_view::npos)
+		{
+			std::array<uint8_t, 16> v4;
+			if (count > 6 || parse_ip_address(rest, v4) != 4)
+				return 0;
+			groups[count++] = (uint16_t)((v4[0] << 8) | v4[1]);
+			groups[count++] = (uint16_t)((v4[2] << 8) | v4[3]);
+			i = s.size();
+			break;
+		}
+
+		uint32_t v = 0;
+		size_t digits = 0;
+		for (; i != s.size() && digits < 5; ++i, ++digits)
+		{
+			char ch = s[i];
+			if (ch >= '0' && ch <= '9')
+				v = v * 16 + (ch - '0');
+			else if (ch >= 'a' && ch <= 'f')
+				v = v * 16 + (ch - 'a' + 10);
+			else if (ch >= 'A' && ch <= 'F')
+				v = v * 16 + (ch - 'A' + 10);
+			else
+				break;
+		}
+
+		if (digits == 0 || v > 0xffff)
+			return 0;
+		groups[count++] = (uint16_t)v;
+
+		if (i == s.size())
+			break;
+		if (s[i] != ':')
+			return 0;
+		++i;
+
+		if (i != s.size() && s[i] == ':')
+		{
+			if (gap != ~(size_t)0)
+				return 0;
+			gap = count;
+			++i;
+		}
+		else if (i == s.size())
+		{
+			return 0;
+		}
+	}
+
+	if (gap == ~(size_t)0)
+	{
+		if (count != 8)
+			return 0;
+	}
+	else
+	{
+		if (count == 8)
+			return 0;
+
+		size_t tail = count - gap;
+		std::copy_backward(groups.begin() + gap, groups.begin() + count, groups.end());
+		std::fill(groups.begin() + gap, groups.end() - tail, 0);
+	}
+
+	for (size_t g = 0; g != 8; ++g)
+	{
+		out[g * 2] = (uint8_t)(groups[g] >> 8);
+		out[g * 2 + 1] = (uint8_t)groups[g];
+	}
+
+	return 16;
+}
+
+inline bool parse_mac_address(std::string_view s, std::array<uint8_t, 6> & out) noexcept
+{
+	if (s.size() != 17)
+		return false;
+
+	for (size_t i = 0; i != 6; ++i)
+	{
+		if (i != 0 && s[i * 3 - 1] != ':' && s[i * 3 - 1] != '-')
+			return false;
+
+		uint8_t v = 0;
+		for (size_t j = 0; j != 2; ++j)
+		{
+			char ch = s[i * 3 + j];
+			if (ch >= '0' && ch <= '9')
+				v = (uint8_t)(v * 16 + (ch - '0'));
+			else if (ch >= 'a' && ch <= 'f')
+				v = (uint8_t)(v * 16 + (ch - 'a' + 10));
+			else if (ch >= 'A' && ch <= 'F')
+				v = (uint8_t)(v * 16 + (ch - 'A' + 10));
+			else
+				return false;
+		}
+
+		out[i] = v;
+	}
+
+	return true;
+}
+
+// A compiled packet filter expression.
+//
+// Supports a subset of the tcpdump filter language: the protocols `ether`,
+// `ip`, `ip6`, `arp`, `tcp`, `udp`, `icmp`, `icmp6` and `vlan [ID]`,
+// `[src|dst] host ADDR`, `[src|dst] net ADDR/LEN`, `[tcp|udp] [src|dst] port N`,
+// `portrange N-M`, `ether [src|dst] host MAC`, `less N`, `greater N`,
+// the boolean operators and arithmetic relations over packet data such as
+// `tcp[tcpflags] & tcp-rst != 0`.
+//
+// Compiling throws `std::runtime_error`; matching never allocates or throws.
+struct packet_filter
+{
+	// The empty filter, which matches all packets.
+	packet_filter() = default;
+
+	static packet_filter compile(std::string_view expr)
+	{
+		packet_filter r;
+
+		_parser p(r, expr);
+		if (!p.at_end())
+			r._root = p.parse_expr();
+
+		if (!p.at_end())
+			throw std::runtime_error("invalid filter expression: unexpected '" + std::string(p.peek()) + "'");
+
+		return r;
+	}
+
+	bool empty() const noexcept
+	{
+		return _nodes.empty();
+	}
+
+	bool match(decoded_packet const & pkt, size_t full_length) const noexcept
+	{
+		return _nodes.empty() || this->_eval(_root, pkt, full_length);
+	}
+
+	bool match(uint16_t link_type, std::span<std::byte const> data, size_t full_length) const noexcept
+	{
+		if (_nodes.empty())
+			return true;
+
+		decoded_packet pkt;
+		decode_packet(link_type, data, pkt);
+		return this->_eval(_root, pkt, full_length);
+	}
+
+	// Finds an IP address that all matching packets must have as their
+	// source or destination, which lets an index rule out whole runs.
+	bool required_host(std::array<uint8_t, 16> & addr, size_t & len) const noexcept
+	{
+		return !_nodes.empty() && this->_required_host(_root, addr, len);
+	}
+
+private:
+	enum class _op: uint8_t
+	{
+		// boolean
+		and_,
+		or_,
+		not_,
+		ethertype,
+		ip_proto,
+		vlan,
+		host,
+		net,
+		port,
+		ether_host,
+		less,
+		greater,
+		relation,
+
+		// arithmetic
+		constant,
+		length,
+		load,
+		add,
+		sub,
+		mul,
+		div,
+		mod,
+		band,
+		bor,
+		bxor,
+		shl,
+		shr,
+		neg,
+	};
+
+	enum: uint8_t
+	{
+		_dir_src = 1,
+		_dir_dst = 2,
+		_dir_any = 3,
+		_dir_both = 7,
+	};
+
+	enum: uint8_t
+	{
+		_layer_ether,
+		_layer_ip,
+		_layer_ip6,
+		_layer_arp,
+		_layer_tcp,
+		_layer_udp,
+		_layer_icmp,
+		_layer_icmp6,
+	};
+
+	enum: uint8_t
+	{
+		_rel_eq,
+		_rel_ne,
+		_rel_lt,
+		_rel_le,
+		_rel_gt,
+		_rel_ge,
+	};
+
+	struct _node
+	{
+		_op op;
+		uint8_t dir = 0;
+		uint8_t sub = 0;
+		uint8_t addr_len = 0;
+		uint32_t a = 0;
+		uint32_t b = 0;
+		uint32_t value = 0;
+		uint32_t value2 = 0;
+		std::array<uint8_t, 16> addr = {};
+	};
+
+	bool _required_host(uint32_t idx, std::array<uint8_t, 16> & addr, size_t & len) const noexcept
+	{
+		_node const & n = _nodes[idx];
+		if (n.op == _op::and_)
+			return this->_required_host(n.a, addr, len) || this->_required_host(n.b, addr, len);
+
+		if (n.op != _op::host)
+			return false;
+
+		addr = n.addr;
+		len = n.addr_len;
+		return true;
+	}
+
+	static bool _addr_match(_node const & n, uint8_t const * addr) noexcept
+	{
+		if (n.op == _op::host)
+			return memcmp(addr, n.addr.data(), n.addr_len) == 0;
+
+		uint32_t prefix = n.value;
+		size_t full = prefix / 8;
+		if (memcmp(addr, n.addr.data(), full) != 0)
+			return false;
+		if (prefix % 8 == 0)
+			return true;
+
+		uint8_t mask = (uint8_t)(0xff00 >> (prefix % 8));
+		return (addr[full] & mask) == (n.addr[full] & mask);
+	}
+
+	static bool _dir_match(uint8_t dir, bool src, bool dst) noexcept
+	{
+		switch (dir)
+		{
+		case _dir_src:
+			return src;
+		case _dir_dst:
+			return dst;
+		case _dir_both:
+			return src && dst;
+		default:
+			return src || dst;
+		}
+	}
+
+	bool _eval(uint32_t idx, decoded_packet const & pkt, size_t full_length) const noexcept
+	{
+		_node const & n = _nodes[idx];
+		switch (n.op)
+		{
+		case _op::and_:
+			return this->_eval(n.a, pkt, full_length) && this->_eval(n.b, pkt, full_length);
+		case _op::or_:
+			return this->_eval(n.a, pkt, full_length) || this->_eval(n.b, pkt, full_length);
+		case _op::not_:
+			return !this->_eval(n.a, pkt, full_length);
+
+		case _op::ethertype:
+			return pkt.l3_offset != decoded_packet::npos && pkt.ethertype == n.value;
+
+		case _op::ip_proto:
+			return pkt.ip_version != 0 && pkt.ip_proto == n.value
+				&& (n.value2 == 0 || pkt.ip_version == n.value2);
+
+		case _op::vlan:
+			return pkt.has_vlan && (n.value2 == 0 || pkt.vlan_id == n.value);
+
+		case _op::host:
+		case _op::net:
+			if (pkt.ip_addr_size() != n.addr_len)
+				return false;
+			return _dir_match(n.dir, _addr_match(n, pkt.src_ip.data()), _addr_match(n, pkt.dst_ip.data()));
+
+		case _op::port:
+			if (pkt.l4_offset == decoded_packet::npos
+				|| (pkt.ip_proto != ip_proto_tcp && pkt.ip_proto != ip_proto_udp)
+				|| (n.sub != 0 && pkt.ip_proto != n.sub))
+			{
+				return false;
+			}
+
+			return _dir_match(n.dir,
+				pkt.src_port >= n.value && pkt.src_port <= n.value2,
+				pkt.dst_port >= n.value && pkt.dst_port <= n.value2);
+
+		case _op::ether_host:
+			if (pkt.l2_offset == decoded_packet::npos)
+				return false;
+			return _dir_match(n.dir,
+				memcmp(pkt.src_mac.data(), n.addr.data(), 6) == 0,
+				memcmp(pkt.dst_mac.data(), n.addr.data(), 6) == 0);
+
+		case _op::less:
+			return full_length <= n.value;
+		case _op::greater:
+			return full_length >= n.value;
+
+		case _op::relation:
+		{
+			uint32_t lhs, rhs;
+			if (!this->_arith(n.a, pkt, full_length, lhs) || !this->_arith(n.b, pkt, full_length, rhs))
+				return false;
+
+			switch (n.sub)
+			{
+			case _rel_eq:
+				return lhs == rhs;
+			case _rel_ne:
+				return lhs != rhs;
+			case _rel_lt:
+				return lhs < rhs;
+			case _rel_le:
+				return lhs <= rhs;
+			case _rel_gt:
+				return lhs > rhs;
+			default:
+				return lhs >= rhs;
+			}
+		}
+
+		default:
+			return false;
+		}
+	}
+
+	static size_t _layer_offset(uint8_t layer, decoded_packet const & pkt) noexcept
+	{
+		switch (layer)
+		{
+		case _layer_ether:
+			return pkt.l2_offset;
+		case _layer_ip:
+			return pkt.ip_version == 4? pkt.l3_offset: decoded_packet::npos;
+		case _layer_ip6:
+			return pkt.ip_version == 6? pkt.l3_offset: decoded_packet::npos;
+		case _layer_arp:
+			return pkt.ethertype == ethertype_arp? pkt.l3_offset: decoded_packet::npos;
+		case _layer_tcp:
+			return pkt.ip_proto == ip_proto_tcp? pkt.l4_offset: decoded_packet::npos;
+		case _layer_udp:
+			return pkt.ip_proto == ip_proto_udp? pkt.l4_offset: decoded_packet::npos;
+		case _layer_icmp:
+			return pkt.ip_proto == ip_proto_icmp? pkt.l4_offset: decoded_packet::npos;
+		case _layer_icmp6:
+			return pkt.ip_proto == ip_proto_icmpv6? pkt.l4_offset: decoded_packet::npos;
+		default:
+			return decoded_packet::npos;
+		}
+	}
+
+	bool _arith(uint32_t idx, decoded_packet const & pkt, size_t full_length, uint32_t & out) const noexcept
+	{
+		_node const & n = _nodes[idx];
+		switch (n.op)
+		{
+		case _op::constant:
+			out = n.value;
+			return true;
+
+		case _op::length:
+			out = (uint32_t)full_length;
+			return true;
+
+		case _op::load:
+		{
+			size_t base = _layer_offset(n.sub, pkt);
+			uint32_t off;
+			if (base == decoded_packet::npos || !this->_arith(n.a, pkt, full_length, off))
+				return false;
+
+			size_t pos = base + off;
+			if (pos < base || pos > pkt.data.size() || pkt.data.size() - pos < n.value)
+				return false;
+
+			std::byte const * p = pkt.data.data() + pos;
+			out = n.value == 1? (uint32_t)p[0]: n.value == 2? load_be16(p): load_be32(p);
+			return true;
+		}
+
+		case _op::neg:
+			if (!this->_arith(n.a, pkt, full_length, out))
+				return false;
+			out = 0 - out;
+			return true;
+
+		default:
+			break;
+		}
+
+		uint32_t lhs, rhs;
+		if (!this->_arith(n.a, pkt, full_length, lhs) || !this->_arith(n.b, pkt, full_length, rhs))
+			return false;
+
+		switch (n.op)
+		{
+		case _op::add:
+			out = lhs + rhs;
+			return true;
+		case _op::sub:
+			out = lhs - rhs;
+			return true;
+		case _op::mul:
+			out = lhs * rhs;
+			return true;
+		case _op::div:
+			if (rhs == 0)
+				return false;
+			out = lhs / rhs;
+			return true;
+		case _op::mod:
+			if (rhs == 0)
+				return false;
+			out = lhs % rhs;
+			return true;
+		case _op::band:
+			out = lhs & rhs;
+			return true;
+		case _op::bor:
+			out = lhs | rhs;
+			return true;
+		case _op::bxor:
+			out = lhs ^ rhs;
+			return true;
+		case _op::shl:
+			out = rhs < 32? lhs << rhs: 0;
+			return true;
+		case _op::shr:
+			out = rhs < 32? lhs >> rhs: 0;
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	struct _syntax_error
+	{
+	};
+
+	struct _parser
+	{
+		_parser(packet_filter & f, std::string_view expr)
+			: _f(f)
+		{
+			_tokenize(expr);
+		}
+
+		bool at_end() const noexcept
+		{
+			return _pos == _tokens.size();
+		}
+
+		std::string_view peek() const noexcept
+		{
+			return at_end()? std::string_view(): std::string_view(_tokens[_pos]);
+		}
+
+		uint32_t parse_expr()
+		{
+			try
+			{
+				return this->_parse_or();
+			}
+			catch (_syntax_error const &)
+			{
+				if (at_end())
+					throw std::runtime_error("invalid filter expression: unexpected end");
+				throw std::runtime_error("invalid filter expression: unexpected '" + std::string(peek()) + "'");
+			}
+		}
+
+	private:
+		static bool _is_word_char(char ch) noexcept
+		{
+			return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_' || ch == '.';
+		}
+
+		static bool _is_alpha(char ch) noexcept
+		{
+			return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+		}
+
+		void _tokenize(std::string_view s)
+		{
+			size_t bracket_depth = 0;
+			size_t i = 0;
+			while (i != s.size())
+			{
+				char ch = s[i];
+				if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n')
+				{
+					++i;
+					continue;
+				}
+
+				// Outside of `proto[off:size]`, colons belong to MAC and IPv6 addresses.
+				bool colon_in_word = bracket_depth == 0;
+				if (_is_word_char(ch) || (ch == ':' && colon_in_word))
+				{
+					size_t start = i;
+					bool alpha_only = true;
+					while (i != s.size())
+					{
+						char c = s[i];
+						if (_is_word_char(c) || (c == ':' && colon_in_word))
+						{
+							alpha_only = alpha_only && _is_alpha(c);
+							++i;
+						}
+						else if (c == '-' && alpha_only && i + 1 != s.size() && _is_alpha(s[i + 1]))
+						{
+							// Keywords such as `tcp-rst` and `icmp-echo`.
+							++i;
+						}
+						else
+						{
+							break;
+						}
+					}
+
+					_tokens.emplace_back(s.substr(start, i - start));
+					continue;
+				}
+
+				static constexpr std::string_view two_char_ops[] = { "&&", "||", "!=", "==", "<=", ">=", "<<", ">>" };
+
+				bool found = false;
+				for (std::string_view op: two_char_ops)
+				{
+					if (s.substr(i).starts_with(op))
+					{
+						_tokens.emplace_back(op);
+						i += 2;
+						found = true;
+						break;
+					}
+				}
+
+				if (found)
+					continue;
+
+				if (std::string_view("()[]:&|^+-*/%!=<>").find(ch) == std::string_view::npos)
+					throw std::runtime_error(std::string("invalid filter expression: unexpected character '") + ch + "'");
+
+				if (ch == '[')
+					++bracket_depth;
+				else if (ch == ']' && bracket_depth != 0)
+					--bracket_depth;
+
+				_tokens.emplace_back(1, ch);
+				++i;
+			}
+		}
+
+		bool _accept(std::string_view tok)
+		{
+			if (!at_end() && _tokens[_pos] == tok)
+			{
+				++_pos;
+				return true;
+			}
+
+			return false;
+		}
+
+		void _expect(std::string_view tok)
+		{
+			if (!this->_accept(tok))
+				throw _syntax_error();
+		}
+
+		std::string_view _next()
+		{
+			if (at_end())
+				throw _syntax_error();
+			return _tokens[_pos++];
+		}
+
+		uint32_t _add(_node n)
+		{
+			_f._nodes.push_back(n);
+			return (uint32_t)(_f._nodes.size() - 1);
+		}
+
+		uint32_t _add(_op op, uint32_t a, uint32_t b = 0)
+		{
+			return this->_add(_node{ .op = op, .a = a, .b = b });
+		}
+
+		static bool _parse_number(std::string_view s, uint32_t & out) noexcept
+		{
+			uint64_t v = 0;
+			uint32_t base = 10;
+			if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+			{
+				base = 16;
+				s = s.substr(2);
+			}
+
+			if (s.empty())
+				return false;
+
+			for (char ch: s)
+			{
+				uint32_t d;
+				if (ch >= '0' && ch <= '9')
+					d = ch - '0';
+				else if (base == 16 && ch >= 'a' && ch <= 'f')
+					d = ch - 'a' + 10;
+				else if (base == 16 && ch >= 'A' && ch <= 'F')
+					d = ch - 'A' + 10;
+				else
+					return false;
+
+				v = v * base + d;
+				if (v > 0xffff'ffff)
+					return false;
+			}
+
+			out = (uint32_t)v;
+			return true;
+		}
+
+		uint32_t _number()
+		{
+			uint32_t v;
+			if (!_parse_number(this->_next(), v))
+				throw _syntax_error();
+			return v;
+		}
+
+		uint32_t _parse_or()
+		{
+			uint32_t r = this->_parse_and();
+			while (this->_accept("or") || this->_accept("||"))
+				r = this->_add(_op::or_, r, this->_parse_and());
+			return r;
+		}
+
+		uint32_t _parse_and()
+		{
+			uint32_t r = this->_parse_not();
+			while (this->_accept("and") || this->_accept("&&"))
+				r = this->_add(_op::and_, r, this->_parse_not());
+			return r;
+		}
+
+		uint32_t _parse_not()
+		{
+			if (this->_accept("not") || this->_accept("!"))
+				return this->_add(_op::not_, this->_parse_not());
+
+			// A relation can also start with a parenthesis or a protocol name,
+			// so try that first and fall back to a primitive.
+			size_t saved_pos = _pos;
+			size_t saved_nodes = _f._nodes.size();
+			try
+			{
+				return this->_parse_relation();
+			}
+			catch (_syntax_error const &)
+			{
+				_pos = saved_pos;
+				_f._nodes.resize(saved_nodes);
+			}
+
+			if (this->_accept("("))
+			{
+				uint32_t r = this->_parse_or();
+				this->_expect(")");
+				return r;
+			}
+
+			return this->_parse_primitive();
+		}
+
+		uint32_t _parse_relation()
+		{
+			uint32_t lhs = this->_parse_arith();
+
+			static constexpr std::string_view rel_ops[] = { "=", "!=", "<", "<=", ">", ">=" };
+			static constexpr uint8_t rel_codes[] = { _rel_eq, _rel_ne, _rel_lt, _rel_le, _rel_gt, _rel_ge };
+
+			uint8_t rel;
+			std::string_view tok = this->_next();
+			if (tok == "==")
+			{
+				rel = _rel_eq;
+			}
+			else
+			{
+				size_t i = 0;
+				while (i != std::size(rel_ops) && rel_ops[i] != tok)
+					++i;
+				if (i == std::size(rel_ops))
+					throw _syntax_error();
+				rel = rel_codes[i];
+			}
+
+			uint32_t rhs = this->_parse_arith();
+			uint32_t r = this->_add(_op::relation, lhs, rhs);
+			_f._nodes[r].sub = rel;
+			return r;
+		}
+
+		uint32_t _parse_binary(uint32_t (_parser::*next)(), std::initializer_list<std::pair<std::string_view, _op>> ops)
+		{
+			uint32_t r = (this->*next)();
+			for (;;)
+			{
+				bool found = false;
+				for (auto const & [tok, op]: ops)
+				{
+					if (this->_accept(tok))
+					{
+						r = this->_add(op, r, (this->*next)());
+						found = true;
+						break;
+					}
+				}
+
+				if (!found)
+					return r;
+			}
+		}
+
+		uint32_t _parse_arith()
+		{
+			return this->_parse_binary(&_parser::_parse_bxor, { { "|", _op::bor } });
+		}
+
+		uint32_t _parse_bxor()
+		{
+			return this->_parse_binary(&_parser::_parse_band, { { "^", _op::bxor } });
+		}
+
+		uint32_t _parse_band()
+		{
+			return this->_parse_binary(&_parser::_parse_shift, { { "&", _op::band } });
+		}
+
+		uint32_t _parse_shift()
+		{
+			return this->_parse_binary(&_parser::_parse_sum, { { "<<", _op::shl }, { ">>", _op::shr } });
+		}
+
+		uint32_t _parse_sum()
+		{
+			return this->_parse_binary(&_parser::_parse_product, { { "+", _op::add }, { "-", _op::sub } });
+		}
+
+		uint32_t _parse_product()
+		{
+			return this->_parse_binary(&_parser::_parse_unary, { { "*", _op::mul }, { "/", _op::div }, { "%", _op::mod } });
+		}
+
+		uint32_t _parse_unary()
+		{
+			if (this->_accept("-"))
+				return this->_add(_op::neg, this->_parse_unary());
+			return this->_parse_atom();
+		}
+
+		static bool _layer_from_name(std::string_view name, uint8_t & layer) noexcept
+		{
+			static constexpr std::pair<std::string_view, uint8_t> layers[] = {
+				{ "ether", _layer_ether },
+				{ "ip", _layer_ip },
+				{ "ip6", _layer_ip6 },
+				{ "arp", _layer_arp },
+				{ "tcp", _layer_tcp },
+				{ "udp", _layer_udp },
+				{ "icmp", _layer_icmp },
+				{ "icmp6", _layer_icmp6 },
+			};
+
+			for (auto const & [n, l]: layers)
+			{
+				if (n == name)
+				{
+					layer = l;
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		static bool _named_constant(std::string_view name, uint32_t & value) noexcept
+		{
+			static constexpr std::pair<std::string_view, uint32_t> constants[] = {
+				{ "tcpflags", 13 },
+				{ "tcp-fin", tcp_fin },
+				{ "tcp-syn", tcp_syn },
+				{ "tcp-rst", tcp_rst },
+				{ "tcp-push", tcp_push },
+				{ "tcp-ack", tcp_ack },
+				{ "tcp-urg", tcp_urg },
+				{ "tcp-ece", tcp_ece },
+				{ "tcp-cwr", tcp_cwr },
+				{ "icmptype", 0 },
+				{ "icmpcode", 1 },
+				{ "icmp-echoreply", 0 },
+				{ "icmp-unreach", 3 },
+				{ "icmp-sourcequench", 4 },
+				{ "icmp-redirect", 5 },
+				{ "icmp-echo", 8 },
+				{ "icmp-routeradvert", 9 },
+				{ "icmp-routersolicit", 10 },
+				{ "icmp-timxceed", 11 },
+				{ "icmp-paramprob", 12 },
+				{ "icmp6type", 0 },
+				{ "icmp6code", 1 },
+			};
+
+			for (auto const & [n, v]: constants)
+			{
+				if (n == name)
+				{
+					value = v;
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		uint32_t _parse_atom()
+		{
+			if (this->_accept("("))
+			{
+				uint32_t r = this->_parse_arith();
+				this->_expect(")");
+				return r;
+			}
+
+			std::string_view tok = this->_next();
+			if (tok == "len")
+				return this->_add(_node{ .op = _op::length });
+
+			uint8_t layer;
+			if (_layer_from_name(tok, layer))
+			{
+				this->_expect("[");
+				uint32_t off = this->_parse_arith();
+				uint32_t size = 1;
+				if (this->_accept(":"))
+				{
+					size = this->_number();
+					if (size != 1 && size != 2 && size != 4)
+						throw std::runtime_error("invalid filter expression: data size must be 1, 2 or 4");
+				}
+				this->_expect("]");
+
+				return this->_add(_node{ .op = _op::load, .sub = layer, .a = off, .value = size });
+			}
+
+			uint32_t value;
+			if (_named_constant(tok, value) || _parse_number(tok, value))
+				return this->_add(_node{ .op = _op::constant, .value = value });
+
+			throw _syntax_error();
+		}
+
+		uint8_t _parse_dir()
+		{
+			if (this->_accept("src"))
+			{
+				if (this->_accept("or"))
+				{
+					this->_expect("dst");
+					return _dir_any;
+				}
+
+				if (this->_accept("and"))
+				{
+					this->_expect("dst");
+					return _dir_both;
+				}
+
+				return _dir_src;
+			}
+
+			if (this->_accept("dst"))
+				return _dir_dst;
+
+			return _dir_any;
+		}
+
+		uint32_t _parse_host(uint8_t dir, uint8_t ip_version)
+		{
+			_node n = { .op = _op::host, .dir = dir };
+			std::string_view tok = this->_next();
+			n.addr_len = (uint8_t)parse_ip_address(tok, n.addr);
+			if (n.addr_len == 0)
+				throw std::runtime_error("invalid filter expression: '" + std::string(tok) + "' is not an IP address");
+			if (ip_version != 0 && n.addr_len != (ip_version == 4? 4: 16))
+				throw std::runtime_error("invalid filter expression: address family mismatch for '" + std::string(tok) + "'");
+			return this->_add(n);
+		}
+
+		uint32_t _parse_net(uint8_t dir)
+		{
+			_node n = { .op = _op::net, .dir = dir };
+			std::string_view tok = this->_next();
+			n.addr_len = (uint8_t)parse_ip_address(tok, n.addr);
+			if (n.addr_len == 0)
+				throw std::runtime_error("invalid filter expression: '" + std::string(tok) + "' is not an IP address");
+
+			n.value = n.addr_len * 8;
+			if (this->_accept("/"))
+			{
+				n.value = this->_number();
+				if (n.value > n.addr_len * 8u)
+					throw std::runtime_error("invalid filter expression: invalid prefix length");
+			}
+			else if (this->_accept("mask"))
+			{
+				std::array<uint8_t, 16> mask;
+				std::string_view mask_tok = this->_next();
+				if (parse_ip_address(mask_tok, mask) != n.addr_len)
+					throw std::runtime_error("invalid filter expression: invalid mask '" + std::string(mask_tok) + "'");
+
+				n.value = 0;
+				while (n.value < n.addr_len * 8u && (mask[n.value / 8] & (0x80 >> (n.value % 8))))
+					++n.value;
+			}
+
+			return this->_add(n);
+		}
+
+		uint32_t _parse_port(uint8_t dir, uint8_t proto, bool range)
+		{
+			_node n = { .op = _op::port, .dir = dir, .sub = proto };
+			n.value = this->_number();
+			n.value2 = n.value;
+			if (range)
+			{
+				this->_expect("-");
+				n.value2 = this->_number();
+			}
+
+			if (n.value > 0xffff || n.value2 > 0xffff || n.value > n.value2)
+				throw std::runtime_error("invalid filter expression: invalid port");
+
+			return this->_add(n);
+		}
+
+		uint32_t _parse_primitive()
+		{
+			if (this->_accept("less"))
+				return this->_add(_node{ .op = _op::less, .value = this->_number() });
+			if (this->_accept("greater"))
+				return this->_add(_node{ .op = _op::greater, .value = this->_number() });
+
+			if (this->_accept("vlan"))
+			{
+				_node n = { .op = _op::vlan };
+				uint32_t id;
+				if (!at_end() && _parse_number(peek(), id))
+				{
+					++_pos;
+					n.value = id;
+					n.value2 = 1;
+				}
+
+				return this->_add(n);
+			}
+
+			if (this->_accept("ether"))
+			{
+				if (this->_accept("proto"))
+					return this->_add(_node{ .op = _op::ethertype, .value = this->_number() });
+
+				uint8_t dir = this->_parse_dir();
+				this->_accept("host");
+
+				_node n = { .op = _op::ether_host, .dir = dir };
+				std::array<uint8_t, 6> mac;
+				std::string_view tok = this->_next();
+				if (!parse_mac_address(tok, mac))
+					throw std::runtime_error("invalid filter expression: '" + std::string(tok) + "' is not a MAC address");
+				memcpy(n.addr.data(), mac.data(), 6);
+				return this->_add(n);
+			}
+
+			uint8_t ip_version = 0;
+			uint8_t l4_proto = 0;
+			std::string_view proto_tok;
+			if (this->_accept("ip"))
+			{
+				proto_tok = "ip";
+				ip_version = 4;
+			}
+			else if (this->_accept("ip6"))
+			{
+				proto_tok = "ip6";
+				ip_version = 6;
+			}
+			else if (this->_accept("arp"))
+			{
+				return this->_add(_node{ .op = _op::ethertype, .value = ethertype_arp });
+			}
+			else if (this->_accept("tcp"))
+			{
+				proto_tok = "tcp";
+				l4_proto = ip_proto_tcp;
+			}
+			else if (this->_accept("udp"))
+			{
+				proto_tok = "udp";
+				l4_proto = ip_proto_udp;
+			}
+			else if (this->_accept("icmp"))
+			{
+				return this->_add(_node{ .op = _op::ip_proto, .value = ip_proto_icmp, .value2 = 4 });
+			}
+			else if (this->_accept("icmp6"))
+			{
+				return this->_add(_node{ .op = _op::ip_proto, .value = ip_proto_icmpv6, .value2 = 6 });
+			}
+
+			if (ip_version != 0 && this->_accept("proto"))
+				return this->_add(_node{ .op = _op::ip_proto, .value = this->_number(), .value2 = ip_version });
+
+			size_t dir_pos = _pos;
+			uint8_t dir = this->_parse_dir();
+			bool has_dir = _pos != dir_pos;
+
+			if (l4_proto == 0 && this->_accept("host"))
+				return this->_parse_host(dir, ip_version);
+			if (l4_proto == 0 && this->_accept("net"))
+				return this->_parse_net(dir);
+			if (ip_version == 0 && this->_accept("port"))
+				return this->_parse_port(dir, l4_proto, false);
+			if (ip_version == 0 && this->_accept("portrange"))
+				return this->_parse_port(dir, l4_proto, true);
+
+			// `src 10.0.0.1` is short for `src host 10.0.0.1`.
+			if (has_dir && l4_proto == 0)
+				return this->_parse_host(dir, ip_version);
+
+			if (ip_version != 0)
+				return this->_add(_node{ .op = _op::ethertype, .value = ip_version == 4? ethertype_ipv4: ethertype_ipv6 });
+			if (l4_proto != 0)
+				return this->_add(_node{ .op = _op::ip_proto, .value = l4_proto });
+
+			throw _syntax_error();
+		}
+
+		packet_filter & _f;
+		std::vector<std::string> _tokens;
+		size_t _pos = 0;
+	};
+
+	std::vector<_node> _nodes;
+	uint32_t _root = 0;
+};
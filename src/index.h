@@ -0,0 +1,424 @@
+#pragma once
+#include "filter.h"
+#include "mmap.h"
+#include "output.h"
+#include "packet.h"
+
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+
+// Converts timestamps to another unit, as `ts * mul / div` without overflowing.
+struct timestamp_scale
+{
+	uint64_t mul = 1;
+	uint64_t div = 1;
+
+	// The scale from the resolution of an interface description block,
+	// given by its `if_tsresol` option and microseconds by default,
+	// to 10^-`exponent` seconds. Only decimal resolutions are supported.
+	static std::optional<timestamp_scale> of_interface(std::span<std::byte const> idb, unsigned exponent) noexcept
+	{
+		uint8_t res = 6;
+		for (size_t pos = 16; idb.size() >= 20 && pos + 4 <= idb.size() - 4;)
+		{
+			uint16_t code, len;
+			memcpy(&code, idb.data() + pos, 2);
+			memcpy(&len, idb.data() + pos + 2, 2);
+			if (code == 0 || pos + 4 + len > idb.size() - 4)
+				break;
+
+			if (code == 9 && len == 1)
+				res = (uint8_t)idb[pos + 4];
+			pos += 4 + ((len + 3) & ~3);
+		}
+
+		if ((res & 0x80) != 0 || res > 18)
+			return std::nullopt;
+
+		timestamp_scale r;
+		for (unsigned i = res; i < exponent; ++i)
+			r.mul *= 10;
+		for (unsigned i = exponent; i < res; ++i)
+			r.div *= 10;
+		return r;
+	}
+
+	uint64_t operator()(uint64_t ts) const noexcept
+	{
+		if (div == 1)
+			return ts * mul;
+		return ts / div * mul + ts % div * mul / div;
+	}
+};
+
+// A sidecar index of a pcapng file.
+//
+// The index is a header followed by fixed-size entries in file order.
+// Section headers and interface descriptions get an entry each; runs
+// of packets get an entry per time bucket, with the time range, file
+// range and a 256-bit set of hashed IP addresses seen in the run.
+struct capture_index_entry
+{
+	enum: uint32_t
+	{
+		section = 0,
+		interface = 1,
+		packets = 2,
+	};
+
+	uint32_t kind;
+	uint32_t packet_count = 0;
+	uint64_t first_timestamp = 0;
+	uint64_t last_timestamp = 0;
+	uint64_t begin_offset;
+	uint64_t end_offset = 0;
+	std::array<uint64_t, 4> hosts = {};
+
+	static size_t host_bit(uint8_t const * addr, size_t len) noexcept
+	{
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i != len; ++i)
+			h = (h ^ addr[i]) * 16777619u;
+		return (h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24)) & 0xff;
+	}
+
+	void add_host(uint8_t const * addr, size_t len) noexcept
+	{
+		size_t bit = host_bit(addr, len);
+		hosts[bit / 64] |= (uint64_t)1 << (bit % 64);
+	}
+
+	bool may_contain_host(uint8_t const * addr, size_t len) const noexcept
+	{
+		size_t bit = host_bit(addr, len);
+		return (hosts[bit / 64] & ((uint64_t)1 << (bit % 64))) != 0;
+	}
+};
+
+struct capture_index_header
+{
+	static constexpr uint32_t magic_value = 0x49584449; // "IDXI"
+
+	uint32_t magic;
+	uint32_t version;
+	uint64_t bucket;
+};
+
+// Builds the index as the blocks are written. The per-packet work is
+// a few comparisons and two hashed bits for the addresses.
+//
+// The finished entries wait in a fixed-size queue until the data they
+// describe is written, so that after a crash the index doesn't point past
+// the end of the capture. Only if more than `max_pending` entries pile up
+// are they written ahead of their data. With a non-zero `write_behind_depth`,
+// the entries are written by a background thread.
+struct capture_index_writer
+{
+	static constexpr uint64_t default_bucket = 1'000'000;
+	static constexpr uint64_t max_run_size = 4 << 20;
+	static constexpr size_t max_pending = 4096;
+
+	explicit capture_index_writer(std::filesystem::path const & path, uint64_t bucket = default_bucket,
+		size_t write_behind_depth = 0)
+		: _out(std::make_shared<file_output>(path)), _bucket(bucket ? bucket : default_bucket)
+	{
+		if (write_behind_depth != 0)
+			_io = std::make_unique<write_behind>(_out, write_behind_depth);
+		_pending.reserve(max_pending);
+
+		if (_out->initial_offset() == 0)
+		{
+			capture_index_header hdr = {
+				.magic = capture_index_header::magic_value,
+				.version = 1,
+				.bucket = _bucket,
+			};
+
+			this->_write(std::as_bytes(std::span(&hdr, 1)));
+		}
+	}
+
+	void add_section(uint64_t offset, uint64_t length)
+	{
+		this->_close_run();
+		this->_push({ .kind = capture_index_entry::section, .begin_offset = offset, .end_offset = offset + length });
+	}
+
+	void add_interface(uint64_t offset, uint64_t length)
+	{
+		this->_close_run();
+		this->_push({ .kind = capture_index_entry::interface, .begin_offset = offset, .end_offset = offset + length });
+	}
+
+	void add_packet(uint64_t offset, uint64_t length, uint64_t timestamp, uint16_t if_type, std::span<std::byte const> data)
+	{
+		if (_in_run
+			&& (_run.end_offset != offset
+				|| timestamp / _bucket != _run.first_timestamp / _bucket
+				|| _run.end_offset - _run.begin_offset >= max_run_size))
+		{
+			this->_close_run();
+		}
+
+		if (!_in_run)
+		{
+			_run = {
+				.kind = capture_index_entry::packets,
+				.first_timestamp = timestamp,
+				.last_timestamp = timestamp,
+				.begin_offset = offset,
+			};
+			_in_run = true;
+		}
+
+		++_run.packet_count;
+		_run.first_timestamp = (std::min)(_run.first_timestamp, timestamp);
+		_run.last_timestamp = (std::max)(_run.last_timestamp, timestamp);
+		_run.end_offset = offset + length;
+
+		decoded_packet pkt;
+		decode_packet(if_type, data, pkt);
+		if (size_t len = pkt.ip_addr_size())
+		{
+			_run.add_host(pkt.src_ip.data(), len);
+			_run.add_host(pkt.dst_ip.data(), len);
+		}
+	}
+
+	// Writes out the finished entries for the data before the stream
+	// offset `written`, up to which the capture has been written. With
+	// `close_run`, the current run of packets is finished first.
+	void write_until(uint64_t written, bool close_run = false)
+	{
+		if (close_run)
+			this->_close_run();
+
+		size_t n = 0;
+		while (n != _pending.size() && _pending[n].end_offset <= written)
+			++n;
+		this->_write_entries(n);
+	}
+
+	// Writes out the entries for everything added so far. Must only
+	// be called once the indexed data itself is written.
+	void flush()
+	{
+		this->_close_run();
+		this->_write_entries(_pending.size());
+		if (_io)
+			_io->wait();
+	}
+
+	// Makes the entries written so far durable. With write-behind,
+	// the sync is left to the background thread.
+	void sync()
+	{
+		if (_io)
+			_io->sync();
+		else
+			_out->sync();
+	}
+
+private:
+	void _close_run()
+	{
+		if (!_in_run)
+			return;
+
+		this->_push(_run);
+		_in_run = false;
+	}
+
+	void _push(capture_index_entry const & e)
+	{
+		if (_pending.size() == max_pending)
+			this->_write_entries(_pending.size());
+		_pending.push_back(e);
+	}
+
+	void _write_entries(size_t n)
+	{
+		if (n == 0)
+			return;
+
+		this->_write(std::as_bytes(std::span(_pending).first(n)));
+		_pending.erase(_pending.begin(), _pending.begin() + n);
+	}
+
+	void _write(std::span<std::byte const> data)
+	{
+		if (!_io)
+		{
+			_out->write(data);
+			return;
+		}
+
+		// The buffers are sized for a full queue, so they are only allocated
+		// until each slot of the background thread has had one.
+		if (_buf.size() < data.size())
+			_buf.resize((std::max)(data.size(), max_pending * sizeof(capture_index_entry)));
+		memcpy(_buf.data(), data.data(), data.size());
+		_buf = _io->submit(std::move(_buf), data.size());
+	}
+
+	std::shared_ptr<file_output> _out;
+	std::unique_ptr<write_behind> _io;
+	std::vector<std::byte> _buf;
+	uint64_t _bucket;
+
+	bool _in_run = false;
+	capture_index_entry _run;
+	std::vector<capture_index_entry> _pending;
+};
+
+struct extract_stats
+{
+	uint64_t runs;
+	uint64_t runs_read;
+	uint64_t packets;
+};
+
+// Copies the packets between `from` and `to` (inclusive, in microseconds)
+// that match the filter from an indexed capture. Only the parts of the
+// capture that the index can't rule out are read. The index is in
+// microseconds, whatever the resolution of the interfaces.
+template <typename Writer>
+extract_stats extract_indexed(std::filesystem::path const & capture_path, std::filesystem::path const & index_path,
+	Writer & out, uint64_t from, uint64_t to, packet_filter const & filter)
+{
+	mapped_file capture(capture_path);
+	mapped_file index(index_path);
+
+	std::span<std::byte const> file = capture.data();
+	std::span<std::byte const> idx = index.data();
+
+	capture_index_header hdr;
+	if (idx.size() < sizeof hdr)
+		throw std::runtime_error("invalid index");
+	memcpy(&hdr, idx.data(), sizeof hdr);
+	if (hdr.magic != capture_index_header::magic_value || hdr.version != 1)
+		throw std::runtime_error("invalid index");
+
+	std::array<uint8_t, 16> host;
+	size_t host_len = 0;
+	bool has_host = filter.required_host(host, host_len);
+
+	auto block_at = [&](uint64_t begin, uint64_t end) -> std::span<std::byte const> {
+		if (begin > end || end > file.size())
+			throw std::runtime_error("the index doesn't match the capture");
+		return file.subspan((size_t)begin, (size_t)(end - begin));
+	};
+
+	extract_stats stats = {};
+
+	// The interfaces of the current section, and how many of them
+	// have already been written to the output.
+	std::vector<std::span<std::byte const>> intf_blocks;
+	std::vector<uint16_t> intf_types;
+	std::vector<std::optional<timestamp_scale>> intf_scales;
+	size_t intfs_written = 0;
+
+	std::span<std::byte const> section_block;
+	bool section_written = false;
+	bool first_section = true;
+
+	for (size_t pos = sizeof hdr; pos + sizeof(capture_index_entry) <= idx.size(); pos += sizeof(capture_index_entry))
+	{
+		capture_index_entry e;
+		memcpy(&e, idx.data() + pos, sizeof e);
+
+		switch (e.kind)
+		{
+		case capture_index_entry::section:
+			section_block = block_at(e.begin_offset, e.end_offset);
+			if (section_written)
+				first_section = false;
+			section_written = false;
+			intf_blocks.clear();
+			intf_types.clear();
+			intf_scales.clear();
+			intfs_written = 0;
+			break;
+
+		case capture_index_entry::interface:
+		{
+			auto block = block_at(e.begin_offset, e.end_offset);
+			uint16_t link_type;
+			if (block.size() < 10)
+				throw std::runtime_error("the index doesn't match the capture");
+			memcpy(&link_type, block.data() + 8, sizeof link_type);
+
+			intf_blocks.push_back(block);
+			intf_types.push_back(if_type_from_pcap(link_type));
+			intf_scales.push_back(timestamp_scale::of_interface(block, 6));
+			break;
+		}
+
+		case capture_index_entry::packets:
+		{
+			++stats.runs;
+			if (e.last_timestamp < from || e.first_timestamp > to)
+				break;
+			if (has_host && !e.may_contain_host(host.data(), host_len))
+				break;
+
+			++stats.runs_read;
+			auto run = block_at(e.begin_offset, e.end_offset);
+			while (run.size() >= 32)
+			{
+				uint32_t type, len, ifidx, ts_hi, ts_lo, captured_len, packet_len;
+				memcpy(&type, run.data(), 4);
+				memcpy(&len, run.data() + 4, 4);
+				if (len < 32 || len > run.size())
+					throw std::runtime_error("the index doesn't match the capture");
+
+				auto block = run.subspan(0, len);
+				run = run.subspan(len);
+				if (type != 6)
+					continue;
+
+				memcpy(&ifidx, block.data() + 8, 4);
+				memcpy(&ts_hi, block.data() + 12, 4);
+				memcpy(&ts_lo, block.data() + 16, 4);
+				memcpy(&captured_len, block.data() + 20, 4);
+				memcpy(&packet_len, block.data() + 24, 4);
+
+				if (ifidx >= intf_types.size() || !intf_scales[ifidx] || captured_len > len - 32)
+					continue;
+
+				uint64_t ts = (*intf_scales[ifidx])(((uint64_t)ts_hi << 32) | ts_lo);
+				if (ts < from || ts > to)
+					continue;
+
+				if (!filter.match(intf_types[ifidx], block.subspan(28, captured_len), packet_len))
+					continue;
+
+				if (!section_written)
+				{
+					// The writer starts with a section header of its own.
+					if (!first_section)
+						out.add_block(section_block);
+					section_written = true;
+				}
+
+				for (; intfs_written != intf_blocks.size(); ++intfs_written)
+					out.add_block(intf_blocks[intfs_written]);
+
+				out.add_block(block);
+				++stats.packets;
+			}
+
+			break;
+		}
+		}
+	}
+
+	return stats;
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include <stdint.h>
+#include <stdexcept>
+#include <string_view>
+
+// Keywords of the Microsoft-Windows-NDIS-PacketCapture provider.
+namespace ndis_keyword {
+	enum: uint64_t
+	{
+		ethernet = 0x1,
+		wireless_wan = 0x200,
+		tunnel = 0x8000,
+		packet_start = 0x4000'0000,
+		packet_end = 0x8000'0000,
+		send_path = 0x1'0000'0000,
+		receive_path = 0x2'0000'0000,
+
+		media = ethernet | wireless_wan | tunnel,
+	};
+}
+
+// The values of the direction bits of the pcapng `epb_flags` option.
+enum: uint32_t
+{
+	epb_inbound = 1,
+	epb_outbound = 2,
+};
+
+// Which packets to capture, by direction and media type.
+//
+// The selection is turned into the narrowest keyword masks for the provider,
+// so that the unwanted events aren't even generated. Since the masks are
+// only as good as the keywords the provider puts on its events, the consumer
+// checks each event again with `match`, which applies the same rules as ETW.
+struct capture_selection
+{
+	bool inbound = true;
+	bool outbound = true;
+
+	// A combination of the `ndis_keyword` media bits; zero selects all media.
+	uint64_t media = 0;
+
+	// Parses `in`, `out` or `inout`.
+	void set_direction(std::string_view dir)
+	{
+		if (dir == "in")
+		{
+			inbound = true;
+			outbound = false;
+		}
+		else if (dir == "out")
+		{
+			inbound = false;
+			outbound = true;
+		}
+		else if (dir == "inout")
+		{
+			inbound = outbound = true;
+		}
+		else
+		{
+			throw std::runtime_error("invalid direction, expected in, out or inout");
+		}
+	}
+
+	// Parses a comma-separated list of `ethernet`, `wwan` and `tunnel`.
+	void set_media(std::string_view list)
+	{
+		media = 0;
+		while (!list.empty())
+		{
+			size_t comma = list.find(',');
+			std::string_view name = list.substr(0, comma);
+			list = comma == std::string_view::npos? std::string_view{}: list.substr(comma + 1);
+
+			if (name == "ethernet")
+				media |= ndis_keyword::ethernet;
+			else if (name == "wwan")
+				media |= ndis_keyword::wireless_wan;
+			else if (name == "tunnel")
+				media |= ndis_keyword::tunnel;
+			else
+				throw std::runtime_error("invalid media type, expected ethernet, wwan or tunnel");
+		}
+	}
+
+	// An event is enabled if it has any of these keywords...
+	uint64_t match_any_keyword() const noexcept
+	{
+		if (media != 0)
+			return media;
+
+		if (inbound != outbound)
+			return inbound? ndis_keyword::receive_path: ndis_keyword::send_path;
+
+		return ~(uint64_t)0;
+	}
+
+	// ...and all of these.
+	uint64_t match_all_keyword() const noexcept
+	{
+		if (inbound == outbound || media == 0)
+			return 0;
+		return inbound? ndis_keyword::receive_path: ndis_keyword::send_path;
+	}
+
+	// Whether ETW would deliver an event with the keyword for the masks above.
+	// Events without any keyword are always delivered.
+	bool match(uint64_t keyword) const noexcept
+	{
+		if (keyword == 0)
+			return true;
+
+		uint64_t all = this->match_all_keyword();
+		return (keyword & this->match_any_keyword()) != 0 && (keyword & all) == all;
+	}
+
+	// The direction bits of `epb_flags` for an event with the keyword,
+	// or zero if the direction isn't known.
+	static uint32_t epb_direction(uint64_t keyword) noexcept
+	{
+		bool send = (keyword & ndis_keyword::send_path) != 0;
+		bool receive = (keyword & ndis_keyword::receive_path) != 0;
+		if (send == receive)
+			return 0;
+		return receive? epb_inbound: epb_outbound;
+	}
+};
@@ -1,273 +1,375 @@
 #include "cmdline.h"
-#include "comptr.h"
-#include "hr.h"
+#include "columns.h"
+#include "content.h"
+#include "fanout.h"
+#include "filter.h"
+#include "index.h"
+#include "keywords.h"
+#include "merge.h"
+#include "net.h"
+#include "packet_sink.h"
+#include "packet_source.h"
 #include "pcapng.h"
-#include "registry.h"
+#include "pipeline.h"
+#include "reassembly.h"
+#include "recorder.h"
+#include "repair.h"
+#include "shard.h"
+#include "shed.h"
 #include "sigint.h"
+#include "text.h"
 #include "utf8.h"
+#include "window.h"
 
-#include <windows.h>
-#include <evntrace.h>
-#include <evntcons.h>
-#include <iphlpapi.h>
-#include <objbase.h>
-#include <Netcfgx.h>
-#include <devguid.h>
+#ifdef _WIN32
+#include "event.h"
+#include "hr.h"
+#include "ndiscap.h"
+#else
+#include "af_packet.h"
+#endif
 
+#include <chrono>
 #include <cstddef>
+#include <cstring>
 #include <concepts>
 #include <functional>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <random>
 #include <span>
+#include <thread>
 
 
-namespace Microsoft_Windows_NDIS_PacketCapture {
-	static constexpr GUID id = { 0x2ED6006E, 0x4729, 0x4609, { 0xB4, 0x23, 0x3E, 0xE7, 0xBC, 0xD6, 0x78, 0xEF } };
-
-	enum: uint32_t
-	{
-		packet_fragment = 1001,
-	};
-}
-
-template <typename T>
-static T read_ne(std::span<std::byte const> & data)
-{
-	if (data.size() < sizeof(T))
-		throw std::runtime_error("invalid");
-	T r;
-	memcpy(&r, data.data(), sizeof(T));
-	data = data.subspan(sizeof(T));
-	return r;
-}
-
-struct ndis_packetcapture_consumer
+// Parses a byte count with an optional K, M or G suffix.
+static size_t _parse_size(std::string const & s)
 {
-	ndis_packetcapture_consumer(std::shared_ptr<pcapng_writer> writer, size_t snaplen)
-		: _writer(std::move(writer)), _snaplen(snaplen)
-	{
-	}
-
-	void push_trace(PEVENT_RECORD event)
+	size_t pos;
+	unsigned long long r = std::stoull(s, &pos);
+	if (pos + 1 == s.size())
 	{
-		if (event->EventHeader.ProviderId != Microsoft_Windows_NDIS_PacketCapture::id)
-			return;
-
-		auto const & ed = event->EventHeader.EventDescriptor;
-		std::span<std::byte const> data = { (std::byte const *)event->UserData, event->UserDataLength };
-
-		switch ((ed.Version << 16) | ed.Id)
+		switch (s[pos])
 		{
-		case Microsoft_Windows_NDIS_PacketCapture::packet_fragment:
-		{
-			auto miniport_intf_index = read_ne<uint32_t>(data);
-			auto lower_intf_index = read_ne<uint32_t>(data);
-			auto fragment_size = read_ne<uint32_t>(data);
-
-			auto it = _intfs.find(miniport_intf_index);
-			if (it == _intfs.end())
-			{
-				MIB_IFROW row = {};
-				row.dwIndex = miniport_intf_index;
-				if (GetIfEntry(&row) != 0)
-					return;
-
-				auto ifidx = _writer->add_interface((uint16_t)row.dwType, to_utf8(row.wszName),
-					(char const *)row.bDescr, _snaplen);
-				it = _intfs.emplace(miniport_intf_index, ifidx).first;
-			}
-
-			if (data.size() < fragment_size)
-				throw std::runtime_error("invalid");
-
-			std::span<std::byte const> fragment(data.data(), fragment_size);
-			data = data.subspan(fragment_size);
-			_writer->add_packet(it->second, (event->EventHeader.TimeStamp.QuadPart / 10) - 11644473600000000l,
-				fragment.subspan(0, (std::min)(fragment.size(), _snaplen)), fragment.size());
-			break;
-		}
+		case 'k':
+		case 'K':
+			return (size_t)(r << 10);
+		case 'm':
+		case 'M':
+			return (size_t)(r << 20);
+		case 'g':
+		case 'G':
+			return (size_t)(r << 30);
 		}
 	}
 
-private:
-	std::shared_ptr<pcapng_writer> _writer;
-	std::map<uint32_t, uint32_t> _intfs;
-	size_t _snaplen;
-};
-
+	if (pos != s.size())
+		throw std::runtime_error("invalid size: " + s);
+	return (size_t)r;
+}
 
-template <typename F>
-void foreach_net_binding(LPCWSTR component_name, F && fn)
+// Parses a UTC time, either as seconds since the epoch or
+// as YYYY-MM-DDTHH:MM:SS, with optional fractional seconds.
+// Returns microseconds since the epoch.
+static uint64_t _parse_time(std::string const & s)
 {
-	comptr<INetCfg> netcfg;
-	hrtry CoCreateInstance(CLSID_CNetCfg, nullptr, CLSCTX_INPROC_SERVER, IID_INetCfg, (void **)~netcfg);
-
-	auto lock = netcfg.query<INetCfgLock>();
-	hrtry lock->AcquireWriteLock(5000, L"ndisdump", nullptr);
-
-	hrtry netcfg->Initialize(nullptr);
-
-	comptr<INetCfgComponent> ndiscap;
-	hrtry netcfg->FindComponent(component_name, ~ndiscap);
-
-	auto bindings = ndiscap.query<INetCfgComponentBindings>();
-
-	comptr<IEnumNetCfgBindingPath> binding_paths;
-	hrtry bindings->EnumBindingPaths(EBP_ABOVE, ~binding_paths);
+	auto fail = [&]() -> uint64_t {
+		throw std::runtime_error("invalid time: " + s);
+	};
 
-	for (;;)
+	uint64_t seconds;
+	size_t pos;
+	if (s.size() >= 19 && s[4] == '-' && s[7] == '-' && (s[10] == 'T' || s[10] == ' ') && s[13] == ':' && s[16] == ':')
 	{
-		comptr<INetCfgBindingPath> path;
-
-		ULONG fetched;
-		auto hr = hrtry binding_paths->Next(1, ~path, &fetched);
-		if (hr == S_FALSE)
-			break;
-
-		fn(path);
+		int y = std::stoi(s.substr(0, 4));
+		unsigned m = (unsigned)std::stoi(s.substr(5, 2));
+		unsigned d = (unsigned)std::stoi(s.substr(8, 2));
+		if (m < 1 || m > 12 || d < 1 || d > 31)
+			return fail();
+
+		// Days since the epoch of a civil date.
+		y -= m <= 2;
+		int era = (y >= 0? y: y - 399) / 400;
+		unsigned yoe = (unsigned)(y - era * 400);
+		unsigned doy = (153 * (m > 2? m - 3: m + 9) + 2) / 5 + d - 1;
+		unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+		int64_t days = (int64_t)era * 146097 + (int64_t)doe - 719468;
+		if (days < 0)
+			return fail();
+
+		seconds = (uint64_t)days * 86400 + std::stoull(s.substr(11, 2)) * 3600 + std::stoull(s.substr(14, 2)) * 60
+			+ std::stoull(s.substr(17, 2));
+		pos = 19;
 	}
-
-	hrtry netcfg->Apply();
-	hrtry lock->ReleaseWriteLock();
-}
-
-struct _ndiscap_sentry
-{
-	_ndiscap_sentry()
-		: _key(win32_reg_handle::open_key(HKEY_LOCAL_MACHINE, LR"(SYSTEM\CurrentControlSet\Services\NdisCap\Parameters)", KEY_QUERY_VALUE | KEY_SET_VALUE))
+	else
 	{
-		uint32_t refcount = _key.query_dword(L"RefCount", 0);
-		_key.set_dword(L"RefCount", refcount + 1);
-
-		foreach_net_binding(L"ms_ndiscap", [](comptr<INetCfgBindingPath> const & path) {
-			hrtry path->Enable(TRUE);
-			});
+		seconds = std::stoull(s, &pos);
 	}
 
-	~_ndiscap_sentry()
+	uint64_t us = 0;
+	if (pos != s.size())
 	{
-		uint32_t refcount = _key.query_dword(L"RefCount", 0);
-		_key.set_dword(L"RefCount", refcount - 1);
+		if (s[pos] != '.')
+			return fail();
 
-		if (refcount == 1)
+		uint64_t scale = 100000;
+		for (++pos; pos != s.size(); ++pos, scale /= 10)
 		{
-			foreach_net_binding(L"ms_ndiscap", [](comptr<INetCfgBindingPath> const & path) {
-				hrtry path->Enable(FALSE);
-				});
+			if (s[pos] < '0' || s[pos] > '9')
+				return fail();
+			us += (s[pos] - '0') * scale;
 		}
 	}
 
-private:
-	win32_reg_handle _key;
-};
+	return seconds * 1'000'000 + us;
+}
 
-struct service_handle
+// Parses an output spec of the form FILE[,snaplen=N][,headers][,filter=EXPR].
+// The filter goes last, so that the expression may contain commas.
+static fanout_output _parse_output_spec(std::string_view spec)
 {
-	explicit service_handle(SC_HANDLE h) noexcept
-		: _h(h)
-	{
-	}
-
-	explicit operator bool() const noexcept
-	{
-		return _h != nullptr;
-	}
+	fanout_output r;
 
-	SC_HANDLE get() const noexcept
-	{
-		return _h;
-	}
+	size_t comma = spec.find(',');
+	std::filesystem::path path = from_utf8(spec.substr(0, comma));
+	if (path.empty())
+		throw std::runtime_error("missing file name in output spec");
 
-	~service_handle()
+	while (comma != std::string_view::npos)
 	{
-		if (_h)
-			CloseServiceHandle(_h);
-	}
-
-	service_handle(service_handle && o) noexcept
-		: _h(std::exchange(o._h, nullptr))
-	{
-	}
+		spec = spec.substr(comma + 1);
+		if (spec.starts_with("filter="))
+		{
+			r.filter = packet_filter::compile(spec.substr(7));
+			break;
+		}
 
-	service_handle & operator=(service_handle o) noexcept
-	{
-		std::swap(_h, o._h);
-		return *this;
+		comma = spec.find(',');
+		std::string opt(spec.substr(0, comma));
+		if (opt.starts_with("snaplen="))
+		{
+			r.snaplen = _parse_size(opt.substr(8));
+			if (r.snaplen == 0)
+				throw std::runtime_error("invalid snaplen: " + opt);
+		}
+		else if (opt == "headers")
+		{
+			r.headers_only = true;
+		}
+		else
+		{
+			throw std::runtime_error("unknown output option: " + opt);
+		}
 	}
 
-private:
-	SC_HANDLE _h;
-};
+	// Each output writes from its own thread, so that a slow disk
+	// only holds back its own output.
+	r.sink = std::make_shared<pcapng_writer>(path, pcapng_writer::default_buffer_size, 4);
+	return r;
+}
 
-static void _start_service(LPCWSTR name)
+// Reads content patterns, one per line; empty lines and lines
+// starting with `#` are skipped.
+static void _read_content_patterns(std::filesystem::path const & path, std::vector<std::string> & patterns)
 {
-	service_handle scman(OpenSCManagerW(nullptr, SERVICES_ACTIVE_DATABASEW, SC_MANAGER_CONNECT));
-	if (!scman)
-	{
-		DWORD err = GetLastError();
-		throw std::system_error(err, std::system_category());
-	}
+	std::ifstream fin(path);
+	if (!fin)
+		throw std::runtime_error("can't open " + path.string());
 
-	service_handle service(OpenServiceW(scman.get(), name, SERVICE_QUERY_STATUS));
-	if (!service)
+	std::string line;
+	while (std::getline(fin, line))
 	{
-		DWORD err = GetLastError();
-		throw std::system_error(err, std::system_category());
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty() || line.front() == '#')
+			continue;
+		patterns.push_back(parse_content_pattern(line));
 	}
+}
 
-	SERVICE_STATUS st = {};
-	if (!QueryServiceStatus(service.get(), &st))
+// Measures the content matcher on full-sized payloads, half of them
+// HTTP requests and half random bytes, as in encrypted traffic.
+static void _benchmark_content(std::vector<std::string> const & patterns)
+{
+	std::string const http =
+		"GET /index.html HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64)\r\n"
+		"Accept: text/html,application/xhtml+xml\r\n"
+		"Accept-Language: en-US,en;q=0.9\r\n"
+		"Cookie: session=0123456789abcdef0123456789abcdef\r\n"
+		"Connection: keep-alive\r\n\r\n";
+
+	std::mt19937 rng(1);
+	std::vector<std::string> payloads(16384);
+	for (size_t i = 0; i != payloads.size(); ++i)
 	{
-		DWORD err = GetLastError();
-		throw std::system_error(err, std::system_category());
+		std::string & p = payloads[i];
+		if (i % 2 == 0)
+		{
+			while (p.size() < 1460)
+				p += http;
+			p.resize(1460);
+		}
+		else
+		{
+			p.resize(1460);
+			for (char & ch: p)
+				ch = (char)rng();
+		}
 	}
 
-	if (st.dwCurrentState == SERVICE_RUNNING)
-		return;
+	// Without the prefilter too, for comparison, if it was used.
+	std::vector<content_matcher> matchers = { content_matcher(patterns) };
+	if (matchers.front().prefiltered())
+		matchers.push_back(content_matcher(patterns, false));
 
-	service = service_handle(OpenServiceW(scman.get(), name, SERVICE_QUERY_STATUS | SERVICE_START));
-	if (!service)
+	for (auto const & m: matchers)
 	{
-		DWORD err = GetLastError();
-		throw std::system_error(err, std::system_category());
-	}
-
-	while (st.dwCurrentState != SERVICE_RUNNING)
-	{
-		if (st.dwCurrentState == SERVICE_STOPPED)
+		size_t bytes = 0;
+		size_t matches = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t round = 0; round != 16; ++round)
 		{
-			if (!StartServiceW(service.get(), 0, nullptr))
+			for (auto const & p: payloads)
 			{
-				DWORD err = GetLastError();
-				if (err != ERROR_SERVICE_ALREADY_RUNNING)
-					throw std::system_error(err, std::system_category());
+				matches += m.match(std::as_bytes(std::span(p)));
+				bytes += p.size();
 			}
 		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		printf("%s: %.2f GB/s, %zu of %zu payloads matched\n", m.prefiltered()? "teddy + aho-corasick": "aho-corasick",
+			bytes / elapsed.count() / 1e9, matches / 16, payloads.size());
+	}
+}
 
-		Sleep(st.dwWaitHint);
+// Replays 10 seconds of 1000-byte UDP packets at 100 MB/s, spread over
+// 4096 flows, through the load shedder into an output that takes `mbps`
+// MB/s, and prints for each second the packets that were shed and those
+// that the capture would have lost because the shedding didn't keep up.
+// A packet counts as lost once it's 50 ms late.
+static void _benchmark_shed(double mbps, std::vector<shed_step> steps, double loss_target)
+{
+	constexpr size_t packet_size = 1000;
+	constexpr uint64_t packet_rate = 100'000;
+	constexpr uint64_t seconds = 10;
+	constexpr uint64_t max_lag_us = 50'000;
+
+	auto writer = std::make_shared<pcapng_writer>(std::make_shared<throttled_output>(mbps * 1e6),
+		pcapng_writer::default_buffer_size, 4);
+	load_shedder shedder(writer, std::move(steps), loss_target);
+	shedder.add_interface({ .index = 1, .link_type = if_type_ethernet, .name = "bench", .desc = "bench", .snaplen = packet_size });
+
+	// Ethernet, IPv4 from 10.0.0.1 to 10.0.0.2, and UDP to port 9999;
+	// the source port picks the flow.
+	uint8_t const headers[] = {
+		0, 0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 1, 0x08, 0x00,
+		0x45, 0, (packet_size - 14) >> 8, (packet_size - 14) & 0xff, 0, 0, 0, 0, 64, 17, 0, 0, 10, 0, 0, 1, 10, 0, 0, 2,
+		0, 0, 0x27, 0x0f, (packet_size - 34) >> 8, (packet_size - 34) & 0xff, 0, 0,
+	};
+	std::vector<std::byte> pkt(packet_size);
+	memcpy(pkt.data(), headers, sizeof headers);
+
+	uint64_t epoch = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	auto start = std::chrono::steady_clock::now();
+
+	printf("%-8s %8s %8s %8s %8s\n", "second", "shed", "lost", "steps", "sample");
+	uint64_t lost = 0;
+	uint64_t last_lost = 0;
+	uint64_t last_shed = 0;
+	for (uint64_t i = 0; i != seconds * packet_rate; ++i)
+	{
+		uint64_t due_us = i * 1'000'000 / packet_rate;
+		uint64_t now_us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		if (due_us > now_us + 1000)
+			std::this_thread::sleep_for(std::chrono::microseconds(due_us - now_us));
 
-		if (!QueryServiceStatus(service.get(), &st))
+		if (now_us > due_us + max_lag_us)
 		{
-			DWORD err = GetLastError();
-			throw std::system_error(err, std::system_category());
+			++lost;
+		}
+		else
+		{
+			uint16_t sport = (uint16_t)(1024 + i % 4096);
+			pkt[34] = (std::byte)(sport >> 8);
+			pkt[35] = (std::byte)sport;
+			shedder.add_packet(0, epoch + due_us, pkt, pkt.size(), 0);
+		}
+
+		if ((i + 1) % packet_rate == 0)
+		{
+			uint64_t shed = shedder.statistics()[0].dropped;
+			printf("%-8llu %7.1f%% %7.1f%% %8zu %7.1f%%\n", (unsigned long long)((i + 1) / packet_rate),
+				100.0 * (shed - last_shed) / packet_rate, 100.0 * (lost - last_lost) / packet_rate,
+				shedder.level(), 100.0 * shedder.sample());
+			last_shed = shed;
+			last_lost = lost;
 		}
 	}
+
+	shedder.flush();
 }
 
 static int _real_main(int argc, char * argv[])
 {
+#ifdef _WIN32
 	hrtry CoInitialize(nullptr);
+#endif
 
 	std::filesystem::path out_path;
+	std::string stream_to;
+	std::vector<std::string> output_specs;
+	std::filesystem::path columns_path;
+	std::filesystem::path reassemble_dir;
+	std::vector<std::string> content_patterns;
+	bool content_flows = false;
+	bool benchmark_content = false;
+	double benchmark_shed = 0;
+	size_t reassembly_memory = tcp_reassembler::default_budget;
+	size_t reassembly_flow_memory = tcp_reassembler::default_flow_budget;
+#ifdef _WIN32
+	std::wstring session_name = L"wncap-" + std::to_wstring(GetCurrentProcessId());
+#else
+	std::string capture_ifname;
+	size_t capture_threads = 1;
+#endif
 	int snaplen = 262144;
+	int threads = 1;
+	size_t flow_files = 0;
+	std::vector<shed_step> shed_steps;
+	double shed_target = 1;
+	size_t ring_size = 0;
+	uint64_t ring_seconds = 0;
+	std::string dump_event;
+	std::string dump_on;
+	std::string trigger_on;
+	std::string stop_on;
+	uint64_t pre_roll = 5;
+	uint64_t post_roll = 30;
+	size_t pre_roll_size = 64 << 20;
+	bool write_index = false;
+	uint64_t checkpoint = 0;
+	std::filesystem::path repair_path;
+	std::filesystem::path extract_path;
+	uint64_t time_from = 0;
+	uint64_t time_to = ~(uint64_t)0;
 	std::string expr;
+	std::vector<std::string> args;
+	bool merge = false;
 	bool list_interfaces = false;
+	capture_selection selection;
+	bool print_link_header = false;
+	bool quiet = false;
 
 	command_line_reader clr(argc, argv);
 	auto print_help = [&] {
-		printf("Usage: %s [OPTIONS] -w FILE [EXPR ...]\n", clr.arg0().stem().string().c_str());
+		printf("Usage: %s [OPTIONS] [-w FILE | --stream HOST:PORT] [--output SPEC ...] [EXPR ...]\n", clr.arg0().stem().string().c_str());
+		printf("       %s --extract FILE [--from TIME] [--to TIME] -w FILE [EXPR ...]\n", clr.arg0().stem().string().c_str());
+		printf("       %s --merge -w FILE INPUT ...\n", clr.arg0().stem().string().c_str());
+		printf("       %s --repair FILE [-w FILE]\n", clr.arg0().stem().string().c_str());
 	};
 
 	while (clr.next())
@@ -280,17 +382,195 @@ static int _real_main(int argc, char * argv[])
 		{
 			clr.pop_path(out_path);
 		}
+		else if (clr == "--output")
+		{
+			output_specs.push_back(clr.pop_string());
+		}
+		else if (clr == "--columns")
+		{
+			clr.pop_path(columns_path);
+		}
+		else if (clr == "--content")
+		{
+			content_patterns.push_back(parse_content_pattern(clr.pop_string()));
+		}
+		else if (clr == "--content-file")
+		{
+			std::filesystem::path path;
+			clr.pop_path(path);
+			_read_content_patterns(path, content_patterns);
+		}
+		else if (clr == "--content-flows")
+		{
+			content_flows = true;
+		}
+		else if (clr == "--benchmark-content")
+		{
+			benchmark_content = true;
+		}
+		else if (clr == "--reassemble")
+		{
+			clr.pop_path(reassemble_dir);
+		}
+		else if (clr == "--reassembly-memory")
+		{
+			reassembly_memory = _parse_size(clr.pop_string());
+		}
+		else if (clr == "--reassembly-flow-memory")
+		{
+			reassembly_flow_memory = _parse_size(clr.pop_string());
+		}
+#ifdef _WIN32
+		else if (clr == "--session")
+		{
+			session_name = from_utf8(clr.pop_string());
+		}
+#else
+		else if (clr == "-i" || clr == "--interface")
+		{
+			capture_ifname = clr.pop_string();
+		}
+		else if (clr == "--capture-threads")
+		{
+			capture_threads = std::stoull(clr.pop_string());
+			if (capture_threads == 0)
+				capture_threads = 1;
+		}
+#endif
+		else if (clr == "--stream")
+		{
+			stream_to = clr.pop_string();
+		}
+		else if (clr == "-n")
+		{
+			// Addresses are never resolved to names.
+		}
+		else if (clr == "-e")
+		{
+			print_link_header = true;
+		}
+		else if (clr == "-q")
+		{
+			quiet = true;
+		}
 		else if (clr == "-s" || clr == "--snapshot-length")
 		{
 			snaplen = std::stoi(clr.pop_string());
 			if (snaplen <= 0)
 				snaplen = 262144;
 		}
+		else if (clr == "--threads")
+		{
+			threads = std::stoi(clr.pop_string());
+			if (threads <= 0)
+				threads = 1;
+		}
+		else if (clr == "--direction")
+		{
+			selection.set_direction(clr.pop_string());
+		}
+#ifdef _WIN32
+		else if (clr == "--media")
+		{
+			selection.set_media(clr.pop_string());
+		}
+#endif
+		else if (clr == "--split-flows")
+		{
+			flow_files = std::stoull(clr.pop_string());
+			if (flow_files == 0)
+				throw std::runtime_error("--split-flows needs at least one file");
+		}
+		else if (clr == "--shed")
+		{
+			shed_steps = parse_shed_steps(clr.pop_string());
+			if (shed_steps.empty())
+				throw std::runtime_error("--shed needs at least one step");
+		}
+		else if (clr == "--shed-target")
+		{
+			shed_target = std::stod(clr.pop_string()) / 100;
+			if (!(shed_target >= 0 && shed_target <= 1))
+				throw std::runtime_error("--shed-target must be a percentage between 0 and 100");
+		}
+		else if (clr == "--benchmark-shed")
+		{
+			benchmark_shed = std::stod(clr.pop_string());
+			if (!(benchmark_shed > 0))
+				throw std::runtime_error("--benchmark-shed needs the output speed in MB/s");
+		}
+		else if (clr == "--ring")
+		{
+			ring_size = _parse_size(clr.pop_string());
+		}
+		else if (clr == "--ring-seconds")
+		{
+			ring_seconds = std::stoull(clr.pop_string());
+		}
+#ifdef _WIN32
+		else if (clr == "--dump-event")
+		{
+			dump_event = clr.pop_string();
+		}
+#endif
+		else if (clr == "--dump-on")
+		{
+			dump_on = clr.pop_string();
+		}
+		else if (clr == "--trigger")
+		{
+			trigger_on = clr.pop_string();
+		}
+		else if (clr == "--stop-on")
+		{
+			stop_on = clr.pop_string();
+		}
+		else if (clr == "--pre-roll")
+		{
+			pre_roll = std::stoull(clr.pop_string());
+		}
+		else if (clr == "--post-roll")
+		{
+			post_roll = std::stoull(clr.pop_string());
+		}
+		else if (clr == "--pre-roll-size")
+		{
+			pre_roll_size = _parse_size(clr.pop_string());
+		}
+		else if (clr == "--index")
+		{
+			write_index = true;
+		}
+		else if (clr == "--checkpoint")
+		{
+			checkpoint = std::stoull(clr.pop_string());
+		}
+		else if (clr == "--repair")
+		{
+			clr.pop_path(repair_path);
+		}
+		else if (clr == "--extract")
+		{
+			clr.pop_path(extract_path);
+		}
+		else if (clr == "--from")
+		{
+			time_from = _parse_time(clr.pop_string());
+		}
+		else if (clr == "--to")
+		{
+			time_to = _parse_time(clr.pop_string());
+		}
+		else if (clr == "--merge")
+		{
+			merge = true;
+		}
 		else if (clr == "")
 		{
+			args.push_back(clr.pop_string());
 			if (!expr.empty())
 				expr.push_back(' ');
-			expr.append(clr.pop_string());
+			expr.append(args.back());
 		}
 		else if (clr == "-h" || clr == "--help")
 		{
@@ -304,109 +584,329 @@ static int _real_main(int argc, char * argv[])
 		}
 	}
 
+	if (benchmark_content)
+	{
+		if (content_patterns.empty())
+		{
+			fprintf(stderr, "error: --benchmark-content requires --content or --content-file\n");
+			return 2;
+		}
+
+		_benchmark_content(content_patterns);
+		return 0;
+	}
+
+	if (benchmark_shed != 0)
+	{
+		if (shed_steps.empty())
+			shed_steps = { shed_step::sample };
+		_benchmark_shed(benchmark_shed, shed_steps, shed_target);
+		return 0;
+	}
+
+	if (content_flows && content_patterns.empty())
+	{
+		fprintf(stderr, "error: --content-flows requires --content or --content-file\n");
+		return 2;
+	}
+
 	if (list_interfaces)
 	{
-		ULONG size;
-		DWORD err = GetIfTable(nullptr, &size, TRUE);
-		if (err != ERROR_INSUFFICIENT_BUFFER)
-			throw std::system_error(err, std::system_category());
+		print_capture_interfaces();
+		return 0;
+	}
 
-		std::vector<std::byte> buf(size);
-		err = GetIfTable((PMIB_IFTABLE)buf.data(), &size, TRUE);
-		if (err != NO_ERROR)
-			throw std::system_error(err, std::system_category());
+	if (!out_path.empty() && !stream_to.empty())
+	{
+		fprintf(stderr, "error: -w and --stream can't be used together\n");
+		return 2;
+	}
 
-		PMIB_IFTABLE iftable = (PMIB_IFTABLE)buf.data();
+	std::string stream_host, stream_port;
+	if (!stream_to.empty())
+		split_host_port(stream_to, stream_host, stream_port);
 
-		for (DWORD i = 0; i != iftable->dwNumEntries; ++i)
+	if (!repair_path.empty())
+	{
+		auto stats = repair_capture(repair_path, out_path, write_index);
+
+		fprintf(stderr, "%s: %llu consistent blocks, %llu packets\n", repair_path.string().c_str(),
+			(unsigned long long)stats.blocks, (unsigned long long)stats.packets);
+		for (auto const & [offset, length]: stats.damaged)
+			fprintf(stderr, "damaged: %llu bytes at offset %llu\n", (unsigned long long)length, (unsigned long long)offset);
+		if (stats.orphaned_blocks != 0)
+			fprintf(stderr, "dropped %llu blocks of interfaces lost with the damage\n", (unsigned long long)stats.orphaned_blocks);
+		if (!stats.damaged.empty())
+			fprintf(stderr, "lost %llu bytes\n", (unsigned long long)stats.lost_bytes);
+
+		if (!stats.repaired)
 		{
-			MIB_IFROW const & row = iftable->table[i];
-			if (row.dwType == IF_TYPE_ETHERNET_CSMACD)
-				printf("[%u] %s\n", row.dwIndex, row.bDescr);
+			fprintf(stderr, "error: the capture is damaged before its end; use -w to copy what's left to a new file\n");
+			return 1;
 		}
 
+		if (stats.index_rebuilt)
+			fprintf(stderr, "rebuilt the index\n");
 		return 0;
 	}
 
-	if (out_path.empty())
+	if (out_path.empty() && (!extract_path.empty() || ring_size != 0 || !trigger_on.empty() || write_index || threads > 1 || flow_files != 0 || !shed_steps.empty() || checkpoint != 0))
 	{
-		print_help();
+		fprintf(stderr, "error: --extract, --ring, --trigger, --index, --threads, --split-flows, --shed and --checkpoint require -w\n");
 		return 2;
 	}
 
-	_start_service(L"ndiscap");
-	_ndiscap_sentry ndiscap;
+	if (ring_size == 0 && (ring_seconds != 0 || !dump_event.empty() || !dump_on.empty()))
+	{
+		fprintf(stderr, "error: --ring-seconds, --dump-event and --dump-on require --ring\n");
+		return 2;
+	}
 
-	alignas(EVENT_TRACE_PROPERTIES) std::byte buf[sizeof(EVENT_TRACE_PROPERTIES) + 2048] = {};
-	EVENT_TRACE_PROPERTIES * etp = (EVENT_TRACE_PROPERTIES *)buf;
+	if (trigger_on.empty() && !stop_on.empty())
+	{
+		fprintf(stderr, "error: --stop-on requires --trigger\n");
+		return 2;
+	}
 
-	ULONG err;
-	TRACEHANDLE etw_session;
-	for (;;)
+	if (merge)
 	{
-		etp->Wnode.BufferSize = sizeof buf;
-		etp->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
-		etp->LogFileMode = EVENT_TRACE_REAL_TIME_MODE;
-		etp->LogFileNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
-		etp->LoggerNameOffset = etp->LogFileNameOffset + 1024;
+		if (out_path.empty() || args.empty())
+		{
+			fprintf(stderr, "error: --merge requires -w and at least one input file\n");
+			return 2;
+		}
+
+		std::vector<std::filesystem::path> inputs;
+		for (auto const & arg: args)
+			inputs.push_back(from_utf8(arg));
 
-		err = StartTraceW(&etw_session, L"wncap", etp);
-		if (err == ERROR_ALREADY_EXISTS)
+		// Large chunks written from a background thread keep the output
+		// streaming while the inputs are read.
+		capture_merger merger(inputs);
+		pcapng_writer w(out_path, 16 << 20, 4);
+		if (write_index)
 		{
-			ControlTraceW(0, L"wncap", etp, EVENT_TRACE_CONTROL_STOP);
-			continue;
+			auto index_path = out_path;
+			index_path += ".idx";
+			w.enable_index(index_path);
 		}
 
-		if (err == ERROR_SUCCESS)
-			break;
+		auto stats = merger.merge(w);
+		w.flush();
 
-		return err;
+		fprintf(stderr, "merged %llu packets from %zu files, %llu interfaces\n",
+			(unsigned long long)stats.packets, inputs.size(), (unsigned long long)stats.interfaces);
+		if (stats.skipped_blocks != 0)
+			fprintf(stderr, "warning: skipped %llu blocks of other types\n", (unsigned long long)stats.skipped_blocks);
+		for (auto const & [path, offset]: stats.truncated)
+		{
+			fprintf(stderr, "warning: %s ends in an incomplete block at offset %llu, which was left out\n",
+				path.string().c_str(), (unsigned long long)offset);
+		}
+		return 0;
 	}
 
-	err = EnableTraceEx(&Microsoft_Windows_NDIS_PacketCapture::id, nullptr, etw_session, TRUE, 0xff, 0xffff'ffff'ffff'ffff, 0, 0, nullptr);
+	if (!extract_path.empty())
+	{
+		auto index_path = extract_path;
+		index_path += ".idx";
 
-	std::shared_ptr<pcapng_writer> w;
-	w = std::make_shared<pcapng_writer>(out_path);
+		pcapng_writer w(out_path);
+		auto stats = extract_indexed(extract_path, index_path, w, time_from, time_to, packet_filter::compile(expr));
+		w.flush();
 
-	ndis_packetcapture_consumer consumer(w, snaplen);
+		fprintf(stderr, "extracted %llu packets, read %llu of %llu indexed runs\n",
+			(unsigned long long)stats.packets, (unsigned long long)stats.runs_read, (unsigned long long)stats.runs);
+		return 0;
+	}
 
-	struct consume_ctx_t
+	if ((ring_size != 0 || !trigger_on.empty())
+		&& (threads > 1 || has_path_pattern(out_path, 'i') || (ring_size != 0 && !trigger_on.empty())))
 	{
-		TRACEHANDLE h;
-		ndis_packetcapture_consumer * consumer;
-	};
+		fprintf(stderr, "error: --ring and --trigger can't be combined with each other, --threads or per-interface output files\n");
+		return 2;
+	}
 
-	consume_ctx_t consume_ctx = {
-		.consumer = &consumer,
-	};
+	if (threads > 1 && has_path_pattern(out_path, 'i'))
+	{
+		fprintf(stderr, "error: --threads can't be used with per-interface output files\n");
+		return 2;
+	}
+
+	if ((flow_files != 0) != has_path_pattern(out_path, 'h'))
+	{
+		fprintf(stderr, "error: --split-flows requires a file name with %%h and vice versa\n");
+		return 2;
+	}
 
-	EVENT_TRACE_LOGFILEW logfile = {};
-	logfile.LoggerName = (LPWSTR)L"wncap";
-	logfile.ProcessTraceMode = PROCESS_TRACE_MODE_REAL_TIME | PROCESS_TRACE_MODE_EVENT_RECORD;
-	logfile.Context = &consume_ctx;
-	logfile.EventRecordCallback = [](PEVENT_RECORD EventRecord) {
-		auto * ctx = (consume_ctx_t *)EventRecord->UserContext;
-		try
+	if (flow_files != 0 && (ring_size != 0 || !trigger_on.empty() || threads > 1 || write_index || has_path_pattern(out_path, 'i')))
+	{
+		fprintf(stderr, "error: --split-flows can't be combined with --ring, --trigger, --threads, --index or per-interface output files\n");
+		return 2;
+	}
+
+	if (!shed_steps.empty() && (ring_size != 0 || !trigger_on.empty() || threads > 1 || flow_files != 0 || has_path_pattern(out_path, 'i')))
+	{
+		fprintf(stderr, "error: --shed can't be combined with --ring, --trigger, --threads, --split-flows or per-interface output files\n");
+		return 2;
+	}
+
+	if (checkpoint != 0 && (ring_size != 0 || flow_files != 0 || has_path_pattern(out_path, 'i')))
+	{
+		fprintf(stderr, "error: --checkpoint can't be combined with --ring, --split-flows or per-interface output files\n");
+		return 2;
+	}
+
+	if (write_index && (ring_size != 0 || has_path_pattern(out_path, 'i')))
+	{
+		fprintf(stderr, "error: --index can't be used with --ring or per-interface output files\n");
+		return 2;
+	}
+
+	packet_filter capture_filter = packet_filter::compile(expr);
+	packet_filter dump_filter = packet_filter::compile(dump_on);
+	packet_filter trigger_filter = packet_filter::compile(trigger_on);
+	packet_filter stop_filter = packet_filter::compile(stop_on);
+
+	std::vector<fanout_output> outputs;
+	for (auto const & spec: output_specs)
+		outputs.push_back(_parse_output_spec(spec));
+	if (!columns_path.empty())
+		outputs.push_back({ .sink = std::make_shared<column_writer>(columns_path) });
+
+	std::shared_ptr<tcp_reassembler> reassembler;
+	if (!reassemble_dir.empty())
+	{
+		reassembler = std::make_shared<tcp_reassembler>(reassemble_dir, reassembly_memory, reassembly_flow_memory);
+		outputs.push_back({ .sink = reassembler });
+	}
+
+	auto make_writer = [&] {
+		// The load shedder needs a write-behind queue to watch,
+		// and checkpoints shouldn't stall the capture.
+		auto r = shed_steps.empty() && checkpoint == 0
+			? std::make_shared<pcapng_writer>(out_path)
+			: std::make_shared<pcapng_writer>(out_path, pcapng_writer::default_buffer_size, 4);
+		r->enable_checkpoints(checkpoint * 1'000'000);
+		if (write_index)
 		{
-			ctx->consumer->push_trace(EventRecord);
+			auto index_path = out_path;
+			index_path += ".idx";
+			r->enable_index(index_path);
 		}
-		catch (std::exception const & e)
+		return r;
+	};
+
+	std::shared_ptr<packet_sink> w;
+	std::shared_ptr<flight_recorder> recorder;
+	if (!stream_to.empty())
+	{
+		w = std::make_shared<pcapng_stream>(stream_host, stream_port);
+	}
+	else if (out_path.empty())
+	{
+		// Without -w, the packets are printed, unless they all go to other outputs.
+		if (outputs.empty())
+			w = std::make_shared<text_printer>(std::make_shared<stdout_output>(), print_link_header, quiet);
+	}
+	else if (!trigger_on.empty())
+	{
+		w = std::make_shared<trigger_window>(make_writer(),
+			std::move(trigger_filter), std::move(stop_filter),
+			pre_roll * 1'000'000, post_roll * 1'000'000, pre_roll_size);
+	}
+	else if (ring_size != 0)
+	{
+		recorder = std::make_shared<flight_recorder>(out_path, ring_size, ring_seconds * 1'000'000, std::move(dump_filter));
+		w = recorder;
+	}
+	else if (flow_files != 0)
+	{
+		w = std::make_shared<flow_hash_writer>(out_path, flow_files);
+	}
+	else if (has_path_pattern(out_path, 'i'))
+	{
+		w = std::make_shared<per_interface_writer>(out_path);
+	}
+	else if (threads > 1)
+	{
+		// The workers apply the capture filter and the content patterns,
+		// unless other outputs need them first or matches open whole flows.
+		packet_filter pipeline_filter;
+		std::optional<content_matcher> pipeline_content;
+		if (outputs.empty())
 		{
-			CloseTrace(ctx->h);
-			fprintf(stderr, "error: %s\n", e.what());
+			pipeline_filter = std::exchange(capture_filter, packet_filter{});
+			if (!content_patterns.empty() && !content_flows)
+				pipeline_content.emplace(std::exchange(content_patterns, {}));
 		}
-	};
+
+		w = std::make_shared<packet_pipeline>(make_writer(), threads, std::move(pipeline_filter), std::move(pipeline_content));
+	}
+	else if (!shed_steps.empty())
+	{
+		w = std::make_shared<load_shedder>(make_writer(), shed_steps, shed_target);
+	}
+	else
+	{
+		w = make_writer();
+	}
+
+	if (w)
+		outputs.insert(outputs.begin(), { .sink = w });
+	if (outputs.size() == 1 && capture_filter.empty())
+		w = outputs.front().sink;
+	else
+		w = std::make_shared<packet_fanout>(std::move(capture_filter), std::move(outputs));
+
+	if (!content_patterns.empty())
+		w = std::make_shared<content_filter>(w, content_matcher(content_patterns), content_flows);
+
+#ifdef _WIN32
+	ndiscap_source source(w, snaplen, selection, session_name);
+
+	std::unique_ptr<named_event_listener> dump_listener;
+	if (!dump_event.empty())
+	{
+		dump_listener = std::make_unique<named_event_listener>(from_utf8(dump_event), [&] {
+			try
+			{
+				recorder->dump();
+			}
+			catch (std::exception const & e)
+			{
+				fprintf(stderr, "error: %s\n", e.what());
+			}
+		});
+	}
+#else
+	af_packet_source source(w, snaplen, selection, capture_ifname, capture_threads);
+#endif
 
 	{
-		consume_ctx.h = OpenTraceW(&logfile);
 		sigint_handler sigint([&] {
-			CloseTrace(consume_ctx.h);
+			source.stop();
 		});
 
-		ProcessTrace(&consume_ctx.h, 1, nullptr, nullptr);
+		source.run();
+	}
+
+#ifdef _WIN32
+	dump_listener.reset();
+#endif
+	w->flush();
+
+	if (reassembler)
+	{
+		auto const & stats = reassembler->stats();
+		fprintf(stderr, "reassembled %llu streams, %llu bytes, %llu bytes lost\n",
+			(unsigned long long)stats.streams, (unsigned long long)stats.bytes, (unsigned long long)stats.lost_bytes);
+		if (stats.dropped_streams != 0)
+			fprintf(stderr, "dropped %llu streams whose files couldn't be opened\n", (unsigned long long)stats.dropped_streams);
 	}
 
-	ControlTraceW(etw_session, nullptr, etp, EVENT_TRACE_CONTROL_STOP);
+	for (auto const & warning: source.warnings())
+		fprintf(stderr, "warning: %s\n", warning.c_str());
 	return 0;
 }
 
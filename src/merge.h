@@ -0,0 +1,301 @@
+#pragma once
+#include "mmap.h"
+#include "pcapng.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Repeatedly picks the smallest of `count` leaves.
+//
+// Each inner node remembers the loser of the match played there, so when
+// the winner's key changes, only the matches on its path to the root are
+// replayed: log2(count) comparisons, against nodes that don't move.
+template <typename Less>
+struct loser_tree
+{
+	loser_tree(size_t count, Less less)
+		: _less(std::move(less)), _nodes(count, count)
+	{
+		// The virtual leaf `count` beats everything, so the first pass
+		// fills the tree from the bottom.
+		for (size_t i = count; i-- != 0;)
+			this->_adjust(i);
+	}
+
+	size_t winner() const noexcept
+	{
+		return _nodes[0];
+	}
+
+	// Restores the order after the key of the winner changed.
+	void replay()
+	{
+		this->_adjust(_nodes[0]);
+	}
+
+private:
+	bool _beats(size_t a, size_t b)
+	{
+		size_t n = _nodes.size();
+		if (a == n)
+			return true;
+		if (b == n)
+			return false;
+		return _less(a, b);
+	}
+
+	void _adjust(size_t leaf)
+	{
+		size_t n = _nodes.size();
+		for (size_t t = (leaf + n) / 2; t != 0; t /= 2)
+		{
+			if (this->_beats(_nodes[t], leaf))
+				std::swap(leaf, _nodes[t]);
+		}
+
+		_nodes[0] = leaf;
+	}
+
+	Less _less;
+	std::vector<size_t> _nodes;
+};
+
+struct merge_stats
+{
+	uint64_t packets = 0;
+
+	// The interfaces written, after removing duplicates.
+	uint64_t interfaces = 0;
+
+	// Blocks other than sections, interfaces, packets and statistics.
+	uint64_t skipped_blocks = 0;
+
+	// The inputs that end in an incomplete block, as left by a writer that
+	// was killed, and the offset of that block. They are merged up to it.
+	std::vector<std::pair<std::filesystem::path, uint64_t>> truncated;
+};
+
+// Merges pcapng files into one, ordering the packets by timestamp.
+//
+// The inputs are mapped into memory and read sequentially, with read-ahead,
+// and a loser tree picks the input with the earliest packet or statistics
+// block next. Interface descriptions that are identical byte for byte, as
+// in files split by hash or rotation, are written only once, and the
+// interface ids of the blocks are remapped to the merged interfaces. Packets
+// with equal timestamps keep the order of the inputs.
+//
+// Only little-endian sections are supported. Timestamps are compared in
+// the resolution of their interface. An input that ends in an incomplete
+// block, or in zeros, is merged up to there; other damage is an error.
+struct capture_merger
+{
+	explicit capture_merger(std::vector<std::filesystem::path> const & inputs)
+	{
+		for (auto const & path: inputs)
+		{
+			auto & in = _inputs.emplace_back();
+			in.path = path;
+			in.file = std::make_unique<mapped_file>(path);
+			in.data = in.file->data();
+		}
+	}
+
+	merge_stats merge(pcapng_writer & out)
+	{
+		for (auto & in: _inputs)
+			this->_advance(in, out);
+
+		auto less = [this](size_t a, size_t b) {
+			_input_t const & x = _inputs[a];
+			_input_t const & y = _inputs[b];
+			if (x.done != y.done)
+				return y.done;
+			return x.key < y.key || (x.key == y.key && a < b);
+		};
+
+		loser_tree tree(_inputs.size(), less);
+		for (;;)
+		{
+			_input_t & in = _inputs[tree.winner()];
+			if (in.done)
+				break;
+
+			out.add_block(in.block, in.intfs[in.block_intf].id);
+			this->_advance(in, out);
+			tree.replay();
+		}
+
+		return _stats;
+	}
+
+private:
+	// Read ahead this much, and again when half of it has been consumed.
+	static constexpr size_t _prefetch_size = 32 << 20;
+
+	struct _intf_t
+	{
+		uint32_t id;
+
+		// Converts the timestamps to nanoseconds.
+		timestamp_scale scale;
+	};
+
+	struct _input_t
+	{
+		std::filesystem::path path;
+		std::unique_ptr<mapped_file> file;
+		std::span<std::byte const> data;
+		size_t pos = 0;
+		size_t prefetched = 0;
+
+		// The interfaces of the current section.
+		std::vector<_intf_t> intfs;
+
+		// The current packet or statistics block.
+		std::span<std::byte const> block;
+		uint32_t block_intf = 0;
+		uint64_t key = 0;
+		bool done = false;
+	};
+
+	[[noreturn]] static void _corrupt(_input_t const & in)
+	{
+		throw std::runtime_error(in.path.string() + ": invalid block at offset " + std::to_string(in.pos));
+	}
+
+	// Whether the rest of the input is a block cut short, or the zeros
+	// that a file system may leave after the last write before a crash.
+	static bool _truncated(_input_t const & in) noexcept
+	{
+		std::span<std::byte const> rest = in.data.subspan(in.pos);
+		if (rest.size() < 12)
+			return true;
+
+		uint32_t len;
+		memcpy(&len, rest.data() + 4, 4);
+		if (len >= 12 && len % 4 == 0 && len > rest.size())
+			return true;
+
+		return std::all_of(rest.begin(), rest.end(), [](std::byte b) { return b == std::byte{}; });
+	}
+
+	// Moves to the next packet or statistics block of the input, passing
+	// the new interface descriptions on to the output on the way.
+	void _advance(_input_t & in, pcapng_writer & out)
+	{
+		while (in.pos != in.data.size())
+		{
+			if (in.pos >= in.prefetched)
+			{
+				in.file->prefetch(in.pos, _prefetch_size);
+				in.prefetched = in.pos + _prefetch_size / 2;
+			}
+
+			uint32_t type = 0, len = 0;
+			size_t rest = in.data.size() - in.pos;
+			if (rest >= 12)
+			{
+				memcpy(&type, in.data.data() + in.pos, 4);
+				memcpy(&len, in.data.data() + in.pos + 4, 4);
+			}
+
+			if (len < 12 || len % 4 != 0 || len > rest)
+			{
+				if (!_truncated(in))
+					_corrupt(in);
+
+				_stats.truncated.push_back({ in.path, (uint64_t)in.pos });
+				break;
+			}
+
+			std::span<std::byte const> block = in.data.subspan(in.pos, len);
+			switch (type)
+			{
+			case 0x0a0d0d0a:
+			{
+				uint32_t magic;
+				if (len < 28)
+					_corrupt(in);
+				memcpy(&magic, block.data() + 8, 4);
+				if (magic != 0x1a2b3c4d)
+					throw std::runtime_error(in.path.string() + ": only little-endian captures can be merged");
+
+				in.intfs.clear();
+				break;
+			}
+
+			case 1:
+				if (len < 20)
+					_corrupt(in);
+				in.intfs.push_back(this->_add_interface(in, block, out));
+				break;
+
+			case 5:
+			case 6:
+			{
+				uint32_t intf, ts_hi, ts_lo;
+				if (len < 24)
+					_corrupt(in);
+				memcpy(&intf, block.data() + 8, 4);
+				memcpy(&ts_hi, block.data() + 12, 4);
+				memcpy(&ts_lo, block.data() + 16, 4);
+				if (intf >= in.intfs.size())
+					_corrupt(in);
+
+				_intf_t const & i = in.intfs[intf];
+				in.block = block;
+				in.block_intf = intf;
+				in.key = i.scale(((uint64_t)ts_hi << 32) | ts_lo);
+				in.pos += len;
+				if (type == 6)
+					++_stats.packets;
+				return;
+			}
+
+			default:
+				++_stats.skipped_blocks;
+				break;
+			}
+
+			in.pos += len;
+		}
+
+		in.done = true;
+	}
+
+	_intf_t _add_interface(_input_t const & in, std::span<std::byte const> block, pcapng_writer & out)
+	{
+		auto scale = timestamp_scale::of_interface(block, 9);
+		if (!scale)
+			throw std::runtime_error(in.path.string() + ": unsupported timestamp resolution");
+
+		_intf_t r = { .id = 0, .scale = *scale };
+
+		std::string key((char const *)block.data(), block.size());
+		auto it = _intfs.find(key);
+		if (it == _intfs.end())
+		{
+			out.add_block(block);
+			it = _intfs.emplace(std::move(key), (uint32_t)_intfs.size()).first;
+			++_stats.interfaces;
+		}
+
+		r.id = it->second;
+		return r;
+	}
+
+	std::vector<_input_t> _inputs;
+
+	// The interface descriptions written so far, by their encoded block.
+	std::map<std::string, uint32_t> _intfs;
+	merge_stats _stats;
+};
@@ -0,0 +1,139 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <span>
+#include <system_error>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A read-only view of a whole file.
+struct mapped_file
+{
+	explicit mapped_file(std::filesystem::path const & path)
+	{
+#ifdef _WIN32
+		_h = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+		if (_h == INVALID_HANDLE_VALUE)
+			throw std::system_error(GetLastError(), std::system_category());
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_h, &size))
+		{
+			DWORD err = GetLastError();
+			CloseHandle(_h);
+			throw std::system_error(err, std::system_category());
+		}
+
+		_size = (size_t)size.QuadPart;
+		if (_size == 0)
+			return;
+
+		_mapping = CreateFileMappingW(_h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!_mapping)
+		{
+			DWORD err = GetLastError();
+			CloseHandle(_h);
+			throw std::system_error(err, std::system_category());
+		}
+
+		_data = (std::byte const *)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!_data)
+		{
+			DWORD err = GetLastError();
+			CloseHandle(_mapping);
+			CloseHandle(_h);
+			throw std::system_error(err, std::system_category());
+		}
+#else
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			throw std::system_error(errno, std::system_category());
+
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			int err = errno;
+			::close(fd);
+			throw std::system_error(err, std::system_category());
+		}
+
+		// The mapping keeps the file open on its own.
+		_size = (size_t)st.st_size;
+		if (_size != 0)
+		{
+			void * p = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED)
+			{
+				int err = errno;
+				::close(fd);
+				throw std::system_error(err, std::system_category());
+			}
+
+			_data = (std::byte const *)p;
+		}
+
+		::close(fd);
+#endif
+	}
+
+	~mapped_file()
+	{
+#ifdef _WIN32
+		if (_data)
+			UnmapViewOfFile(_data);
+		if (_mapping)
+			CloseHandle(_mapping);
+		CloseHandle(_h);
+#else
+		if (_data)
+			munmap((void *)_data, _size);
+#endif
+	}
+
+	mapped_file(mapped_file const &) = delete;
+	mapped_file & operator=(mapped_file const &) = delete;
+
+	std::span<std::byte const> data() const noexcept
+	{
+		return { _data, _size };
+	}
+
+	// Asks the system to read a range of the file ahead of its use.
+	void prefetch(size_t offset, size_t length) const noexcept
+	{
+		if (offset >= _size)
+			return;
+
+		length = (std::min)(length, _size - offset);
+#ifdef _WIN32
+		WIN32_MEMORY_RANGE_ENTRY range = {
+			.VirtualAddress = (PVOID)(_data + offset),
+			.NumberOfBytes = length,
+		};
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+		// The advice has to start on a page boundary.
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		size_t start = offset / page * page;
+		madvise((void *)(_data + start), length + (offset - start), MADV_WILLNEED);
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE _h;
+	HANDLE _mapping = nullptr;
+#endif
+	std::byte const * _data = nullptr;
+	size_t _size = 0;
+};
@@ -0,0 +1,468 @@
+#pragma once
+#include "comptr.h"
+#include "hr.h"
+#include "keywords.h"
+#include "packet_sink.h"
+#include "packet_source.h"
+#include "registry.h"
+#include "utf8.h"
+
+#include <windows.h>
+#include <evntrace.h>
+#include <evntcons.h>
+#include <iphlpapi.h>
+#include <objbase.h>
+#include <Netcfgx.h>
+#include <devguid.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Microsoft_Windows_NDIS_PacketCapture {
+	static constexpr GUID id = { 0x2ED6006E, 0x4729, 0x4609, { 0xB4, 0x23, 0x3E, 0xE7, 0xBC, 0xD6, 0x78, 0xEF } };
+
+	enum: uint32_t
+	{
+		packet_fragment = 1001,
+	};
+}
+
+template <typename T>
+inline bool read_ne(std::span<std::byte const> & data, T & out) noexcept
+{
+	if (data.size() < sizeof(T))
+		return false;
+	memcpy(&out, data.data(), sizeof(T));
+	data = data.subspan(sizeof(T));
+	return true;
+}
+
+struct ndis_packetcapture_consumer
+{
+	ndis_packetcapture_consumer(std::shared_ptr<packet_sink> writer, size_t snaplen, capture_selection selection = {})
+		: _writer(std::move(writer)), _snaplen(snaplen), _selection(selection)
+	{
+	}
+
+	// Events that can't be parsed are counted and skipped, they don't
+	// interrupt the capture.
+	uint64_t malformed_events() const noexcept
+	{
+		return _malformed_events;
+	}
+
+	void push_trace(PEVENT_RECORD event)
+	{
+		if (event->EventHeader.ProviderId != Microsoft_Windows_NDIS_PacketCapture::id)
+			return;
+
+		auto const & ed = event->EventHeader.EventDescriptor;
+
+		// The provider should only send what the keyword masks selected,
+		// but older systems don't always put the keywords on their events.
+		if (!_selection.match(ed.Keyword))
+			return;
+
+		std::span<std::byte const> data = { (std::byte const *)event->UserData, event->UserDataLength };
+
+		switch ((ed.Version << 16) | ed.Id)
+		{
+		case Microsoft_Windows_NDIS_PacketCapture::packet_fragment:
+		{
+			uint32_t miniport_intf_index;
+			uint32_t lower_intf_index;
+			uint32_t fragment_size;
+			if (!read_ne(data, miniport_intf_index)
+				|| !read_ne(data, lower_intf_index)
+				|| !read_ne(data, fragment_size)
+				|| data.size() < fragment_size)
+			{
+				++_malformed_events;
+				return;
+			}
+
+			auto it = _intfs.find(miniport_intf_index);
+			if (it == _intfs.end())
+			{
+				MIB_IFROW row = {};
+				row.dwIndex = miniport_intf_index;
+				if (GetIfEntry(&row) != 0)
+					return;
+
+				auto ifidx = _writer->add_interface({
+					.index = miniport_intf_index,
+					.link_type = (uint16_t)row.dwType,
+					.name = to_utf8(row.wszName),
+					.desc = (char const *)row.bDescr,
+					.snaplen = _snaplen,
+					});
+				it = _intfs.emplace(miniport_intf_index, ifidx).first;
+			}
+
+			std::span<std::byte const> fragment(data.data(), fragment_size);
+			_writer->add_packet(it->second, (event->EventHeader.TimeStamp.QuadPart / 10) - 11644473600000000l,
+				fragment.subspan(0, (std::min)(fragment.size(), _snaplen)), fragment.size(),
+				capture_selection::epb_direction(ed.Keyword));
+			break;
+		}
+		}
+	}
+
+	void tick()
+	{
+		_writer->tick();
+	}
+
+private:
+	std::shared_ptr<packet_sink> _writer;
+	std::map<uint32_t, uint32_t> _intfs;
+	size_t _snaplen;
+	capture_selection _selection;
+	uint64_t _malformed_events = 0;
+};
+
+
+template <typename F>
+void foreach_net_binding(LPCWSTR component_name, F && fn)
+{
+	comptr<INetCfg> netcfg;
+	hrtry CoCreateInstance(CLSID_CNetCfg, nullptr, CLSCTX_INPROC_SERVER, IID_INetCfg, (void **)~netcfg);
+
+	auto lock = netcfg.query<INetCfgLock>();
+	hrtry lock->AcquireWriteLock(5000, L"ndisdump", nullptr);
+
+	hrtry netcfg->Initialize(nullptr);
+
+	comptr<INetCfgComponent> ndiscap;
+	hrtry netcfg->FindComponent(component_name, ~ndiscap);
+
+	auto bindings = ndiscap.query<INetCfgComponentBindings>();
+
+	comptr<IEnumNetCfgBindingPath> binding_paths;
+	hrtry bindings->EnumBindingPaths(EBP_ABOVE, ~binding_paths);
+
+	for (;;)
+	{
+		comptr<INetCfgBindingPath> path;
+
+		ULONG fetched;
+		auto hr = hrtry binding_paths->Next(1, ~path, &fetched);
+		if (hr == S_FALSE)
+			break;
+
+		fn(path);
+	}
+
+	hrtry netcfg->Apply();
+	hrtry lock->ReleaseWriteLock();
+}
+
+struct _ndiscap_sentry
+{
+	_ndiscap_sentry()
+		: _key(win32_reg_handle::open_key(HKEY_LOCAL_MACHINE, LR"(SYSTEM\CurrentControlSet\Services\NdisCap\Parameters)", KEY_QUERY_VALUE | KEY_SET_VALUE))
+	{
+		uint32_t refcount = _key.query_dword(L"RefCount", 0);
+		_key.set_dword(L"RefCount", refcount + 1);
+
+		foreach_net_binding(L"ms_ndiscap", [](comptr<INetCfgBindingPath> const & path) {
+			hrtry path->Enable(TRUE);
+			});
+	}
+
+	~_ndiscap_sentry()
+	{
+		uint32_t refcount = _key.query_dword(L"RefCount", 0);
+		_key.set_dword(L"RefCount", refcount - 1);
+
+		if (refcount == 1)
+		{
+			foreach_net_binding(L"ms_ndiscap", [](comptr<INetCfgBindingPath> const & path) {
+				hrtry path->Enable(FALSE);
+				});
+		}
+	}
+
+private:
+	win32_reg_handle _key;
+};
+
+struct service_handle
+{
+	explicit service_handle(SC_HANDLE h) noexcept
+		: _h(h)
+	{
+	}
+
+	explicit operator bool() const noexcept
+	{
+		return _h != nullptr;
+	}
+
+	SC_HANDLE get() const noexcept
+	{
+		return _h;
+	}
+
+	~service_handle()
+	{
+		if (_h)
+			CloseServiceHandle(_h);
+	}
+
+	service_handle(service_handle && o) noexcept
+		: _h(std::exchange(o._h, nullptr))
+	{
+	}
+
+	service_handle & operator=(service_handle o) noexcept
+	{
+		std::swap(_h, o._h);
+		return *this;
+	}
+
+private:
+	SC_HANDLE _h;
+};
+
+inline void _start_service(LPCWSTR name)
+{
+	service_handle scman(OpenSCManagerW(nullptr, SERVICES_ACTIVE_DATABASEW, SC_MANAGER_CONNECT));
+	if (!scman)
+	{
+		DWORD err = GetLastError();
+		throw std::system_error(err, std::system_category());
+	}
+
+	service_handle service(OpenServiceW(scman.get(), name, SERVICE_QUERY_STATUS));
+	if (!service)
+	{
+		DWORD err = GetLastError();
+		throw std::system_error(err, std::system_category());
+	}
+
+	SERVICE_STATUS st = {};
+	if (!QueryServiceStatus(service.get(), &st))
+	{
+		DWORD err = GetLastError();
+		throw std::system_error(err, std::system_category());
+	}
+
+	if (st.dwCurrentState == SERVICE_RUNNING)
+		return;
+
+	service = service_handle(OpenServiceW(scman.get(), name, SERVICE_QUERY_STATUS | SERVICE_START));
+	if (!service)
+	{
+		DWORD err = GetLastError();
+		throw std::system_error(err, std::system_category());
+	}
+
+	while (st.dwCurrentState != SERVICE_RUNNING)
+	{
+		if (st.dwCurrentState == SERVICE_STOPPED)
+		{
+			if (!StartServiceW(service.get(), 0, nullptr))
+			{
+				DWORD err = GetLastError();
+				if (err != ERROR_SERVICE_ALREADY_RUNNING)
+					throw std::system_error(err, std::system_category());
+			}
+		}
+
+		Sleep(st.dwWaitHint);
+
+		if (!QueryServiceStatus(service.get(), &st))
+		{
+			DWORD err = GetLastError();
+			throw std::system_error(err, std::system_category());
+		}
+	}
+}
+
+// Captures with the ndiscap.sys filter through a real-time ETW session.
+//
+// The filter is bound to the network adapters for the lifetime of
+// the source, unless another capture still holds it, and the session
+// is stopped again in the destructor.
+struct ndiscap_source final
+	: packet_source
+{
+	ndiscap_source(std::shared_ptr<packet_sink> sink, size_t snaplen, capture_selection selection, std::wstring session_name)
+		: _consumer(std::move(sink), snaplen, selection), _session_name(std::move(session_name))
+	{
+		_start_service(L"ndiscap");
+		_ndiscap = std::make_unique<_ndiscap_sentry>();
+
+		EVENT_TRACE_PROPERTIES * etp = (EVENT_TRACE_PROPERTIES *)_etp_buf;
+		memset(_etp_buf, 0, sizeof _etp_buf);
+		etp->Wnode.BufferSize = sizeof _etp_buf;
+		etp->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
+		etp->LogFileMode = EVENT_TRACE_REAL_TIME_MODE;
+		etp->LogFileNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+		etp->LoggerNameOffset = etp->LogFileNameOffset + 1024;
+
+		// The session may belong to another capture, or to another tool
+		// altogether, so it's not ours to stop.
+		ULONG err = StartTraceW(&_session, _session_name.c_str(), etp);
+		if (err == ERROR_ALREADY_EXISTS)
+		{
+			throw std::runtime_error("the ETW session " + to_utf8(_session_name)
+				+ " already exists; choose another name with --session, or stop it with `logman stop "
+				+ to_utf8(_session_name) + " -ets` if it was left over from a crashed capture");
+		}
+
+		if (err != ERROR_SUCCESS)
+			throw std::system_error(err, std::system_category());
+
+		EnableTraceEx(&Microsoft_Windows_NDIS_PacketCapture::id, nullptr, _session, TRUE, 0xff,
+			selection.match_any_keyword(), selection.match_all_keyword(), 0, nullptr);
+	}
+
+	~ndiscap_source()
+	{
+		ControlTraceW(_session, nullptr, (EVENT_TRACE_PROPERTIES *)_etp_buf, EVENT_TRACE_CONTROL_STOP);
+	}
+
+	ndiscap_source(ndiscap_source const &) = delete;
+	ndiscap_source & operator=(ndiscap_source const &) = delete;
+
+	void run() override
+	{
+		EVENT_TRACE_LOGFILEW logfile = {};
+		logfile.LoggerName = _session_name.data();
+		logfile.ProcessTraceMode = PROCESS_TRACE_MODE_REAL_TIME | PROCESS_TRACE_MODE_EVENT_RECORD;
+		logfile.Context = this;
+		logfile.EventRecordCallback = [](PEVENT_RECORD EventRecord) {
+			auto * self = (ndiscap_source *)EventRecord->UserContext;
+			try
+			{
+				std::lock_guard<std::mutex> lock(self->_sink_mutex);
+				self->_consumer.push_trace(EventRecord);
+			}
+			catch (std::exception const & e)
+			{
+				self->stop();
+				fprintf(stderr, "error: %s\n", e.what());
+			}
+		};
+
+		TRACEHANDLE h = OpenTraceW(&logfile);
+		if (h == INVALID_PROCESSTRACE_HANDLE)
+			throw std::system_error(GetLastError(), std::system_category());
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_stopping)
+			{
+				CloseTrace(h);
+				return;
+			}
+
+			_trace = h;
+		}
+
+		// ETW only calls back when there are events, so the ticks
+		// come from a thread of their own.
+		std::thread ticker([this] { this->_tick_loop(); });
+		ProcessTrace(&h, 1, nullptr, nullptr);
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_cv.notify_all();
+		ticker.join();
+	}
+
+	void stop() override
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+			if (_trace != INVALID_PROCESSTRACE_HANDLE)
+				CloseTrace(std::exchange(_trace, INVALID_PROCESSTRACE_HANDLE));
+		}
+		_cv.notify_all();
+	}
+
+	std::vector<std::string> warnings() const override
+	{
+		std::vector<std::string> r;
+		if (_consumer.malformed_events() != 0)
+			r.push_back("skipped " + std::to_string(_consumer.malformed_events()) + " malformed events");
+		return r;
+	}
+
+private:
+	void _tick_loop()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (!_cv.wait_for(lock, std::chrono::milliseconds(tick_interval_ms), [&] { return _stopping; }))
+		{
+			lock.unlock();
+			try
+			{
+				std::lock_guard<std::mutex> sink_lock(_sink_mutex);
+				_consumer.tick();
+			}
+			catch (std::exception const & e)
+			{
+				this->stop();
+				fprintf(stderr, "error: %s\n", e.what());
+			}
+			lock.lock();
+		}
+	}
+
+	// Guards the consumer and the sink behind it,
+	// which the ticks share with the ETW callbacks.
+	std::mutex _sink_mutex;
+	ndis_packetcapture_consumer _consumer;
+	std::wstring _session_name;
+	std::unique_ptr<_ndiscap_sentry> _ndiscap;
+
+	alignas(EVENT_TRACE_PROPERTIES) std::byte _etp_buf[sizeof(EVENT_TRACE_PROPERTIES) + 2048];
+	TRACEHANDLE _session = 0;
+
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	TRACEHANDLE _trace = INVALID_PROCESSTRACE_HANDLE;
+	bool _stopping = false;
+};
+
+// Prints the Ethernet adapters, which are the ones the filter binds to.
+inline void print_capture_interfaces()
+{
+	ULONG size;
+	DWORD err = GetIfTable(nullptr, &size, TRUE);
+	if (err != ERROR_INSUFFICIENT_BUFFER)
+		throw std::system_error(err, std::system_category());
+
+	std::vector<std::byte> buf(size);
+	err = GetIfTable((PMIB_IFTABLE)buf.data(), &size, TRUE);
+	if (err != NO_ERROR)
+		throw std::system_error(err, std::system_category());
+
+	PMIB_IFTABLE iftable = (PMIB_IFTABLE)buf.data();
+
+	for (DWORD i = 0; i != iftable->dwNumEntries; ++i)
+	{
+		MIB_IFROW const & row = iftable->table[i];
+		if (row.dwType == IF_TYPE_ETHERNET_CSMACD)
+			printf("[%u] %s\n", row.dwIndex, row.bDescr);
+	}
+}
@@ -0,0 +1,627 @@
+#pragma once
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "output.h"
+#include "packet_sink.h"
+#include "pcapng.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// Keeps Winsock initialized for the lifetime of the object.
+struct winsock_scope
+{
+#ifdef _WIN32
+	winsock_scope()
+	{
+		WSADATA wd;
+		if (int err = WSAStartup(MAKEWORD(2, 2), &wd))
+			throw std::system_error(err, std::system_category());
+	}
+
+	~winsock_scope()
+	{
+		WSACleanup();
+	}
+#else
+	winsock_scope()
+	{
+	}
+#endif
+
+	winsock_scope(winsock_scope const &) = delete;
+	winsock_scope & operator=(winsock_scope const &) = delete;
+};
+
+// Splits "host:port" or "[v6-address]:port".
+inline void split_host_port(std::string_view addr, std::string & host, std::string & port)
+{
+	size_t colon = addr.rfind(':');
+	if (colon == std::string_view::npos || colon == 0 || colon + 1 == addr.size())
+		throw std::runtime_error("expected HOST:PORT");
+
+	std::string_view h = addr.substr(0, colon);
+	if (h.size() >= 2 && h.front() == '[' && h.back() == ']')
+		h = h.substr(1, h.size() - 2);
+
+	host.assign(h);
+	port.assign(addr.substr(colon + 1));
+}
+
+// A connected TCP socket.
+//
+// The socket is non-blocking; connecting and sending wait for it
+// in short slices and give up with `operation_canceled` as soon as
+// `cancel` is set, so that a stalled peer can't hold up the caller.
+struct tcp_connection
+{
+	static constexpr int poll_interval_ms = 100;
+
+	tcp_connection(std::string const & host, std::string const & port, std::atomic<bool> const & cancel)
+		: _cancel(cancel)
+	{
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+
+		addrinfo * ai;
+		if (int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &ai))
+		{
+#ifdef _WIN32
+			throw std::system_error(err, std::system_category());
+#else
+			throw std::runtime_error(host + ": " + gai_strerror(err));
+#endif
+		}
+
+		int err = 0;
+		for (addrinfo * cur = ai; cur; cur = cur->ai_next)
+		{
+			_s = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+			if (_s == _invalid_socket)
+			{
+				err = _last_error();
+				continue;
+			}
+
+			try
+			{
+				err = this->_connect(cur);
+			}
+			catch (...)
+			{
+				freeaddrinfo(ai);
+				_close(_s);
+				throw;
+			}
+
+			if (err == 0)
+				break;
+
+			_close(_s);
+			_s = _invalid_socket;
+		}
+
+		freeaddrinfo(ai);
+		if (_s == _invalid_socket)
+			throw std::system_error(err, std::system_category());
+
+		// The batches are large; let the kernel keep one in flight.
+		int sndbuf = 4 << 20;
+		setsockopt(_s, SOL_SOCKET, SO_SNDBUF, (char const *)&sndbuf, sizeof sndbuf);
+	}
+
+	~tcp_connection()
+	{
+		_close(_s);
+	}
+
+	tcp_connection(tcp_connection const &) = delete;
+	tcp_connection & operator=(tcp_connection const &) = delete;
+
+	void send(std::span<std::byte const> data)
+	{
+		while (!data.empty())
+		{
+			int chunk = (int)(std::min)(data.size(), (size_t)(1 << 30));
+			int sent = (int)::send(_s, (char const *)data.data(), chunk, _send_flags);
+			if (sent < 0)
+			{
+				int err = _last_error();
+				if (!_would_block(err))
+					throw std::system_error(err, std::system_category());
+
+				this->_wait_writable();
+				continue;
+			}
+
+			data = data.subspan((size_t)sent);
+		}
+	}
+
+private:
+	// Returns zero once connected, or the error.
+	int _connect(addrinfo const * ai)
+	{
+		if (!_set_nonblocking(_s))
+			return _last_error();
+
+		if (connect(_s, ai->ai_addr, (int)ai->ai_addrlen) == 0)
+			return 0;
+
+		int err = _last_error();
+		if (!_in_progress(err))
+			return err;
+
+		this->_wait_writable();
+
+		socklen_t len = sizeof err;
+		if (getsockopt(_s, SOL_SOCKET, SO_ERROR, (char *)&err, &len) != 0)
+			return _last_error();
+		return err;
+	}
+
+	void _wait_writable()
+	{
+		for (;;)
+		{
+			if (_cancel.load(std::memory_order_relaxed))
+				throw std::system_error(std::make_error_code(std::errc::operation_canceled));
+
+			pollfd pfd = {};
+			pfd.fd = _s;
+			pfd.events = POLLOUT;
+			int r = _poll(&pfd, 1, poll_interval_ms);
+			if (r > 0)
+				return;
+			if (r < 0 && !_interrupted(_last_error()))
+				throw std::system_error(_last_error(), std::system_category());
+		}
+	}
+
+#ifdef _WIN32
+	using _socket_t = SOCKET;
+	static constexpr _socket_t _invalid_socket = INVALID_SOCKET;
+	static constexpr int _send_flags = 0;
+
+	static int _last_error() noexcept
+	{
+		return WSAGetLastError();
+	}
+
+	static bool _would_block(int err) noexcept
+	{
+		return err == WSAEWOULDBLOCK;
+	}
+
+	static bool _in_progress(int err) noexcept
+	{
+		return err == WSAEWOULDBLOCK;
+	}
+
+	static bool _interrupted(int err) noexcept
+	{
+		return err == WSAEINTR;
+	}
+
+	static bool _set_nonblocking(_socket_t s) noexcept
+	{
+		u_long on = 1;
+		return ioctlsocket(s, FIONBIO, &on) == 0;
+	}
+
+	static int _poll(pollfd * fds, ULONG count, int timeout) noexcept
+	{
+		return WSAPoll(fds, count, timeout);
+	}
+
+	static void _close(_socket_t s) noexcept
+	{
+		if (s != _invalid_socket)
+			closesocket(s);
+	}
+#else
+	using _socket_t = int;
+	static constexpr _socket_t _invalid_socket = -1;
+
+	// A broken connection is reported by `send` rather than by SIGPIPE.
+	static constexpr int _send_flags = MSG_NOSIGNAL;
+
+	static int _last_error() noexcept
+	{
+		return errno;
+	}
+
+	static bool _would_block(int err) noexcept
+	{
+		return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+	}
+
+	static bool _in_progress(int err) noexcept
+	{
+		return err == EINPROGRESS;
+	}
+
+	static bool _interrupted(int err) noexcept
+	{
+		return err == EINTR;
+	}
+
+	static bool _set_nonblocking(_socket_t s) noexcept
+	{
+		int fl = fcntl(s, F_GETFL);
+		return fl >= 0 && fcntl(s, F_SETFL, fl | O_NONBLOCK) == 0;
+	}
+
+	static int _poll(pollfd * fds, nfds_t count, int timeout) noexcept
+	{
+		return poll(fds, count, timeout);
+	}
+
+	static void _close(_socket_t s) noexcept
+	{
+		if (s != _invalid_socket)
+			::close(s);
+	}
+#endif
+
+	std::atomic<bool> const & _cancel;
+	_socket_t _s = _invalid_socket;
+};
+
+// Sends a pcapng stream to a TCP collector from a background thread.
+//
+// Section headers and interface descriptions are kept aside as the
+// preamble, which is sent again at the start of every connection, so
+// that the collector always gets a valid stream. The other blocks are
+// queued in the chunks they were written in; when the queue is full,
+// or a chunk is lost with a broken connection, its packets are counted
+// as dropped instead.
+//
+// The preferred chunk size adapts to the link: it shrinks while the
+// sender keeps up, so that packets don't wait for a large batch, and
+// grows when chunks start to queue up, so that sends get larger.
+struct tcp_stream_output final
+	: byte_output
+{
+	static constexpr size_t min_batch_size = 64 << 10;
+	static constexpr size_t max_batch_size = 4 << 20;
+
+	// How long `sync` waits for a collector that stopped reading.
+	static constexpr std::chrono::seconds sync_timeout{ 5 };
+
+	tcp_stream_output(std::string host, std::string port, size_t queue_depth = 16)
+		: _host(std::move(host)), _port(std::move(port)), _queue_depth(queue_depth ? queue_depth : 1)
+	{
+		_thread = std::thread([this] { this->_run(); });
+	}
+
+	~tcp_stream_output()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_cv.notify_all();
+		_thread.join();
+	}
+
+	tcp_stream_output(tcp_stream_output const &) = delete;
+	tcp_stream_output & operator=(tcp_stream_output const &) = delete;
+
+	void write(std::span<std::byte const> data) override
+	{
+		if (data.empty())
+			return;
+
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		std::vector<std::byte> buf;
+		if (!_free.empty())
+		{
+			buf = std::move(_free.back());
+			_free.pop_back();
+		}
+		buf.clear();
+
+		for (auto rest = data; rest.size() >= 12;)
+		{
+			uint32_t type, len;
+			memcpy(&type, rest.data(), 4);
+			memcpy(&len, rest.data() + 4, 4);
+			if (len < 12 || len > rest.size())
+				throw std::logic_error("a chunk must consist of whole blocks");
+
+			auto & dest = type == 0x0a0d0d0a || type == 1? _preamble: buf;
+			dest.insert(dest.end(), rest.begin(), rest.begin() + len);
+			rest = rest.subspan(len);
+		}
+
+		if (_queue.size() == _queue_depth)
+		{
+			this->_drop_locked(buf);
+			_free.push_back(std::move(buf));
+			_batch_size = max_batch_size;
+			return;
+		}
+
+		if (_queue.empty() && !_sending)
+			_batch_size = (std::max)(_batch_size / 2, min_batch_size);
+		else if (_queue.size() >= _queue_depth / 2)
+			_batch_size = (std::min)(_batch_size * 2, max_batch_size);
+
+		if (buf.empty() && _preamble.size() == _preamble_queued)
+		{
+			_free.push_back(std::move(buf));
+			return;
+		}
+
+		_queue.push_back({ std::move(buf), _preamble.size() });
+		_preamble_queued = _preamble.size();
+
+		lock.unlock();
+		_cv.notify_all();
+	}
+
+	// Waits until the queued chunks are sent, unless the collector
+	// can't currently be reached or doesn't take them within `sync_timeout`.
+	// Once a wait has timed out, later ones don't wait until a chunk
+	// gets through again.
+	void sync() override
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		if (!_cv.wait_for(lock, sync_timeout, [&] { return (_queue.empty() && !_sending) || _disconnected || _stalled; }))
+			_stalled = true;
+	}
+
+	// The size the chunks should have; the writer should flush once
+	// it has buffered this much.
+	size_t batch_size() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _batch_size;
+	}
+
+	// Copies out the drop counters of the interfaces if they changed
+	// since the last call.
+	bool take_drops(std::vector<uint64_t> & drops)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_drops_changed)
+			return false;
+
+		drops = _drops;
+		_drops_changed = false;
+		return true;
+	}
+
+private:
+	struct _chunk_t
+	{
+		std::vector<std::byte> buf;
+
+		// The preamble blocks that must be sent before the chunk.
+		size_t preamble_size;
+	};
+
+	void _drop_locked(std::span<std::byte const> chunk)
+	{
+		while (chunk.size() >= 12)
+		{
+			uint32_t type, len;
+			memcpy(&type, chunk.data(), 4);
+			memcpy(&len, chunk.data() + 4, 4);
+
+			if (type == 6 && len >= 12)
+			{
+				uint32_t ifidx;
+				memcpy(&ifidx, chunk.data() + 8, 4);
+				if (_drops.size() <= ifidx)
+					_drops.resize(ifidx + 1);
+				++_drops[ifidx];
+				_drops_changed = true;
+			}
+
+			chunk = chunk.subspan(len);
+		}
+	}
+
+	void _run()
+	{
+		using namespace std::chrono_literals;
+
+		winsock_scope ws;
+		std::unique_ptr<tcp_connection> conn;
+		size_t preamble_sent = 0;
+		auto backoff = 100ms;
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		for (;;)
+		{
+			_cv.wait(lock, [&] { return !_queue.empty() || _stopping; });
+			if (_stopping)
+				return;
+
+			if (!conn)
+			{
+				lock.unlock();
+				try
+				{
+					conn = std::make_unique<tcp_connection>(_host, _port, _stopping);
+					preamble_sent = 0;
+				}
+				catch (std::exception const &)
+				{
+				}
+				lock.lock();
+
+				_disconnected = !conn;
+				_cv.notify_all();
+				if (!conn)
+				{
+					_cv.wait_for(lock, backoff, [&] { return _stopping.load(); });
+					backoff = (std::min)(backoff * 2, std::chrono::milliseconds(5s));
+					continue;
+				}
+
+				backoff = 100ms;
+			}
+
+			_chunk_t chunk = std::move(_queue.front());
+			_queue.pop_front();
+			_sending = true;
+
+			std::vector<std::byte> preamble(_preamble.begin() + preamble_sent, _preamble.begin() + chunk.preamble_size);
+			lock.unlock();
+
+			bool failed = false;
+			try
+			{
+				conn->send(preamble);
+				preamble_sent = chunk.preamble_size;
+				conn->send(chunk.buf);
+			}
+			catch (std::exception const &)
+			{
+				conn.reset();
+				failed = true;
+			}
+
+			lock.lock();
+			if (failed)
+				this->_drop_locked(chunk.buf);
+			else
+				_stalled = false;
+			_free.push_back(std::move(chunk.buf));
+			_sending = false;
+			_cv.notify_all();
+		}
+	}
+
+	std::string _host;
+	std::string _port;
+	size_t _queue_depth;
+
+	mutable std::mutex _mutex;
+	std::condition_variable _cv;
+	std::deque<_chunk_t> _queue;
+	std::vector<std::vector<std::byte>> _free;
+	std::vector<std::byte> _preamble;
+	size_t _preamble_queued = 0;
+	size_t _batch_size = min_batch_size;
+	bool _sending = false;
+	bool _disconnected = false;
+	bool _stalled = false;
+
+	// Also read without the lock, to cancel a send in progress.
+	std::atomic<bool> _stopping = false;
+
+	std::vector<uint64_t> _drops;
+	bool _drops_changed = false;
+
+	std::thread _thread;
+};
+
+// Streams the capture as pcapng to a TCP collector.
+//
+// The packets are encoded by a regular writer, which is flushed whenever
+// it has buffered a batch of the size preferred by the output, and on
+// every tick, so that no packet waits longer than that for its batch
+// to fill up, however quiet the link. Drops are reported to the
+// collector in interface statistics blocks.
+struct pcapng_stream final
+	: packet_sink
+{
+	pcapng_stream(std::string host, std::string port)
+		: _out(std::make_shared<tcp_stream_output>(std::move(host), std::move(port))),
+		_w(_out, tcp_stream_output::max_batch_size)
+	{
+	}
+
+	~pcapng_stream()
+	{
+		try
+		{
+			this->flush();
+		}
+		catch (...)
+		{
+		}
+	}
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		_received.push_back(0);
+		return _w.add_interface(intf);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) override
+	{
+		_w.add_packet(ifidx, timestamp, payload, full_length, flags);
+		++_received[ifidx];
+		_last_timestamp = timestamp;
+
+		if (_w.buffered_size() >= _batch_size)
+			this->_send_batch();
+	}
+
+	void tick() override
+	{
+		if (_w.buffered_size() != 0)
+			this->_send_batch();
+	}
+
+	void flush() override
+	{
+		this->_send_batch();
+		_out->sync();
+	}
+
+private:
+	void _send_batch()
+	{
+		if (_out->take_drops(_drops))
+		{
+			for (size_t i = 0; i != _drops.size() && i != _received.size(); ++i)
+			{
+				if (_drops[i] != 0)
+					_w.add_statistics((uint32_t)i, _last_timestamp, { .received = _received[i], .dropped = _drops[i] });
+			}
+		}
+
+		_w.flush();
+		_batch_size = _out->batch_size();
+	}
+
+	std::shared_ptr<tcp_stream_output> _out;
+	pcapng_writer _w;
+
+	size_t _batch_size = tcp_stream_output::min_batch_size;
+	uint64_t _last_timestamp = 0;
+	std::vector<uint64_t> _received;
+	std::vector<uint64_t> _drops;
+};
@@ -0,0 +1,415 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdint.h>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The destination of an encoded byte stream.
+struct byte_output
+{
+	virtual ~byte_output() = default;
+
+	virtual void write(std::span<std::byte const> data) = 0;
+
+	// The stream offset of the first write, which is non-zero
+	// when appending to an existing file.
+	virtual uint64_t initial_offset() const noexcept
+	{
+		return 0;
+	}
+
+	// Makes sure that everything written so far is durable.
+	virtual void sync() = 0;
+};
+
+#ifdef _WIN32
+struct file_output final
+	: byte_output
+{
+	explicit file_output(std::filesystem::path const & path)
+	{
+		_h = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, 0, nullptr);
+		if (_h == INVALID_HANDLE_VALUE)
+			throw std::system_error(GetLastError(), std::system_category());
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_h, &size))
+		{
+			DWORD err = GetLastError();
+			CloseHandle(_h);
+			throw std::system_error(err, std::system_category());
+		}
+
+		_initial_size = (uint64_t)size.QuadPart;
+	}
+
+	~file_output()
+	{
+		CloseHandle(_h);
+	}
+
+	file_output(file_output const &) = delete;
+	file_output & operator=(file_output const &) = delete;
+
+	void write(std::span<std::byte const> data) override
+	{
+		OVERLAPPED ov = {};
+		ov.Offset = 0xffffffff;
+		ov.OffsetHigh = 0xffffffff;
+		while (!data.empty())
+		{
+			DWORD written;
+			if (!WriteFile(_h, data.data(), (DWORD)data.size(), &written, &ov))
+				throw std::system_error(GetLastError(), std::system_category());
+
+			data = data.subspan(written);
+		}
+	}
+
+	uint64_t initial_offset() const noexcept override
+	{
+		return _initial_size;
+	}
+
+	void sync() override
+	{
+		if (!FlushFileBuffers(_h))
+			throw std::system_error(GetLastError(), std::system_category());
+	}
+
+private:
+	HANDLE _h;
+	uint64_t _initial_size;
+};
+
+// The standard output of the process, which may be a console,
+// a pipe or a redirected file.
+struct stdout_output final
+	: byte_output
+{
+	stdout_output()
+		: _h(GetStdHandle(STD_OUTPUT_HANDLE))
+	{
+		if (_h == INVALID_HANDLE_VALUE)
+			throw std::system_error(GetLastError(), std::system_category());
+	}
+
+	void write(std::span<std::byte const> data) override
+	{
+		while (!data.empty())
+		{
+			DWORD written;
+			if (!WriteFile(_h, data.data(), (DWORD)data.size(), &written, nullptr))
+				throw std::system_error(GetLastError(), std::system_category());
+
+			data = data.subspan(written);
+		}
+	}
+
+	void sync() override
+	{
+	}
+
+private:
+	HANDLE _h;
+};
+#else
+inline void _write_fd(int fd, std::span<std::byte const> data)
+{
+	while (!data.empty())
+	{
+		ssize_t written = ::write(fd, data.data(), data.size());
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::system_category());
+		}
+
+		data = data.subspan((size_t)written);
+	}
+}
+
+struct file_output final
+	: byte_output
+{
+	explicit file_output(std::filesystem::path const & path)
+	{
+		_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (_fd < 0)
+			throw std::system_error(errno, std::system_category());
+
+		struct stat st;
+		if (fstat(_fd, &st) != 0)
+		{
+			int err = errno;
+			::close(_fd);
+			throw std::system_error(err, std::system_category());
+		}
+
+		_initial_size = (uint64_t)st.st_size;
+	}
+
+	~file_output()
+	{
+		::close(_fd);
+	}
+
+	file_output(file_output const &) = delete;
+	file_output & operator=(file_output const &) = delete;
+
+	void write(std::span<std::byte const> data) override
+	{
+		_write_fd(_fd, data);
+	}
+
+	uint64_t initial_offset() const noexcept override
+	{
+		return _initial_size;
+	}
+
+	void sync() override
+	{
+		if (fsync(_fd) != 0)
+			throw std::system_error(errno, std::system_category());
+	}
+
+private:
+	int _fd;
+	uint64_t _initial_size;
+};
+
+// The standard output of the process, which may be a terminal,
+// a pipe or a redirected file.
+struct stdout_output final
+	: byte_output
+{
+	void write(std::span<std::byte const> data) override
+	{
+		_write_fd(STDOUT_FILENO, data);
+	}
+
+	void sync() override
+	{
+	}
+};
+#endif
+
+// Discards what is written to it at a fixed rate, standing in
+// for a disk that can't keep up.
+struct throttled_output final
+	: byte_output
+{
+	explicit throttled_output(double bytes_per_second)
+		: _bytes_per_second(bytes_per_second)
+	{
+	}
+
+	void write(std::span<std::byte const> data) override
+	{
+		std::this_thread::sleep_for(std::chrono::duration<double>(data.size() / _bytes_per_second));
+	}
+
+	void sync() override
+	{
+	}
+
+private:
+	double _bytes_per_second;
+};
+
+// Moves the writes to a background thread.
+//
+// Filled buffers are swapped into a fixed ring of `depth` slots and
+// the caller gets back the buffer that was written out the last time
+// the slot was used, so the data is never copied. `submit` blocks
+// while all slots are waiting to be written. The slots start out with
+// buffers of `buffer_size`, so that the first buffers handed back don't
+// have to be allocated by the caller.
+struct write_behind
+{
+	write_behind(std::shared_ptr<byte_output> out, size_t depth = 4, size_t buffer_size = 0)
+		: _out(std::move(out)), _slots(depth ? depth : 1)
+	{
+		for (_slot_t & slot: _slots)
+			slot.buf.resize(buffer_size);
+		_thread = std::thread([this] { this->_run(); });
+	}
+
+	~write_behind()
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_cv.notify_all();
+		_thread.join();
+	}
+
+	write_behind(write_behind const &) = delete;
+	write_behind & operator=(write_behind const &) = delete;
+
+	std::vector<std::byte> submit(std::vector<std::byte> buf, size_t size)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_cv.wait(lock, [&] { return _queued != _slots.size() || _error; });
+		this->_rethrow_locked();
+
+		_slot_t & slot = _slots[(_head + _queued) % _slots.size()];
+		std::swap(slot.buf, buf);
+		slot.size = size;
+		++_queued;
+
+		lock.unlock();
+		_cv.notify_all();
+		return buf;
+	}
+
+	// Makes the buffers submitted so far durable once they are written,
+	// without waiting for it.
+	void sync()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		this->_rethrow_locked();
+		if (_queued != 0)
+			_slots[(_head + _queued - 1) % _slots.size()].sync = true;
+		else
+			_sync = true;
+
+		lock.unlock();
+		_cv.notify_all();
+	}
+
+	// Waits until all submitted buffers are written.
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_cv.wait(lock, [&] { return _queued == 0 || _error; });
+		this->_rethrow_locked();
+	}
+
+	// The number of buffers waiting to be written; a measure of how far
+	// the output is falling behind.
+	size_t queued() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _queued;
+	}
+
+	size_t depth() const noexcept
+	{
+		return _slots.size();
+	}
+
+	// The number of bytes written to the output so far.
+	uint64_t written() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _written;
+	}
+
+private:
+	struct _slot_t
+	{
+		std::vector<std::byte> buf;
+		size_t size = 0;
+
+		// Whether to sync the output after writing the buffer.
+		bool sync = false;
+	};
+
+	void _run()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		for (;;)
+		{
+			_cv.wait(lock, [&] { return _queued != 0 || _sync || _stopping; });
+			if (_queued == 0 && !_sync)
+				return;
+
+			if (_queued == 0)
+			{
+				_sync = false;
+				lock.unlock();
+
+				std::exception_ptr error;
+				try
+				{
+					_out->sync();
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+				}
+
+				lock.lock();
+				if (error && !_error)
+					_error = error;
+				continue;
+			}
+
+			_slot_t & slot = _slots[_head];
+			bool sync = std::exchange(slot.sync, false);
+			lock.unlock();
+
+			std::exception_ptr error;
+			try
+			{
+				_out->write({ slot.buf.data(), slot.size });
+				if (sync)
+					_out->sync();
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+
+			lock.lock();
+			if (error && !_error)
+				_error = error;
+			if (!error)
+				_written += slot.size;
+			_head = (_head + 1) % _slots.size();
+			--_queued;
+			_cv.notify_all();
+		}
+	}
+
+	void _rethrow_locked()
+	{
+		if (_error)
+			std::rethrow_exception(_error);
+	}
+
+	std::shared_ptr<byte_output> _out;
+
+	mutable std::mutex _mutex;
+	std::condition_variable _cv;
+	std::vector<_slot_t> _slots;
+	size_t _head = 0;
+	size_t _queued = 0;
+	uint64_t _written = 0;
+	bool _sync = false;
+	bool _stopping = false;
+	std::exception_ptr _error;
+
+	std::thread _thread;
+};
@@ -0,0 +1,306 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <stdint.h>
+
+// IANA ifType values, as reported in `capture_interface::link_type`.
+enum: uint16_t
+{
+	if_type_ethernet = 6,
+	if_type_ieee80211 = 71,
+};
+
+// Maps an IANA ifType to the LINKTYPE used in pcap files.
+inline uint16_t pcap_link_type(uint16_t if_type) noexcept
+{
+	switch (if_type)
+	{
+	case if_type_ethernet:
+		return 1;
+	case if_type_ieee80211:
+		return 105;
+	default:
+		return if_type;
+	}
+}
+
+inline uint16_t if_type_from_pcap(uint16_t link_type) noexcept
+{
+	switch (link_type)
+	{
+	case 1:
+		return if_type_ethernet;
+	case 105:
+		return if_type_ieee80211;
+	default:
+		return link_type;
+	}
+}
+
+enum: uint16_t
+{
+	ethertype_ipv4 = 0x0800,
+	ethertype_arp = 0x0806,
+	ethertype_vlan = 0x8100,
+	ethertype_ipv6 = 0x86dd,
+	ethertype_qinq = 0x88a8,
+};
+
+enum: uint8_t
+{
+	ip_proto_icmp = 1,
+	ip_proto_tcp = 6,
+	ip_proto_udp = 17,
+	ip_proto_icmpv6 = 58,
+};
+
+enum: uint8_t
+{
+	tcp_fin = 0x01,
+	tcp_syn = 0x02,
+	tcp_rst = 0x04,
+	tcp_push = 0x08,
+	tcp_ack = 0x10,
+	tcp_urg = 0x20,
+	tcp_ece = 0x40,
+	tcp_cwr = 0x80,
+};
+
+// The headers of a packet, decoded in place.
+//
+// Offsets are into `data`; a layer that isn't present has its offset
+// set to `npos`. IPv4 addresses are stored in the first four bytes
+// of the address arrays.
+struct decoded_packet
+{
+	static constexpr size_t npos = ~(size_t)0;
+
+	std::span<std::byte const> data;
+
+	size_t l2_offset = npos;
+	size_t l3_offset = npos;
+	size_t l4_offset = npos;
+	size_t payload_offset = npos;
+
+	std::array<uint8_t, 6> src_mac = {};
+	std::array<uint8_t, 6> dst_mac = {};
+	uint16_t ethertype = 0;
+	uint16_t vlan_id = 0;
+	bool has_vlan = false;
+
+	uint8_t ip_version = 0;
+	uint8_t ip_proto = 0;
+	bool ip_fragment = false;
+	std::array<uint8_t, 16> src_ip = {};
+	std::array<uint8_t, 16> dst_ip = {};
+
+	uint16_t src_port = 0;
+	uint16_t dst_port = 0;
+	uint8_t tcp_flags = 0;
+	uint32_t tcp_seq = 0;
+	uint32_t tcp_ack = 0;
+	uint16_t tcp_window = 0;
+
+	uint8_t icmp_type = 0;
+	uint8_t icmp_code = 0;
+
+	size_t ip_addr_size() const noexcept
+	{
+		return ip_version == 4? 4: ip_version == 6? 16: 0;
+	}
+
+	std::span<std::byte const> payload() const noexcept
+	{
+		if (payload_offset == npos)
+			return {};
+		return data.subspan(payload_offset);
+	}
+
+	// The length of everything up to the start of the L4 payload,
+	// or of the last header that could be decoded.
+	size_t header_length() const noexcept
+	{
+		if (payload_offset != npos)
+			return payload_offset;
+		if (l4_offset != npos)
+			return l4_offset;
+		if (l3_offset != npos)
+			return l3_offset;
+		return data.size();
+	}
+};
+
+inline uint16_t load_be16(std::byte const * p) noexcept
+{
+	return (uint16_t)(((uint16_t)p[0] << 8) | (uint16_t)p[1]);
+}
+
+inline uint32_t load_be32(std::byte const * p) noexcept
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// Decodes as many headers as can be found in a (possibly truncated) packet.
+// Never fails; the layers that couldn't be decoded are left unset.
+inline void decode_packet(uint16_t link_type, std::span<std::byte const> data, decoded_packet & pkt) noexcept
+{
+	pkt = {};
+	pkt.data = data;
+
+	if (link_type != if_type_ethernet || data.size() < 14)
+		return;
+
+	std::byte const * p = data.data();
+	pkt.l2_offset = 0;
+	memcpy(pkt.dst_mac.data(), p, 6);
+	memcpy(pkt.src_mac.data(), p + 6, 6);
+
+	size_t off = 12;
+	uint16_t ethertype = load_be16(p + off);
+	while ((ethertype == ethertype_vlan || ethertype == ethertype_qinq) && off + 6 <= data.size())
+	{
+		if (!pkt.has_vlan)
+		{
+			pkt.has_vlan = true;
+			pkt.vlan_id = load_be16(p + off + 2) & 0xfff;
+		}
+
+		off += 4;
+		ethertype = load_be16(p + off);
+	}
+
+	off += 2;
+	pkt.ethertype = ethertype;
+	pkt.l3_offset = off;
+
+	size_t l4_offset;
+	if (ethertype == ethertype_ipv4)
+	{
+		if (data.size() < off + 20)
+			return;
+
+		std::byte const * ip = p + off;
+		size_t ihl = ((size_t)ip[0] & 0xf) * 4;
+		if (((uint8_t)ip[0] >> 4) != 4 || ihl < 20 || data.size() < off + ihl)
+			return;
+
+		pkt.ip_version = 4;
+		pkt.ip_proto = (uint8_t)ip[9];
+		memcpy(pkt.src_ip.data(), ip + 12, 4);
+		memcpy(pkt.dst_ip.data(), ip + 16, 4);
+
+		uint16_t frag = load_be16(ip + 6);
+		pkt.ip_fragment = (frag & 0x3fff) != 0;
+		if ((frag & 0x1fff) != 0)
+			return;
+
+		l4_offset = off + ihl;
+	}
+	else if (ethertype == ethertype_ipv6)
+	{
+		if (data.size() < off + 40)
+			return;
+
+		std::byte const * ip = p + off;
+		if (((uint8_t)ip[0] >> 4) != 6)
+			return;
+
+		pkt.ip_version = 6;
+		memcpy(pkt.src_ip.data(), ip + 8, 16);
+		memcpy(pkt.dst_ip.data(), ip + 24, 16);
+
+		uint8_t next = (uint8_t)ip[6];
+		l4_offset = off + 40;
+		for (;;)
+		{
+			// Hop-by-hop, routing, destination options.
+			if (next == 0 || next == 43 || next == 60)
+			{
+				if (data.size() < l4_offset + 8)
+					return;
+				next = (uint8_t)p[l4_offset];
+				l4_offset += ((size_t)p[l4_offset + 1] + 1) * 8;
+				continue;
+			}
+
+			// Fragment.
+			if (next == 44)
+			{
+				if (data.size() < l4_offset + 8)
+					return;
+				pkt.ip_fragment = true;
+				if ((load_be16(p + l4_offset + 2) & 0xfff8) != 0)
+				{
+					pkt.ip_proto = (uint8_t)p[l4_offset];
+					return;
+				}
+				next = (uint8_t)p[l4_offset];
+				l4_offset += 8;
+				continue;
+			}
+
+			break;
+		}
+
+		pkt.ip_proto = next;
+	}
+	else
+	{
+		return;
+	}
+
+	if (data.size() < l4_offset)
+		return;
+
+	std::byte const * l4 = p + l4_offset;
+	size_t l4_avail = data.size() - l4_offset;
+	switch (pkt.ip_proto)
+	{
+	case ip_proto_tcp:
+	{
+		if (l4_avail < 20)
+			return;
+
+		size_t hdr_len = ((size_t)((uint8_t)l4[12] >> 4)) * 4;
+		pkt.l4_offset = l4_offset;
+		pkt.src_port = load_be16(l4);
+		pkt.dst_port = load_be16(l4 + 2);
+		pkt.tcp_seq = load_be32(l4 + 4);
+		pkt.tcp_ack = load_be32(l4 + 8);
+		pkt.tcp_flags = (uint8_t)l4[13];
+		pkt.tcp_window = load_be16(l4 + 14);
+		if (hdr_len >= 20 && hdr_len <= l4_avail)
+			pkt.payload_offset = l4_offset + hdr_len;
+		break;
+	}
+
+	case ip_proto_udp:
+		if (l4_avail < 8)
+			return;
+
+		pkt.l4_offset = l4_offset;
+		pkt.src_port = load_be16(l4);
+		pkt.dst_port = load_be16(l4 + 2);
+		pkt.payload_offset = l4_offset + 8;
+		break;
+
+	case ip_proto_icmp:
+	case ip_proto_icmpv6:
+		if (l4_avail < 4)
+			return;
+
+		pkt.l4_offset = l4_offset;
+		pkt.icmp_type = (uint8_t)l4[0];
+		pkt.icmp_code = (uint8_t)l4[1];
+		pkt.payload_offset = l4_offset + (pkt.ip_proto == ip_proto_icmp? 8: 4);
+		if (pkt.payload_offset > data.size())
+			pkt.payload_offset = decoded_packet::npos;
+		break;
+
+	default:
+		pkt.l4_offset = l4_offset;
+		break;
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <span>
+#include <stdint.h>
+#include <string>
+
+struct capture_interface
+{
+	// The OS interface index.
+	uint32_t index;
+
+	// The IANA ifType of the interface.
+	uint16_t link_type;
+
+	std::string name;
+	std::string desc;
+	size_t snaplen;
+};
+
+// Receives the interfaces and packets decoded by the capture consumer.
+//
+// The interface index returned from `add_interface` is local to the sink
+// and is what the consumer passes back in `add_packet`. The payload is only
+// valid for the duration of the call. The flags are the value of the pcapng
+// `epb_flags` option, zero if there is nothing to record.
+struct packet_sink
+{
+	virtual ~packet_sink() = default;
+
+	virtual uint32_t add_interface(capture_interface const & intf) = 0;
+	virtual void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) = 0;
+	virtual void flush() = 0;
+
+	// Called by the source about every `packet_source::tick_interval_ms`
+	// while capturing, with or without packets, for work that is due after
+	// some time rather than after some data, such as showing buffered
+	// output. Sinks that pass packets on must pass this on as well.
+	virtual void tick()
+	{
+	}
+};
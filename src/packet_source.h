@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Delivers captured packets to a `packet_sink` until stopped.
+//
+// `run` blocks the calling thread for the whole capture. `stop` may be called
+// from any thread, including before `run` starts, and makes `run` return
+// once the packets already taken from the system are delivered. The sink is
+// only ever called from one thread at a time.
+struct packet_source
+{
+	// How often the source calls `packet_sink::tick`.
+	static constexpr unsigned tick_interval_ms = 100;
+
+	virtual ~packet_source() = default;
+
+	virtual void run() = 0;
+	virtual void stop() = 0;
+
+	// Problems to report once the capture is over, such as packets
+	// the system dropped.
+	virtual std::vector<std::string> warnings() const
+	{
+		return {};
+	}
+};
@@ -1,28 +1,74 @@
+#pragma once
+#include "index.h"
+#include "output.h"
+#include "packet.h"
+#include "packet_sink.h"
+
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <cstring>
 #include <filesystem>
+#include <memory>
+#include <optional>
 #include <span>
+#include <stdexcept>
 #include <stddef.h>
 #include <stdint.h>
 #include <string>
 #include <string_view>
+#include <system_error>
 #include <vector>
 
-#include <windows.h>
+
+// Packet counters of an interface, as written to interface statistics blocks.
+struct interface_statistics
+{
+	// Packets seen by the capture.
+	uint64_t received;
+
+	// Packets that were seen but not delivered to the output.
+	uint64_t dropped;
+};
+
+// How far a writer is falling behind its output.
+struct writer_pressure
+{
+	// The buffers waiting for the background thread, out of `depth`.
+	size_t queued;
+	size_t depth;
+
+	// The total time spent waiting for the output, in microseconds.
+	uint64_t stall_us;
+};
 
 template <typename T>
 concept payload
 	= !std::convertible_to<T, std::span<std::byte const>>
 	&& !std::convertible_to<T, std::string_view>;
 
-struct pcapng_writer
+struct pcapng_writer final
+	: packet_sink
 {
-	pcapng_writer(std::filesystem::path const & path)
+	static constexpr size_t default_buffer_size = 1 << 20;
+
+	// Blocks are accumulated in a preallocated buffer and written out
+	// in large chunks. The buffer only ever grows when a single block
+	// doesn't fit, which can't happen to packets once the interfaces
+	// (and thus their snaplens) are known.
+	//
+	// With a non-zero `write_behind_depth`, the chunks are written
+	// by a background thread.
+	explicit pcapng_writer(std::shared_ptr<byte_output> out, size_t buffer_size = default_buffer_size,
+		size_t write_behind_depth = 0)
+		: _buf(buffer_size), _buf_capacity(buffer_size), _out(std::move(out))
 	{
-		_h = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, 0, nullptr);
-		if (_h == INVALID_HANDLE_VALUE)
-			throw std::system_error(GetLastError(), std::system_category());
+		if (write_behind_depth != 0)
+			_io = std::make_unique<write_behind>(_out, write_behind_depth, buffer_size);
 
-		_new_block(0x0a0d0d0a);
+		_stream_offset = _out->initial_offset();
+
+		_new_block(0x0a0d0d0a, sizeof(_section_header_t));
 		_append(_section_header_t{
 			.magic = 0x1a2b3c4d,
 			.major_version = 1,
@@ -30,82 +76,409 @@ struct pcapng_writer
 			.section_length = -1,
 			});
 		_end_block();
+		_section_length = _size;
 	}
 
-	~pcapng_writer()
+	explicit pcapng_writer(std::filesystem::path const & path, size_t buffer_size = default_buffer_size,
+		size_t write_behind_depth = 0)
+		: pcapng_writer(std::make_shared<file_output>(path), buffer_size, write_behind_depth)
 	{
-		if (_h != INVALID_HANDLE_VALUE)
-			CloseHandle(_h);
 	}
 
-	uint32_t add_interface(uint16_t link_type, std::string name, std::string desc, size_t snaplen)
+	~pcapng_writer()
 	{
-		switch (link_type)
+		try
 		{
-		case 6:
-			link_type = 1;
-			break;
-		case 71:
-			link_type = 105;
-			break;
+			this->flush();
 		}
+		catch (...)
+		{
+		}
+	}
+
+	pcapng_writer(pcapng_writer const &) = delete;
+	pcapng_writer & operator=(pcapng_writer const &) = delete;
+
+	void flush() override
+	{
+		this->_flush_buffer();
+		if (_io)
+			_io->wait();
+		if (_index)
+			_index->flush();
+	}
+
+	// Makes the output durable every `interval` microseconds, timed by
+	// the source's ticks rather than by the packets, so that a crash loses
+	// at most about that much of the capture even when the link goes quiet.
+	// With write-behind, the sync is left to the background thread.
+	void enable_checkpoints(uint64_t interval) noexcept
+	{
+		_checkpoint_interval = interval;
+	}
+
+	// Starts writing a sidecar index of the blocks. Must be called
+	// before any interfaces are added.
+	void enable_index(std::filesystem::path const & path)
+	{
+		if (_intf_count != 0)
+			throw std::logic_error("the index must be enabled before adding interfaces");
+
+		// The index keeps pace with the writer, so it writes behind too if the writer does.
+		_index = std::make_unique<capture_index_writer>(path, capture_index_writer::default_bucket, _io? 2: 0);
+		_index->add_section(_stream_offset, _section_length);
+	}
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		uint16_t link_type = pcap_link_type(intf.link_type);
 
 		uint32_t r = _intf_count++;
-		_interface_desc_t intf = {
+		_interface_desc_t idb = {
 			.link_type = link_type,
-			.snaplen = (uint32_t)snaplen,
+			._0a = 0,
+			.snaplen = (uint32_t)intf.snaplen,
 		};
 
-		_new_block(1);
-		_append(intf);
-		_opt(2, name);
-		_opt(3, desc);
+		// Make sure that packets up to the snaplen never need to grow the buffer,
+		// counting the flags option that most packets carry.
+		_reserve_capacity(packet_block_size(intf.snaplen, ~(uint32_t)0));
+
+		_new_block(1, sizeof idb + _opt_size(intf.name.size()) + _opt_size(intf.desc.size()) + _opt_size(0));
+		_append(idb);
+		_opt(2, intf.name);
+		_opt(3, intf.desc);
 		_opt(0, std::span<std::byte const>{});
 		_end_block();
+
+		_if_types.push_back(intf.link_type);
+		_if_scales.push_back(timestamp_scale{});
+		if (_index)
+			_index->add_interface(_stream_offset + _block_start, _size - _block_start);
 		return r;
 	}
 
-	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length)
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) override
+	{
+		size_t size = packet_block_size(payload.size(), flags);
+		_reserve(size);
+
+		size_t offset = _size;
+		_size += encode_packet({ _buf.data() + _size, size }, ifidx, timestamp, payload, full_length, flags);
+
+		if (_index)
+			_index->add_packet(_stream_offset + offset, size, timestamp, _if_types[ifidx], payload);
+	}
+
+	void tick() override
+	{
+		if (_checkpoint_interval == 0)
+			return;
+
+		auto now = std::chrono::steady_clock::now();
+		if (now >= _next_checkpoint)
+			this->_checkpoint(now);
+	}
+
+	// Appends an interface statistics block with the counters at `timestamp`.
+	void add_statistics(uint32_t ifidx, uint64_t timestamp, interface_statistics const & stats, std::string_view comment = {})
 	{
-		_new_block(6);
-		_append(_enhanced_packet_t{
+		_interface_statistics_t const isb = {
 			.intf_id = ifidx,
 			.timestamp_hi = (uint32_t)(timestamp >> 32),
 			.timestamp_lo = (uint32_t)timestamp,
-			.captured_len = (uint32_t)payload.size(),
-			.packet_len = (uint32_t)full_length,
-			});
-		_append(payload);
-		_pad();
+		};
+
+		_new_block(5, sizeof isb + _opt_size(comment.size()) + 3 * _opt_size(sizeof(uint64_t)) + _opt_size(0));
+		_append(isb);
+		if (!comment.empty())
+			_opt(1, comment);
+		_opt(4, stats.received);
+		_opt(7, stats.dropped);
+		_opt(8, stats.received - stats.dropped);
 		_opt(0, std::span<std::byte const>{});
 		_end_block();
 	}
 
+	writer_pressure pressure() const
+	{
+		return {
+			.queued = _io? _io->queued(): 0,
+			.depth = _io? _io->depth(): 0,
+			.stall_us = _stall_us,
+		};
+	}
+
+	// The number of bytes waiting in the buffer for the next flush.
+	size_t buffered_size() const noexcept
+	{
+		return _size;
+	}
+
+	// Appends a complete block that was encoded elsewhere, for example
+	// by `encode_packet`.
+	void add_block(std::span<std::byte const> block)
+	{
+		_reserve(block.size());
+
+		size_t offset = _size;
+		_append(block);
+
+		if (_index)
+			this->_index_block(_stream_offset + offset, block);
+	}
+
+	// Writes out a buffer of complete packet blocks that were encoded
+	// elsewhere, after everything added so far. The buffer is handed to the
+	// output as is rather than copied into the writer's; the returned
+	// buffer, of any size, is free for reuse.
+	std::vector<std::byte> add_blocks(std::vector<std::byte> blocks, size_t size)
+	{
+		if (_size != 0)
+			this->_flush_buffer();
+
+		if (_index)
+		{
+			for (size_t pos = 0; pos != size;)
+			{
+				uint32_t len;
+				memcpy(&len, blocks.data() + pos + 4, sizeof len);
+				this->_index_block(_stream_offset + pos, { blocks.data() + pos, len });
+				pos += len;
+			}
+		}
+
+		return this->_write_out(std::move(blocks), size);
+	}
+
+	// Appends a packet or interface statistics block that was encoded
+	// elsewhere, with its interface replaced by `ifidx`.
+	void add_block(std::span<std::byte const> block, uint32_t ifidx)
+	{
+		_reserve(block.size());
+
+		size_t offset = _size;
+		_append(block);
+		memcpy(_buf.data() + offset + 8, &ifidx, sizeof ifidx);
+
+		if (_index)
+			this->_index_block(_stream_offset + offset, { _buf.data() + offset, block.size() });
+	}
+
+	// The `epb_flags` option is only written when the flags are non-zero.
+	static constexpr size_t packet_block_size(size_t captured_len, uint32_t flags = 0) noexcept
+	{
+		return 12 + sizeof(_enhanced_packet_t) + _pad_size(captured_len) + (flags? _opt_size(sizeof flags): 0) + _opt_size(0);
+	}
+
+	// Encodes an enhanced packet block into `out`, which must be at least
+	// `packet_block_size(payload.size(), flags)` bytes long. Returns the size of the block.
+	static size_t encode_packet(std::span<std::byte> out, uint32_t ifidx, uint64_t timestamp,
+		std::span<std::byte const> payload, size_t full_length, uint32_t flags = 0) noexcept
+	{
+		uint32_t const len = (uint32_t)packet_block_size(payload.size(), flags);
+		_block_header_t const hdr = {
+			.type = 6,
+			.length = len,
+		};
+
+		_enhanced_packet_t const epb = {
+			.intf_id = ifidx,
+			.timestamp_hi = (uint32_t)(timestamp >> 32),
+			.timestamp_lo = (uint32_t)timestamp,
+			.captured_len = (uint32_t)payload.size(),
+			.packet_len = (uint32_t)full_length,
+		};
+
+		std::byte * p = out.data();
+		memcpy(p, &hdr, sizeof hdr);
+		p += sizeof hdr;
+		memcpy(p, &epb, sizeof epb);
+		p += sizeof epb;
+		memcpy(p, payload.data(), payload.size());
+		p += payload.size();
+
+		size_t pad = _pad_size(payload.size()) - payload.size();
+		memset(p, 0, pad);
+		p += pad;
+
+		if (flags)
+		{
+			uint16_t const opt[2] = { 2, sizeof flags };
+			memcpy(p, opt, sizeof opt);
+			memcpy(p + sizeof opt, &flags, sizeof flags);
+			p += sizeof opt + sizeof flags;
+		}
+
+		// The empty end-of-options.
+		memset(p, 0, _opt_size(0));
+		p += _opt_size(0);
+
+		memcpy(p, &len, sizeof len);
+		return len;
+	}
+
 private:
+	static constexpr size_t _pad_size(size_t len) noexcept
+	{
+		return (len + 3) & ~(size_t)3;
+	}
+
+	static constexpr size_t _opt_size(size_t len) noexcept
+	{
+		return 4 + _pad_size(len);
+	}
+
+	void _index_block(uint64_t offset, std::span<std::byte const> block)
+	{
+		uint32_t type;
+		memcpy(&type, block.data(), sizeof type);
+
+		switch (type)
+		{
+		case 0x0a0d0d0a:
+			_index->add_section(offset, block.size());
+			break;
+
+		case 1:
+		{
+			// Interfaces copied in as blocks need their link type and
+			// timestamp resolution for indexing the packets that follow.
+			_interface_desc_t idb;
+			if (block.size() < 8 + sizeof idb)
+				break;
+
+			memcpy(&idb, block.data() + 8, sizeof idb);
+			_if_types.push_back(if_type_from_pcap(idb.link_type));
+			_if_scales.push_back(timestamp_scale::of_interface(block, 6));
+			_index->add_interface(offset, block.size());
+			break;
+		}
+
+		case 6:
+		{
+			_enhanced_packet_t epb;
+			if (block.size() < 8 + sizeof epb)
+				break;
+
+			memcpy(&epb, block.data() + 8, sizeof epb);
+			if (epb.intf_id >= _if_types.size() || epb.captured_len > block.size() - 8 - sizeof epb)
+				break;
+
+			// Packets whose timestamps can't be converted are left out of the index.
+			auto const & scale = _if_scales[epb.intf_id];
+			if (!scale)
+				break;
+
+			_index->add_packet(offset, block.size(), (*scale)(((uint64_t)epb.timestamp_hi << 32) | epb.timestamp_lo),
+				_if_types[epb.intf_id], block.subspan(8 + sizeof epb, epb.captured_len));
+			break;
+		}
+		}
+	}
+
+	void _checkpoint(std::chrono::steady_clock::time_point now)
+	{
+		// The first tick only starts the clock.
+		if (_next_checkpoint != std::chrono::steady_clock::time_point{})
+		{
+			if (_size != 0)
+				this->_flush_buffer();
+			if (_io)
+				_io->sync();
+			else
+				_out->sync();
+
+			if (_index)
+			{
+				_index->write_until(this->_written_offset(), true);
+				_index->sync();
+			}
+		}
+
+		_next_checkpoint = now + std::chrono::microseconds(_checkpoint_interval);
+	}
+
+	void _flush_buffer()
+	{
+		_buf = this->_write_out(std::move(_buf), _size);
+		if (_buf.size() < _buf_capacity)
+			_buf.resize(_buf_capacity);
+		_size = 0;
+	}
+
+	// Hands the first `size` bytes of `buf` to the output and returns
+	// a buffer to reuse.
+	std::vector<std::byte> _write_out(std::vector<std::byte> buf, size_t size)
+	{
+		auto start = std::chrono::steady_clock::now();
+		if (_io)
+			buf = _io->submit(std::move(buf), size);
+		else
+			_out->write({ buf.data(), size });
+
+		_stream_offset += size;
+		_stall_us += (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+		if (_index)
+			_index->write_until(this->_written_offset());
+		return buf;
+	}
+
+	// The stream offset up to which the output has been written.
+	uint64_t _written_offset() const
+	{
+		return _io? _out->initial_offset() + _io->written(): _stream_offset;
+	}
+
+	void _reserve_capacity(size_t block_size)
+	{
+		if (_buf_capacity < block_size)
+		{
+			this->_flush_buffer();
+			_buf_capacity = block_size;
+			_buf.resize(block_size);
+		}
+	}
+
 	void _pad()
 	{
-		_buf.resize((_buf.size() + 3) & ~3);
+		size_t padded = _pad_size(_size);
+		std::fill(_buf.data() + _size, _buf.data() + padded, std::byte{});
+		_size = padded;
+	}
+
+	void _reserve(size_t block_size)
+	{
+		if (_buf.size() - _size < block_size)
+		{
+			this->_flush_buffer();
+			_reserve_capacity(block_size);
+		}
 	}
 
-	void _new_block(uint32_t type)
+	// The body size must be an upper bound on what will be appended
+	// before the matching `_end_block`.
+	void _new_block(uint32_t type, size_t body_size)
 	{
-		_buf.clear();
+		_reserve(body_size + 12);
+
+		_block_start = _size;
 		this->_append(type);
 		this->_append((uint32_t)0);
 	}
 
 	void _end_block()
 	{
-		uint32_t len = (uint32_t)(_buf.size() + 4);
+		uint32_t len = (uint32_t)(_size - _block_start + 4);
 		_append(len);
-		*(uint32_t *)&_buf[4] = len;
-
-		_write(_buf);
+		memcpy(&_buf[_block_start + 4], &len, sizeof len);
 	}
 
 	void _append(std::span<std::byte const> data)
 	{
-		_buf.insert(_buf.end(), data.begin(), data.end());
+		memcpy(_buf.data() + _size, data.data(), data.size());
+		_size += data.size();
 	}
 
 	template <payload T>
@@ -125,7 +498,7 @@ private:
 	template <payload T>
 	void _opt(uint16_t type, T const & payload)
 	{
-		this->_opt(type, std::as_bytes({ &payload, 1 }));
+		this->_opt(type, std::as_bytes(std::span<T const>{ &payload, 1 }));
 	}
 
 	void _opt(uint16_t type, std::string_view payload)
@@ -133,26 +506,11 @@ private:
 		this->_opt(type, std::as_bytes(std::span<char const>{ payload.data(), payload.size() }));
 	}
 
-	template <payload T>
-	void _write(T const & data)
-	{
-		this->_write(std::as_bytes(std::span<T const>{ &data, 1 }));
-	}
-
-	void _write(std::span<std::byte const> data)
+	struct _block_header_t
 	{
-		OVERLAPPED ov = {};
-		ov.Offset = 0xffffffff;
-		ov.OffsetHigh = 0xffffffff;
-		while (!data.empty())
-		{
-			DWORD written;
-			if (!WriteFile(_h, data.data(), (DWORD)data.size(), &written, &ov))
-				throw std::system_error(GetLastError(), std::system_category());
-
-			data = data.subspan(written);
-		}
-	}
+		uint32_t type;
+		uint32_t length;
+	};
 
 	struct _section_header_t
 	{
@@ -169,6 +527,13 @@ private:
 		uint32_t snaplen;
 	};
 
+	struct _interface_statistics_t
+	{
+		uint32_t intf_id;
+		uint32_t timestamp_hi;
+		uint32_t timestamp_lo;
+	};
+
 	struct _enhanced_packet_t
 	{
 		uint32_t intf_id;
@@ -180,9 +545,23 @@ private:
 
 
 	std::vector<std::byte> _buf;
+	size_t _buf_capacity;
+	size_t _size = 0;
+	size_t _block_start = 0;
+
+	std::shared_ptr<byte_output> _out;
+	std::unique_ptr<write_behind> _io;
+	uint64_t _stream_offset = 0;
+	size_t _section_length = 0;
+	uint64_t _stall_us = 0;
+
+	uint64_t _checkpoint_interval = 0;
+	std::chrono::steady_clock::time_point _next_checkpoint;
 
-	HANDLE _h;
 	uint32_t _intf_count = 0;
-};
+	std::vector<uint16_t> _if_types;
 
-#pragma once
+	// The conversion of each interface's timestamps to the index's microseconds.
+	std::vector<std::optional<timestamp_scale>> _if_scales;
+	std::unique_ptr<capture_index_writer> _index;
+};
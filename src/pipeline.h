@@ -0,0 +1,313 @@
+#pragma once
+#include "content.h"
+#include "filter.h"
+#include "packet.h"
+#include "packet_sink.h"
+#include "pcapng.h"
+
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Spreads the decoding and filtering of the packets over several worker threads.
+//
+// The capture thread only encodes each packet into the current batch,
+// which is the one copy of the payload that can't be avoided. Batch `k` is
+// handed to worker `k % N`, which decodes its packets and matches them
+// against the filter and the content patterns in place, closing up the gaps
+// left by the dropped ones. A separate commit thread
+// takes the batches back in the same round-robin order and passes each
+// buffer to the writer as a whole, so the packets reach the output in
+// arrival order and aren't copied again.
+//
+// A batch is handed over once it's full or on the next tick, which the
+// commit thread passes on to the writer in order. The batch buffers are swapped with the writer's rather
+// than reallocated, so the steady state doesn't allocate.
+struct packet_pipeline final
+	: packet_sink
+{
+	static constexpr size_t batch_size = pcapng_writer::default_buffer_size;
+
+	packet_pipeline(std::shared_ptr<pcapng_writer> writer, size_t worker_count, packet_filter filter = {},
+		std::optional<content_matcher> content = {}, size_t queue_depth = 2)
+		: _writer(std::move(writer)), _filter(std::move(filter)), _content(std::move(content))
+	{
+		if (worker_count == 0)
+			worker_count = 1;
+		if (queue_depth == 0)
+			queue_depth = 1;
+
+		_workers.reserve(worker_count);
+		for (size_t i = 0; i != worker_count; ++i)
+			_workers.push_back(std::make_unique<_worker_t>(queue_depth));
+
+		for (auto & w: _workers)
+			w->thread = std::thread([this, w = w.get()] { this->_filter_loop(*w); });
+		_committer = std::thread([this] { this->_commit_loop(); });
+	}
+
+	~packet_pipeline()
+	{
+		this->_drain();
+
+		for (auto & w: _workers)
+		{
+			for (auto & batch: w->batches)
+			{
+				batch.state.store(_st_stop, std::memory_order_release);
+				batch.state.notify_all();
+			}
+		}
+
+		for (auto & w: _workers)
+			w->thread.join();
+		_committer.join();
+	}
+
+	packet_pipeline(packet_pipeline const &) = delete;
+	packet_pipeline & operator=(packet_pipeline const &) = delete;
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		// Interfaces are rare, so rather than sequencing them with the packets,
+		// wait for the packets in flight to be committed.
+		this->_drain();
+		this->_rethrow();
+
+		_if_types.push_back(intf.link_type);
+		return _writer->add_interface(intf);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) override
+	{
+		this->_rethrow();
+
+		size_t size = pcapng_writer::packet_block_size(payload.size(), flags);
+		if (_cur && _cur->buf.size() - _cur->size < size)
+			this->_submit();
+
+		if (!_cur)
+		{
+			this->_acquire();
+			if (_cur->buf.size() < size)
+				_cur->buf.resize(size);
+		}
+
+		_cur->size += pcapng_writer::encode_packet({ _cur->buf.data() + _cur->size, size }, ifidx, timestamp, payload, full_length, flags);
+	}
+
+	void tick() override
+	{
+		this->_rethrow();
+
+		if (!_cur)
+			this->_acquire();
+		_cur->tick = true;
+		this->_submit();
+	}
+
+	void flush() override
+	{
+		this->_drain();
+		this->_rethrow();
+		_writer->flush();
+	}
+
+private:
+	enum: uint32_t
+	{
+		_st_free,
+		_st_filled,
+		_st_filtered,
+		_st_stop,
+	};
+
+	struct _batch_t
+	{
+		std::atomic<uint32_t> state = _st_free;
+		std::vector<std::byte> buf;
+		size_t size = 0;
+
+		// Whether to pass a tick to the writer after the batch.
+		bool tick = false;
+	};
+
+	struct _worker_t
+	{
+		explicit _worker_t(size_t queue_depth)
+			: batches(queue_depth)
+		{
+		}
+
+		std::vector<_batch_t> batches;
+		size_t submit_pos = 0;
+		size_t commit_pos = 0;
+		decoded_packet pkt;
+		std::thread thread;
+	};
+
+	// Takes the next batch in round-robin order, once it's free.
+	void _acquire()
+	{
+		_worker_t & w = *_workers[_submitted % _workers.size()];
+		_batch_t & batch = w.batches[w.submit_pos];
+		w.submit_pos = (w.submit_pos + 1) % w.batches.size();
+
+		for (uint32_t st; (st = batch.state.load(std::memory_order_acquire)) != _st_free; )
+			batch.state.wait(st, std::memory_order_acquire);
+
+		// Buffers swapped in from the writer may be smaller.
+		if (batch.buf.size() < batch_size)
+			batch.buf.resize(batch_size);
+		batch.size = 0;
+		batch.tick = false;
+		_cur = &batch;
+	}
+
+	void _submit()
+	{
+		_cur->state.store(_st_filled, std::memory_order_release);
+		_cur->state.notify_all();
+		_cur = nullptr;
+		++_submitted;
+	}
+
+	void _filter_loop(_worker_t & w)
+	{
+		for (size_t pos = 0;; pos = (pos + 1) % w.batches.size())
+		{
+			_batch_t & batch = w.batches[pos];
+
+			uint32_t st;
+			while ((st = batch.state.load(std::memory_order_acquire)) != _st_filled)
+			{
+				if (st == _st_stop)
+					return;
+				batch.state.wait(st, std::memory_order_acquire);
+			}
+
+			if (!_filter.empty() || _content)
+				this->_filter_batch(batch, w.pkt);
+
+			batch.state.store(_st_filtered, std::memory_order_release);
+			batch.state.notify_all();
+		}
+	}
+
+	// Drops the blocks that don't match the filter or the content patterns,
+	// moving the rest down. As with `content_filter`, the L4 payload is
+	// searched, or the whole packet if its headers can't be decoded.
+	void _filter_batch(_batch_t & batch, decoded_packet & pkt) const noexcept
+	{
+		std::byte * p = batch.buf.data();
+
+		size_t kept = 0;
+		for (size_t pos = 0; pos != batch.size;)
+		{
+			uint32_t len, ifidx, captured_len, packet_len;
+			memcpy(&len, p + pos + 4, 4);
+			memcpy(&ifidx, p + pos + 8, 4);
+			memcpy(&captured_len, p + pos + 20, 4);
+			memcpy(&packet_len, p + pos + 24, 4);
+
+			std::span<std::byte const> data(p + pos + 28, captured_len);
+			decode_packet(_if_types[ifidx], data, pkt);
+			if (_filter.match(pkt, packet_len)
+				&& (!_content || _content->match(pkt.payload_offset != decoded_packet::npos? pkt.payload(): data)))
+			{
+				if (kept != pos)
+					memmove(p + kept, p + pos, len);
+				kept += len;
+			}
+
+			pos += len;
+		}
+
+		batch.size = kept;
+	}
+
+	void _commit_loop()
+	{
+		for (size_t k = 0;; ++k)
+		{
+			_worker_t & w = *_workers[k % _workers.size()];
+			_batch_t & batch = w.batches[w.commit_pos];
+			w.commit_pos = (w.commit_pos + 1) % w.batches.size();
+
+			uint32_t st;
+			while ((st = batch.state.load(std::memory_order_acquire)) != _st_filtered)
+			{
+				if (st == _st_stop)
+					return;
+				batch.state.wait(st, std::memory_order_acquire);
+			}
+
+			// After a write error, keep draining the batches so that the producer
+			// doesn't block; it will pick up the error on its next call.
+			if (!_failed.load(std::memory_order_relaxed) && (batch.size != 0 || batch.tick))
+			{
+				try
+				{
+					if (batch.size != 0)
+						batch.buf = _writer->add_blocks(std::move(batch.buf), batch.size);
+					if (batch.tick)
+						_writer->tick();
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(_error_mutex);
+					_error = std::current_exception();
+					_failed.store(true, std::memory_order_release);
+				}
+			}
+
+			batch.state.store(_st_free, std::memory_order_release);
+			batch.state.notify_all();
+
+			_committed.store(k + 1, std::memory_order_release);
+			_committed.notify_all();
+		}
+	}
+
+	void _drain()
+	{
+		if (_cur && _cur->size != 0)
+			this->_submit();
+
+		for (uint64_t c; (c = _committed.load(std::memory_order_acquire)) != _submitted; )
+			_committed.wait(c, std::memory_order_acquire);
+	}
+
+	void _rethrow()
+	{
+		if (!_failed.load(std::memory_order_acquire))
+			return;
+
+		std::lock_guard<std::mutex> lock(_error_mutex);
+		if (_error)
+			std::rethrow_exception(std::exchange(_error, nullptr));
+	}
+
+	std::shared_ptr<pcapng_writer> _writer;
+	packet_filter _filter;
+	std::optional<content_matcher> _content;
+	std::vector<uint16_t> _if_types;
+
+	std::vector<std::unique_ptr<_worker_t>> _workers;
+	std::thread _committer;
+
+	// The batch being filled by the capture thread.
+	_batch_t * _cur = nullptr;
+	uint64_t _submitted = 0;
+	std::atomic<uint64_t> _committed = 0;
+
+	std::atomic<bool> _failed = false;
+	std::mutex _error_mutex;
+	std::exception_ptr _error;
+};
@@ -0,0 +1,768 @@
+#pragma once
+#include "output.h"
+#include "packet.h"
+#include "packet_sink.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <span>
+#include <stdint.h>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+// Fixed-size blocks for the segments that arrive ahead of a hole.
+//
+// The blocks are allocated in slabs as they are needed, up to the budget,
+// and are recycled through a free list. A segment is stored as a chain
+// of blocks, linked by a table beside the slabs. Memory that is used
+// for other things can be reserved out of the same budget.
+struct segment_pool
+{
+	static constexpr size_t block_size = 2048;
+	static constexpr uint32_t none = ~(uint32_t)0;
+
+	explicit segment_pool(size_t budget)
+		: _capacity(budget / block_size), _next(_capacity)
+	{
+	}
+
+	static size_t blocks_for(size_t size) noexcept
+	{
+		return (size + block_size - 1) / block_size;
+	}
+
+	size_t available() const noexcept
+	{
+		return this->_free_bytes() / block_size;
+	}
+
+	// Takes `size` bytes out of the budget, if they are available.
+	bool reserve(size_t size) noexcept
+	{
+		if (size > this->_free_bytes())
+			return false;
+
+		_reserved += size;
+		return true;
+	}
+
+	void unreserve(size_t size) noexcept
+	{
+		_reserved -= size;
+	}
+
+	// Copies the data into a chain of blocks, or returns `none`
+	// if there aren't enough free blocks.
+	uint32_t store(std::span<std::byte const> data)
+	{
+		size_t count = blocks_for(data.size());
+		if (count == 0 || count > this->available())
+			return none;
+
+		uint32_t head = none;
+		uint32_t * link = &head;
+		for (size_t i = 0; i != count; ++i)
+		{
+			uint32_t b = this->_alloc();
+			size_t n = (std::min)(data.size(), block_size);
+			memcpy(this->_block(b), data.data(), n);
+			data = data.subspan(n);
+
+			*link = b;
+			link = &_next[b];
+		}
+
+		*link = none;
+		_used += count;
+		return head;
+	}
+
+	// Calls `fn` with the stored data, a block at a time.
+	template <typename F>
+	void read(uint32_t head, size_t size, F && fn) const
+	{
+		for (uint32_t b = head; b != none && size != 0; b = _next[b])
+		{
+			size_t n = (std::min)(size, block_size);
+			fn(std::span<std::byte const>(this->_block(b), n));
+			size -= n;
+		}
+	}
+
+	void release(uint32_t head) noexcept
+	{
+		while (head != none)
+		{
+			uint32_t next = _next[head];
+			_next[head] = _free;
+			_free = head;
+			head = next;
+			--_used;
+		}
+	}
+
+private:
+	static constexpr size_t _slab_blocks = 256;
+
+	size_t _free_bytes() const noexcept
+	{
+		return (_capacity - _used) * block_size - _reserved;
+	}
+
+	uint32_t _alloc()
+	{
+		if (_free == none)
+		{
+			size_t first = _slabs.size() * _slab_blocks;
+			size_t count = (std::min)(_slab_blocks, _capacity - first);
+			_slabs.push_back(std::make_unique<std::byte[]>(count * block_size));
+
+			for (size_t b = first + count; b-- != first;)
+			{
+				_next[b] = _free;
+				_free = (uint32_t)b;
+			}
+		}
+
+		uint32_t b = _free;
+		_free = _next[b];
+		return b;
+	}
+
+	std::byte * _block(uint32_t b) const noexcept
+	{
+		return _slabs[b / _slab_blocks].get() + (b % _slab_blocks) * block_size;
+	}
+
+	size_t _capacity;
+	size_t _used = 0;
+	size_t _reserved = 0;
+	std::vector<uint32_t> _next;
+	std::vector<std::unique_ptr<std::byte[]>> _slabs;
+	uint32_t _free = none;
+};
+
+// One direction of a TCP connection.
+struct tcp_flow_key
+{
+	uint8_t ip_version = 0;
+	std::array<uint8_t, 16> src_ip = {};
+	std::array<uint8_t, 16> dst_ip = {};
+	uint16_t src_port = 0;
+	uint16_t dst_port = 0;
+
+	tcp_flow_key reversed() const noexcept
+	{
+		return { ip_version, dst_ip, src_ip, dst_port, src_port };
+	}
+
+	// Whether this is the direction the connection is keyed by.
+	bool canonical() const noexcept
+	{
+		int r = memcmp(src_ip.data(), dst_ip.data(), src_ip.size());
+		return r < 0 || (r == 0 && src_port <= dst_port);
+	}
+
+	bool operator==(tcp_flow_key const &) const = default;
+};
+
+// The name of the file a direction is written to, in the style of tcpflow:
+// the source and destination address and port, e.g. `10.0.0.1.51000-10.0.0.2.80`.
+// IPv6 addresses are written as eight dot-separated hex groups, since colons
+// aren't allowed in file names.
+inline std::string tcp_stream_file_name(tcp_flow_key const & key)
+{
+	std::string r;
+	auto endpoint = [&](std::array<uint8_t, 16> const & addr, uint16_t port) {
+		char buf[64];
+		if (key.ip_version == 4)
+		{
+			snprintf(buf, sizeof buf, "%u.%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3], port);
+		}
+		else
+		{
+			snprintf(buf, sizeof buf, "%x.%x.%x.%x.%x.%x.%x.%x.%u",
+				(addr[0] << 8) | addr[1], (addr[2] << 8) | addr[3], (addr[4] << 8) | addr[5], (addr[6] << 8) | addr[7],
+				(addr[8] << 8) | addr[9], (addr[10] << 8) | addr[11], (addr[12] << 8) | addr[13], (addr[14] << 8) | addr[15],
+				port);
+		}
+		r += buf;
+	};
+
+	endpoint(key.src_ip, key.src_port);
+	r += '-';
+	endpoint(key.dst_ip, key.dst_port);
+	return r;
+}
+
+struct tcp_reassembly_stats
+{
+	// The directions that had any data written.
+	uint64_t streams = 0;
+
+	uint64_t bytes = 0;
+
+	// Retransmitted or overlapping bytes that were already written.
+	uint64_t duplicate_bytes = 0;
+
+	// Bytes in the holes that were given up on, cut off by the snaplen,
+	// or of connections there was no memory or no file for.
+	uint64_t lost_bytes = 0;
+
+	// The directions whose output couldn't be opened, such as when
+	// the process ran out of file descriptors.
+	uint64_t dropped_streams = 0;
+};
+
+// Reassembles the TCP streams and writes the bytes of each direction
+// to its own output.
+//
+// In-order data is written straight through. Segments past a hole are held
+// in pooled blocks until the hole is filled; when holding another segment
+// would exceed the budget of the direction or of the whole pool, the first
+// hole is given up on and the held data behind it is written out, so memory
+// use stays bounded no matter how much is lost. The connection table and
+// the lists of held segments are paid for out of the same budget; a new
+// connection that doesn't fit gives up the oldest holes first, and is
+// ignored if that isn't enough. Bytes that were already written win over
+// retransmissions and overlaps.
+//
+// At most `max_open` outputs are open at a time. The one written least
+// recently is closed to make room, and is opened again through the factory
+// when it gets more data, so the factory must append to what it wrote
+// before. A direction whose output can't be opened is dropped and counted
+// in `dropped_streams` rather than failing the capture.
+//
+// A direction ends with its FIN, both end with an RST, and connections that
+// have been idle for `idle_timeout` microseconds are dropped. A SYN with
+// a new sequence number starts the connection over.
+struct tcp_reassembler final
+	: packet_sink
+{
+	using output_factory = std::function<std::shared_ptr<byte_output>(tcp_flow_key const & key)>;
+
+	static constexpr size_t default_budget = 64 << 20;
+	static constexpr size_t default_flow_budget = 1 << 20;
+	static constexpr uint64_t default_idle_timeout = 60'000'000;
+	static constexpr size_t default_max_open = 256;
+
+	// Writes the streams to files in the directory, named by `tcp_stream_file_name`.
+	explicit tcp_reassembler(std::filesystem::path const & dir, size_t budget = default_budget, size_t flow_budget = default_flow_budget,
+		size_t max_open = default_max_open)
+		: tcp_reassembler(_directory_outputs(dir), budget, flow_budget, default_idle_timeout, max_open)
+	{
+	}
+
+	explicit tcp_reassembler(output_factory factory, size_t budget = default_budget, size_t flow_budget = default_flow_budget,
+		uint64_t idle_timeout = default_idle_timeout, size_t max_open = default_max_open)
+		: _factory(std::move(factory)), _pool(budget), _flow_blocks(flow_budget / segment_pool::block_size),
+		_idle_timeout(idle_timeout), _max_open(max_open ? max_open : 1)
+	{
+	}
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		_if_types.push_back(intf.link_type);
+		return (uint32_t)(_if_types.size() - 1);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t /*full_length*/, uint32_t /*flags*/) override
+	{
+		decode_packet(_if_types[ifidx], payload, _pkt);
+		if (_pkt.ip_proto != ip_proto_tcp || _pkt.ip_fragment || _pkt.payload_offset == decoded_packet::npos)
+			return;
+
+		// The segment length comes from the IP header, so that Ethernet padding
+		// isn't taken for data and truncated segments are noticed. Segments
+		// offloaded to the NIC may have no IPv4 length at all.
+		std::byte const * ip = payload.data() + _pkt.l3_offset;
+		size_t ip_end = _pkt.ip_version == 4
+			? _pkt.l3_offset + load_be16(ip + 2)
+			: _pkt.l3_offset + 40 + load_be16(ip + 4);
+
+		std::span<std::byte const> data = _pkt.payload();
+		size_t length = data.size();
+		if (ip_end > _pkt.payload_offset)
+		{
+			length = ip_end - _pkt.payload_offset;
+			data = data.first((std::min)(data.size(), length));
+		}
+
+		tcp_flow_key key = {
+			.ip_version = _pkt.ip_version,
+			.src_ip = _pkt.src_ip,
+			.dst_ip = _pkt.dst_ip,
+			.src_port = _pkt.src_port,
+			.dst_port = _pkt.dst_port,
+		};
+
+		this->add_segment(key, timestamp, _pkt.tcp_seq, _pkt.tcp_flags, data, length);
+	}
+
+	// Adds a segment of `length` bytes of sequence space, of which the first
+	// `data.size()` were captured.
+	void add_segment(tcp_flow_key const & key, uint64_t timestamp, uint32_t seq, uint8_t tcp_flags,
+		std::span<std::byte const> data, size_t length)
+	{
+		if (timestamp >= _next_expiry)
+			this->_expire(timestamp);
+
+		bool forward = key.canonical();
+		tcp_flow_key flow_key = forward? key: key.reversed();
+		auto it = _flows.find(flow_key);
+		if (it == _flows.end())
+		{
+			if (!this->_reserve(_flow_entry_size()))
+			{
+				_stats.lost_bytes += length;
+				return;
+			}
+
+			it = _flows.try_emplace(flow_key).first;
+		}
+
+		_flow_t & flow = it->second;
+		flow.last_seen = timestamp;
+
+		if (tcp_flags & tcp_rst)
+		{
+			this->_finish(it->first, flow);
+			return;
+		}
+
+		_stream_t * s = &flow.dirs[forward? 0: 1];
+		if (tcp_flags & tcp_syn)
+		{
+			if (s->synced && s->base != seq + 1)
+			{
+				this->_finish(it->first, flow);
+				flow = {};
+				flow.last_seen = timestamp;
+			}
+
+			s->synced = true;
+			s->base = seq + 1;
+			++seq;
+		}
+
+		if (s->closed)
+		{
+			if (s->failed)
+				_stats.lost_bytes += length;
+			else
+				_stats.duplicate_bytes += length;
+			return;
+		}
+
+		if (!s->synced)
+		{
+			// Joined in the middle of the connection.
+			if (length == 0)
+				return;
+
+			s->synced = true;
+			s->base = seq;
+		}
+
+		// The offset into the stream, relative to the next byte to write.
+		int64_t rel = (int32_t)(seq - (uint32_t)(s->base + s->next));
+		if (rel < 0 && (uint64_t)-rel > s->next)
+		{
+			// Starts before the stream; only the rest is of any use.
+			size_t skip = (size_t)(-rel - (int64_t)s->next);
+			if (skip >= length)
+				return;
+
+			data = data.subspan((std::min)(skip, data.size()));
+			length -= skip;
+			rel = -(int64_t)s->next;
+		}
+
+		uint64_t offset = s->next + rel;
+		if (tcp_flags & tcp_fin)
+			s->fin = offset + length;
+
+		this->_add(key, *s, offset, data, length);
+		if (s->failed || s->next >= s->fin)
+			this->_close(*s);
+	}
+
+	// Writes out everything that is held, giving up on the holes.
+	void flush() override
+	{
+		for (auto & [key, flow]: _flows)
+		{
+			for (size_t i = 0; i != 2; ++i)
+				this->_give_up(i == 0? key: key.reversed(), flow.dirs[i]);
+		}
+	}
+
+	tcp_reassembly_stats const & stats() const noexcept
+	{
+		return _stats;
+	}
+
+private:
+	struct _held_t
+	{
+		uint64_t offset;
+		uint32_t head;
+
+		// The bytes stored and the bytes of sequence space covered.
+		uint32_t size;
+		uint32_t length;
+	};
+
+	struct _holder_t;
+
+	struct _stream_t
+	{
+		std::shared_ptr<byte_output> out;
+
+		// The place in `_open_streams` while `out` is open.
+		std::list<_stream_t *>::iterator lru;
+
+		// The place in `_holders` while `held` isn't empty.
+		std::list<_holder_t>::iterator holder;
+
+		// Sorted by offset.
+		std::vector<_held_t> held;
+		size_t held_blocks = 0;
+
+		// The stream offset of the next byte to write and of the FIN.
+		uint64_t next = 0;
+		uint64_t fin = ~(uint64_t)0;
+
+		// The sequence number of the first byte of the stream.
+		uint32_t base = 0;
+
+		bool synced = false;
+		bool closed = false;
+
+		// Whether the output was ever opened, and whether opening it failed.
+		bool opened = false;
+		bool failed = false;
+	};
+
+	struct _holder_t
+	{
+		tcp_flow_key key;
+		_stream_t * s;
+	};
+
+	struct _flow_t
+	{
+		// The canonical direction first.
+		std::array<_stream_t, 2> dirs;
+		uint64_t last_seen = 0;
+	};
+
+	struct _key_hash
+	{
+		size_t operator()(tcp_flow_key const & key) const noexcept
+		{
+			// FNV-1a over the addresses and ports.
+			uint64_t h = 0xcbf29ce484222325;
+			auto feed = [&](void const * p, size_t len) {
+				for (size_t i = 0; i != len; ++i)
+					h = (h ^ ((uint8_t const *)p)[i]) * 0x100000001b3;
+			};
+
+			feed(key.src_ip.data(), key.src_ip.size());
+			feed(key.dst_ip.data(), key.dst_ip.size());
+			feed(&key.src_port, sizeof key.src_port);
+			feed(&key.dst_port, sizeof key.dst_port);
+			return (size_t)h;
+		}
+	};
+
+	static output_factory _directory_outputs(std::filesystem::path const & dir)
+	{
+		std::filesystem::create_directories(dir);
+		return [dir](tcp_flow_key const & key) {
+			return std::make_shared<file_output>(dir / tcp_stream_file_name(key));
+		};
+	}
+
+	void _add(tcp_flow_key const & key, _stream_t & s, uint64_t offset, std::span<std::byte const> data, size_t length)
+	{
+		for (;;)
+		{
+			if (offset + length <= s.next)
+			{
+				_stats.duplicate_bytes += length;
+				return;
+			}
+
+			if (offset <= s.next)
+			{
+				this->_write(key, s, offset, length, [&](auto && fn) { fn(data); }, data.size());
+				this->_drain(key, s);
+				return;
+			}
+
+			if (this->_hold(key, s, offset, data, length))
+				return;
+
+			// There is no room to wait for the hole to be filled, so skip
+			// to whichever comes first, the segment or the held data.
+			uint64_t to = s.held.empty()? offset: (std::min)(offset, s.held.front().offset);
+			_stats.lost_bytes += to - s.next;
+			s.next = to;
+			this->_drain(key, s);
+		}
+	}
+
+	bool _hold(tcp_flow_key const & key, _stream_t & s, uint64_t offset, std::span<std::byte const> data, size_t length)
+	{
+		if (length == 0)
+			return true;
+
+		size_t blocks = segment_pool::blocks_for(data.size());
+		if (s.held_blocks + blocks > _flow_blocks || blocks > _pool.available())
+			return false;
+
+		// Grow the list by hand, so that its memory is accounted for.
+		if (s.held.size() == s.held.capacity())
+		{
+			size_t capacity = (std::max)(s.held.capacity() * 2, (size_t)4);
+			size_t extra = (capacity - s.held.capacity()) * sizeof(_held_t);
+			if (!_pool.reserve(extra + blocks * segment_pool::block_size))
+				return false;
+
+			_pool.unreserve(blocks * segment_pool::block_size);
+			s.held.reserve(capacity);
+		}
+
+		auto pos = std::lower_bound(s.held.begin(), s.held.end(), offset,
+			[](_held_t const & h, uint64_t off) { return h.offset < off; });
+		if (pos != s.held.end() && pos->offset == offset)
+		{
+			if (pos->length >= length)
+			{
+				_stats.duplicate_bytes += length;
+				return true;
+			}
+
+			_stats.duplicate_bytes += pos->length;
+			s.held_blocks -= segment_pool::blocks_for(pos->size);
+			_pool.release(pos->head);
+			pos = s.held.erase(pos);
+		}
+
+		if (s.held.empty())
+			s.holder = _holders.insert(_holders.end(), { key, &s });
+
+		s.held.insert(pos, { offset, _pool.store(data), (uint32_t)data.size(), (uint32_t)length });
+		s.held_blocks += blocks;
+		return true;
+	}
+
+	// Writes the bytes of a segment starting at or before `s.next`.
+	// `read` passes the `size` captured bytes to its argument in pieces.
+	template <typename Read>
+	void _write(tcp_flow_key const & key, _stream_t & s, uint64_t offset, size_t length, Read && read, size_t size)
+	{
+		uint64_t end = offset + length;
+		uint64_t data_end = offset + size;
+		_stats.duplicate_bytes += s.next - offset;
+
+		if (data_end > s.next && !s.out && !s.failed)
+			this->_open(key, s);
+
+		if (s.failed)
+		{
+			_stats.lost_bytes += end - s.next;
+			s.next = end;
+			return;
+		}
+
+		if (data_end > s.next)
+		{
+			_open_streams.splice(_open_streams.begin(), _open_streams, s.lru);
+
+			uint64_t skip = s.next - offset;
+			read([&](std::span<std::byte const> piece) {
+				if (skip >= piece.size())
+				{
+					skip -= piece.size();
+					return;
+				}
+
+				piece = piece.subspan((size_t)skip);
+				skip = 0;
+				s.out->write(piece);
+				_stats.bytes += piece.size();
+			});
+		}
+
+		_stats.lost_bytes += end - (std::max)(data_end, s.next);
+		s.next = end;
+	}
+
+	void _open(tcp_flow_key const & key, _stream_t & s)
+	{
+		if (_open_streams.size() >= _max_open)
+		{
+			_stream_t * lru = _open_streams.back();
+			lru->out.reset();
+			_open_streams.pop_back();
+		}
+
+		try
+		{
+			s.out = _factory(key);
+		}
+		catch (std::system_error const &)
+		{
+			s.failed = true;
+			++_stats.dropped_streams;
+			return;
+		}
+
+		_open_streams.push_front(&s);
+		s.lru = _open_streams.begin();
+		if (!s.opened)
+		{
+			s.opened = true;
+			++_stats.streams;
+		}
+	}
+
+	// Writes out the held segments that the stream has caught up with.
+	void _drain(tcp_flow_key const & key, _stream_t & s)
+	{
+		size_t done = 0;
+		for (; done != s.held.size() && s.held[done].offset <= s.next; ++done)
+		{
+			_held_t const & h = s.held[done];
+			if (h.offset + h.length > s.next)
+			{
+				this->_write(key, s, h.offset, h.length,
+					[&](auto && fn) { _pool.read(h.head, h.size, fn); }, h.size);
+			}
+			else
+			{
+				_stats.duplicate_bytes += h.length;
+			}
+
+			s.held_blocks -= segment_pool::blocks_for(h.size);
+			_pool.release(h.head);
+		}
+
+		if (done != 0 && done == s.held.size())
+			_holders.erase(s.holder);
+		s.held.erase(s.held.begin(), s.held.begin() + done);
+	}
+
+	// Takes `size` bytes out of the budget, giving up on the oldest holes
+	// to make room if needed.
+	bool _reserve(size_t size)
+	{
+		while (!_pool.reserve(size))
+		{
+			if (_holders.empty())
+				return false;
+
+			_holder_t h = _holders.front();
+			this->_give_up(h.key, *h.s);
+		}
+
+		return true;
+	}
+
+	void _give_up(tcp_flow_key const & key, _stream_t & s)
+	{
+		while (!s.held.empty())
+		{
+			_stats.lost_bytes += s.held.front().offset - s.next;
+			s.next = s.held.front().offset;
+			this->_drain(key, s);
+		}
+	}
+
+	void _close(_stream_t & s) noexcept
+	{
+		if (!s.held.empty())
+			_holders.erase(s.holder);
+
+		for (_held_t const & h: s.held)
+		{
+			if (s.failed)
+				_stats.lost_bytes += h.length;
+			_pool.release(h.head);
+		}
+
+		_pool.unreserve(s.held.capacity() * sizeof(_held_t));
+		std::vector<_held_t>().swap(s.held);
+		s.held_blocks = 0;
+		if (s.out)
+		{
+			_open_streams.erase(s.lru);
+			s.out.reset();
+		}
+		s.closed = true;
+	}
+
+	void _finish(tcp_flow_key const & key, _flow_t & flow)
+	{
+		for (size_t i = 0; i != 2; ++i)
+		{
+			this->_give_up(i == 0? key: key.reversed(), flow.dirs[i]);
+			this->_close(flow.dirs[i]);
+		}
+	}
+
+	void _expire(uint64_t timestamp)
+	{
+		_next_expiry = timestamp + 1'000'000;
+		for (auto it = _flows.begin(); it != _flows.end();)
+		{
+			if (timestamp - it->second.last_seen < _idle_timeout)
+			{
+				++it;
+				continue;
+			}
+
+			this->_finish(it->first, it->second);
+			it = _flows.erase(it);
+			_pool.unreserve(_flow_entry_size());
+		}
+	}
+
+	using _flow_map = std::unordered_map<tcp_flow_key, _flow_t, _key_hash>;
+
+	// The memory of a connection table entry: the node with its link
+	// and cached hash, and about a bucket.
+	static size_t _flow_entry_size() noexcept
+	{
+		return sizeof(_flow_map::value_type) + 3 * sizeof(void *);
+	}
+
+	output_factory _factory;
+	segment_pool _pool;
+	size_t _flow_blocks;
+	uint64_t _idle_timeout;
+	size_t _max_open;
+	uint64_t _next_expiry = 0;
+
+	_flow_map _flows;
+
+	// The streams with an open output, the most recently written first.
+	std::list<_stream_t *> _open_streams;
+
+	// The streams holding segments, in the order they started to.
+	std::list<_holder_t> _holders;
+	tcp_reassembly_stats _stats;
+
+	std::vector<uint16_t> _if_types;
+	decoded_packet _pkt;
+};
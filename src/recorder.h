@@ -0,0 +1,89 @@
+#pragma once
+#include "filter.h"
+#include "packet_sink.h"
+#include "pcapng.h"
+#include "ring.h"
+#include "shard.h"
+
+#include <filesystem>
+#include <mutex>
+#include <vector>
+
+// Keeps the most recent packets in memory and only writes them
+// out when triggered.
+//
+// Each dump is a complete pcapng section: the section header, all known
+// interfaces and then the buffered packets in order. The ring is emptied
+// afterwards, so consecutive dumps don't overlap. If the output path
+// contains `%n`, each dump goes to a separate file numbered from 1,
+// otherwise the sections are appended to a single file.
+struct flight_recorder final
+	: packet_sink
+{
+	flight_recorder(std::filesystem::path path, size_t capacity, uint64_t max_age, packet_filter trigger = {})
+		: _path(std::move(path)), _ring(capacity, max_age), _trigger(std::move(trigger))
+	{
+	}
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_intfs.push_back(intf);
+		return (uint32_t)(_intfs.size() - 1);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) override
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_ring.push(ifidx, timestamp, payload, full_length, flags);
+
+		if (!_trigger.empty() && _trigger.match(_intfs[ifidx].link_type, payload, full_length))
+			this->_dump_locked();
+	}
+
+	// Writes out the buffered packets, if there are any.
+	void flush() override
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_ring.empty())
+			this->_dump_locked();
+	}
+
+	// Writes out the buffered packets. Can be called from any thread.
+	void dump()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		this->_dump_locked();
+	}
+
+	uint64_t dump_count() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _dumps;
+	}
+
+private:
+	void _dump_locked()
+	{
+		++_dumps;
+
+		pcapng_writer w(expand_path_pattern(_path, 'n', _dumps));
+		for (auto const & intf: _intfs)
+			w.add_interface(intf);
+
+		_ring.for_each([&](std::span<std::byte const> block, uint64_t) {
+			w.add_block(block);
+		});
+
+		w.flush();
+		_ring.clear();
+	}
+
+	std::filesystem::path _path;
+
+	mutable std::mutex _mutex;
+	packet_ring _ring;
+	packet_filter _trigger;
+	std::vector<capture_interface> _intfs;
+	uint64_t _dumps = 0;
+};
@@ -0,0 +1,495 @@
+#pragma once
+#include "index.h"
+#include "mmap.h"
+#include "output.h"
+#include "packet.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct repair_stats
+{
+	// The consistent blocks, and how many of them are packets.
+	uint64_t blocks = 0;
+	uint64_t packets = 0;
+
+	// The ranges of the file that were dropped, as offset and length.
+	std::vector<std::pair<uint64_t, uint64_t>> damaged;
+	uint64_t lost_bytes = 0;
+
+	// The consistent blocks that were dropped, and counted as lost, because
+	// the interface they belong to may have been lost with the damage.
+	uint64_t orphaned_blocks = 0;
+
+	// False if the damage couldn't be repaired in place.
+	bool repaired = false;
+	bool index_rebuilt = false;
+};
+
+// Walks the blocks of a pcapng file that may be truncated or damaged.
+//
+// A block is consistent if its leading and trailing lengths match and
+// fit the file, and, for the blocks that refer to an interface, the
+// interface was described earlier in the section. After a block that
+// fails, the scan resumes at the next offset where a block of a known
+// type starts and is followed by another plausible block or the end of
+// the file. The candidates are picked by their block type four at a time
+// with SSE2, so a damaged range is skipped at memory speed.
+//
+// Only little-endian sections are recognized.
+struct pcapng_scanner
+{
+	explicit pcapng_scanner(mapped_file const & file)
+		: _file(file), _data(file.data())
+	{
+	}
+
+	// Calls `fn(offset, block)` for each consistent block, in file order.
+	template <typename F>
+	repair_stats scan(F && fn)
+	{
+		repair_stats stats;
+		size_t prefetched = 0;
+		for (size_t pos = 0; pos != _data.size();)
+		{
+			if (pos >= prefetched)
+			{
+				_file.prefetch(pos, _prefetch_size);
+				prefetched = pos + _prefetch_size / 2;
+			}
+
+			size_t len = this->_check(pos);
+			if (len == 0)
+			{
+				size_t next = this->_resync(pos + 4);
+				stats.damaged.push_back({ pos, next - pos });
+				stats.lost_bytes += next - pos;
+				pos = next;
+				continue;
+			}
+
+			uint32_t type = this->_u32(pos);
+			if (type == _shb)
+				_intfs = 0;
+			else if (type == _idb)
+				++_intfs;
+			else if (type == _epb || type == _spb)
+				++stats.packets;
+
+			++stats.blocks;
+			fn((uint64_t)pos, _data.subspan(pos, len));
+			pos += len;
+		}
+
+		return stats;
+	}
+
+private:
+	static constexpr size_t _prefetch_size = 32 << 20;
+
+	enum: uint32_t
+	{
+		_idb = 1,
+		_spb = 3,
+		_nrb = 4,
+		_isb = 5,
+		_epb = 6,
+		_dsb = 0xa,
+		_shb = 0x0a0d0d0a,
+	};
+
+	uint32_t _u32(size_t pos) const noexcept
+	{
+		uint32_t r;
+		memcpy(&r, _data.data() + pos, sizeof r);
+		return r;
+	}
+
+	// The length of the block at `pos` if its lengths are consistent, zero otherwise.
+	size_t _frame(size_t pos) const noexcept
+	{
+		size_t rest = _data.size() - pos;
+		if (rest < 12)
+			return 0;
+
+		uint32_t len = this->_u32(pos + 4);
+		if (len < 12 || len % 4 != 0 || len > rest || this->_u32(pos + len - 4) != len)
+			return 0;
+		return len;
+	}
+
+	// The length of the block at `pos` if it is consistent, zero otherwise.
+	size_t _check(size_t pos) const noexcept
+	{
+		size_t len = this->_frame(pos);
+		if (len == 0)
+			return 0;
+
+		switch (this->_u32(pos))
+		{
+		case _shb:
+			return len >= 28 && this->_u32(pos + 8) == 0x1a2b3c4d? len: 0;
+
+		case _idb:
+			return len >= 20? len: 0;
+
+		case _epb:
+			// The captured length must fit before the trailer.
+			if (len < 32 || this->_u32(pos + 8) >= _intfs || this->_u32(pos + 20) > len - 32)
+				return 0;
+			return len;
+
+		case _isb:
+			return len >= 24 && this->_u32(pos + 8) < _intfs? len: 0;
+
+		case _spb:
+			return len >= 16 && _intfs != 0? len: 0;
+
+		default:
+			return len;
+		}
+	}
+
+	// Whether a consistent block of a known type starts at `pos`.
+	bool _plausible(size_t pos) const noexcept
+	{
+		switch (this->_u32(pos))
+		{
+		case _shb:
+		case _idb:
+		case _spb:
+		case _nrb:
+		case _isb:
+		case _epb:
+		case _dsb:
+			break;
+
+		default:
+			return false;
+		}
+
+		size_t len = this->_check(pos);
+		if (len == 0)
+			return false;
+
+		// A single block could be random bytes that happen to look like one;
+		// two in a row practically can't.
+		pos += len;
+		return pos == _data.size() || this->_frame(pos) != 0;
+	}
+
+	// The offset of the next plausible block at or after `pos`,
+	// or the end of the file if there is none.
+	size_t _resync(size_t pos) const noexcept
+	{
+		if (pos >= _data.size())
+			return _data.size();
+
+		std::byte const * p = _data.data();
+
+#if defined(_M_X64) || defined(__SSE2__)
+		// Block types 1 to 15 and the section header.
+		__m128i const shb = _mm_set1_epi32((int)_shb);
+		__m128i const high = _mm_set1_epi32(~0xf);
+		__m128i const zero = _mm_setzero_si128();
+		for (; _data.size() - pos >= 16; pos += 16)
+		{
+			__m128i v = _mm_loadu_si128((__m128i const *)(p + pos));
+			__m128i small = _mm_andnot_si128(_mm_cmpeq_epi32(v, zero), _mm_cmpeq_epi32(_mm_and_si128(v, high), zero));
+			unsigned mask = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(small, _mm_cmpeq_epi32(v, shb))));
+			for (; mask != 0; mask &= mask - 1)
+			{
+				size_t candidate = pos + 4 * (size_t)std::countr_zero(mask);
+				if (this->_plausible(candidate))
+					return candidate;
+			}
+		}
+#endif
+
+		for (; _data.size() - pos >= 12; pos += 4)
+		{
+			if (this->_plausible(pos))
+				return pos;
+		}
+
+		return _data.size();
+	}
+
+	mapped_file const & _file;
+	std::span<std::byte const> _data;
+
+	// The interfaces described so far in the current section.
+	uint32_t _intfs = 0;
+};
+
+// Rebuilds the sidecar index from the blocks that are kept.
+struct _repair_indexer
+{
+	explicit _repair_indexer(std::filesystem::path const & path)
+		: _w(_replace(path))
+	{
+	}
+
+	void add(uint64_t offset, std::span<std::byte const> block)
+	{
+		uint32_t type;
+		memcpy(&type, block.data(), sizeof type);
+
+		switch (type)
+		{
+		case 0x0a0d0d0a:
+			_if_types.clear();
+			_if_scales.clear();
+			_w.add_section(offset, block.size());
+			break;
+
+		case 1:
+		{
+			uint16_t link_type;
+			memcpy(&link_type, block.data() + 8, sizeof link_type);
+			_if_types.push_back(if_type_from_pcap(link_type));
+			_if_scales.push_back(timestamp_scale::of_interface(block, 6));
+			_w.add_interface(offset, block.size());
+			break;
+		}
+
+		case 6:
+		{
+			uint32_t intf, ts_hi, ts_lo, captured_len;
+			memcpy(&intf, block.data() + 8, 4);
+			memcpy(&ts_hi, block.data() + 12, 4);
+			memcpy(&ts_lo, block.data() + 16, 4);
+			memcpy(&captured_len, block.data() + 20, 4);
+
+			// The index is in microseconds; packets whose timestamps
+			// can't be converted are left out.
+			if (auto const & scale = _if_scales[intf])
+			{
+				_w.add_packet(offset, block.size(), (*scale)(((uint64_t)ts_hi << 32) | ts_lo), _if_types[intf],
+					block.subspan(28, captured_len));
+			}
+			break;
+		}
+		}
+	}
+
+	void flush()
+	{
+		_w.flush();
+	}
+
+private:
+	// The index writer appends, so the old index goes first.
+	static std::filesystem::path const & _replace(std::filesystem::path const & path)
+	{
+		std::filesystem::remove(path);
+		return path;
+	}
+
+	capture_index_writer _w;
+	std::vector<uint16_t> _if_types;
+	std::vector<std::optional<timestamp_scale>> _if_scales;
+};
+
+// Salvages the consistent blocks of a capture.
+//
+// Without `out_path`, the file is repaired in place, which is only
+// possible when all of the damage is at its end: the file is truncated
+// after its last consistent block. Otherwise, the consistent blocks are
+// copied to `out_path`, in large writes straight from the mapping, and
+// the section lengths are reset to unspecified as blocks may be missing.
+// If the section header itself is lost, one is made up.
+//
+// Interface ids count the interface blocks of a section, so once there is
+// damage in a section that could have held one, the interfaces that follow
+// it can't be told apart from those lost with it. Those interfaces and the blocks referring to
+// them are dropped, up to the next section header, rather than written
+// under the wrong interface.
+//
+// The sidecar index is rebuilt for the result if the capture had one,
+// or if `write_index` is set.
+inline repair_stats repair_capture(std::filesystem::path const & path, std::filesystem::path const & out_path, bool write_index)
+{
+	auto index_path = [](std::filesystem::path p) {
+		p += ".idx";
+		return p;
+	};
+
+	write_index = write_index || std::filesystem::exists(index_path(path));
+
+	repair_stats stats;
+	if (out_path.empty())
+	{
+		uint64_t size;
+		{
+			mapped_file file(path);
+			stats = pcapng_scanner(file).scan([](uint64_t, std::span<std::byte const>) {});
+			size = file.data().size();
+			if (!stats.damaged.empty())
+			{
+				if (stats.damaged.size() != 1 || stats.damaged[0].first + stats.damaged[0].second != size)
+					return stats;
+				size = stats.damaged[0].first;
+			}
+
+			// Even without damage, the index may be missing its last entries.
+			if (write_index)
+			{
+				_repair_indexer index(index_path(path));
+				pcapng_scanner(file).scan([&](uint64_t offset, std::span<std::byte const> block) {
+					index.add(offset, block);
+				});
+				index.flush();
+				stats.index_rebuilt = true;
+			}
+		}
+
+		// The file can only be truncated once it's no longer mapped.
+		if (!stats.damaged.empty())
+			std::filesystem::resize_file(path, size);
+		stats.repaired = true;
+		return stats;
+	}
+
+	if (std::filesystem::exists(out_path))
+		throw std::runtime_error(out_path.string() + " already exists");
+
+	mapped_file file(path);
+	std::span<std::byte const> data = file.data();
+	file_output out(out_path);
+
+	std::unique_ptr<_repair_indexer> index;
+	if (write_index)
+		index = std::make_unique<_repair_indexer>(index_path(out_path));
+
+	// Consecutive consistent blocks are written out together.
+	size_t run_begin = 0;
+	size_t run_end = 0;
+	uint64_t out_offset = 0;
+	auto write_run = [&] {
+		out.write(data.subspan(run_begin, run_end - run_begin));
+		run_begin = run_end;
+	};
+
+	// The interfaces of the current section whose ids are certain.
+	bool in_section = false;
+	bool section_damaged = false;
+	uint32_t intfs = 0;
+	uint64_t scanned_end = 0;
+
+	uint64_t orphaned_blocks = 0;
+	uint64_t orphaned_bytes = 0;
+
+	stats = pcapng_scanner(file).scan([&](uint64_t offset, std::span<std::byte const> block) {
+		uint32_t type;
+		memcpy(&type, block.data(), sizeof type);
+
+		// A damaged range too short for an interface block, besides the
+		// section header at the start of the file, can't have hidden one.
+		uint64_t gap = offset - scanned_end;
+		uint64_t hidden = in_section? gap: gap - (std::min)(gap, (uint64_t)28);
+		scanned_end = offset + block.size();
+
+		bool keep = true;
+		if (type == 0x0a0d0d0a)
+		{
+			section_damaged = false;
+			intfs = 0;
+		}
+		else
+		{
+			section_damaged = section_damaged || hidden >= 20;
+
+			uint32_t intf = 0;
+			switch (type)
+			{
+			case 1:
+				keep = !section_damaged;
+				if (keep)
+					++intfs;
+				break;
+
+			case 3:
+				keep = intfs != 0;
+				break;
+
+			case 5:
+			case 6:
+				memcpy(&intf, block.data() + 8, sizeof intf);
+				keep = intf < intfs;
+				break;
+			}
+		}
+
+		if (!keep)
+		{
+			++orphaned_blocks;
+			orphaned_bytes += block.size();
+			return;
+		}
+
+		if (type != 0x0a0d0d0a && !in_section)
+		{
+			// Version 1.0, with the section length unspecified.
+			uint32_t const shb_words[7] = { 0x0a0d0d0a, 28, 0x1a2b3c4d, 1, 0xffffffff, 0xffffffff, 28 };
+			std::byte shb[28];
+			memcpy(shb, shb_words, sizeof shb);
+
+			write_run();
+			out.write(shb);
+			if (index)
+				index->add(out_offset, shb);
+			out_offset += sizeof shb;
+		}
+		in_section = true;
+
+		if (offset != run_end || run_end - run_begin >= (16 << 20) || type == 0x0a0d0d0a)
+		{
+			write_run();
+			run_begin = run_end = (size_t)offset;
+		}
+
+		if (type == 0x0a0d0d0a)
+		{
+			std::vector<std::byte> shb(block.begin(), block.end());
+			int64_t section_length = -1;
+			memcpy(shb.data() + 16, &section_length, sizeof section_length);
+			out.write(shb);
+			run_begin = run_end = (size_t)offset + block.size();
+		}
+		else
+		{
+			run_end = (size_t)offset + block.size();
+		}
+
+		if (index)
+			index->add(out_offset, block);
+		out_offset += block.size();
+	});
+	write_run();
+
+	stats.orphaned_blocks = orphaned_blocks;
+	stats.lost_bytes += orphaned_bytes;
+
+	if (index)
+	{
+		index->flush();
+		stats.index_rebuilt = true;
+	}
+
+	stats.repaired = true;
+	return stats;
+}
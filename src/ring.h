@@ -0,0 +1,179 @@
+#pragma once
+#include "pcapng.h"
+
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <stdint.h>
+#include <vector>
+
+// A bounded in-memory history of encoded enhanced packet blocks.
+//
+// The blocks are stored back to back in a preallocated arena; a block never
+// wraps around the end, the unused space at the end is skipped instead.
+// When a new block doesn't fit, or the oldest one is older than `max_age`
+// microseconds, the oldest blocks are discarded.
+struct packet_ring
+{
+	explicit packet_ring(size_t capacity, uint64_t max_age = 0)
+		: _buf(capacity), _max_age(max_age)
+	{
+	}
+
+	size_t size() const noexcept
+	{
+		return _count;
+	}
+
+	bool empty() const noexcept
+	{
+		return _count == 0;
+	}
+
+	// The number of packets that were too large to ever fit in the ring.
+	uint64_t oversized() const noexcept
+	{
+		return _oversized;
+	}
+
+	void clear() noexcept
+	{
+		_count = 0;
+		_head = 0;
+		_tail = 0;
+		_wrapped = false;
+	}
+
+	void push(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags = 0) noexcept
+	{
+		if (_max_age != 0 && timestamp > _max_age)
+			this->evict_before(timestamp - _max_age);
+
+		size_t size = pcapng_writer::packet_block_size(payload.size(), flags);
+		std::byte * p = this->_alloc(size);
+		if (!p)
+		{
+			++_oversized;
+			return;
+		}
+
+		pcapng_writer::encode_packet({ p, size }, ifidx, timestamp, payload, full_length, flags);
+	}
+
+	// Discards the packets older than `timestamp`.
+	void evict_before(uint64_t timestamp) noexcept
+	{
+		while (_count != 0 && _block_timestamp(_buf.data() + _head) < timestamp)
+			this->_pop();
+	}
+
+	uint64_t oldest_timestamp() const noexcept
+	{
+		return _count != 0? _block_timestamp(_buf.data() + _head): 0;
+	}
+
+	// Calls `fn(block, timestamp)` for each stored block, oldest first.
+	template <typename F>
+	void for_each(F && fn) const
+	{
+		if (_count == 0)
+			return;
+
+		if (_wrapped)
+		{
+			this->_for_each_in(_head, _wrap, fn);
+			this->_for_each_in(0, _tail, fn);
+		}
+		else
+		{
+			this->_for_each_in(_head, _tail, fn);
+		}
+	}
+
+private:
+	static uint32_t _block_length(std::byte const * block) noexcept
+	{
+		uint32_t len;
+		memcpy(&len, block + 4, sizeof len);
+		return len;
+	}
+
+	static uint64_t _block_timestamp(std::byte const * block) noexcept
+	{
+		uint32_t hi, lo;
+		memcpy(&hi, block + 12, sizeof hi);
+		memcpy(&lo, block + 16, sizeof lo);
+		return ((uint64_t)hi << 32) | lo;
+	}
+
+	template <typename F>
+	void _for_each_in(size_t first, size_t last, F & fn) const
+	{
+		while (first != last)
+		{
+			std::byte const * block = _buf.data() + first;
+			uint32_t len = _block_length(block);
+			fn(std::span<std::byte const>(block, len), _block_timestamp(block));
+			first += len;
+		}
+	}
+
+	void _pop() noexcept
+	{
+		_head += _block_length(_buf.data() + _head);
+		--_count;
+
+		if (_count == 0)
+		{
+			this->clear();
+		}
+		else if (_wrapped && _head == _wrap)
+		{
+			_head = 0;
+			_wrapped = false;
+		}
+	}
+
+	std::byte * _alloc(size_t size) noexcept
+	{
+		if (size > _buf.size())
+			return nullptr;
+
+		for (;;)
+		{
+			if (!_wrapped)
+			{
+				if (_buf.size() - _tail >= size)
+					break;
+
+				// Skip the rest of the arena and continue at the start.
+				_wrap = _tail;
+				_tail = 0;
+				_wrapped = true;
+				if (_count == 0)
+					this->clear();
+				continue;
+			}
+
+			if (_head - _tail >= size)
+				break;
+
+			this->_pop();
+		}
+
+		std::byte * r = _buf.data() + _tail;
+		_tail += size;
+		++_count;
+		return r;
+	}
+
+	std::vector<std::byte> _buf;
+	uint64_t _max_age;
+
+	size_t _head = 0;
+	size_t _tail = 0;
+	size_t _wrap = 0;
+	bool _wrapped = false;
+	size_t _count = 0;
+	uint64_t _oversized = 0;
+};
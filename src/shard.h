@@ -0,0 +1,227 @@
+#pragma once
+#include "packet.h"
+#include "packet_sink.h"
+#include "pcapng.h"
+
+#include <array>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Replaces `%<spec>` in the file name with `value`; `%%` stands for a single `%`.
+inline std::filesystem::path expand_path_pattern(std::filesystem::path const & pattern, char spec, uint64_t value)
+{
+	using string_type = std::filesystem::path::string_type;
+	string_type const & src = pattern.native();
+	string_type const value_str = std::filesystem::path(std::to_string(value)).native();
+
+	string_type r;
+	for (size_t i = 0; i != src.size(); ++i)
+	{
+		if (src[i] == '%' && i + 1 != src.size())
+		{
+			if (src[i + 1] == spec)
+			{
+				r.append(value_str);
+				++i;
+				continue;
+			}
+
+			if (src[i + 1] == '%')
+			{
+				r.push_back('%');
+				++i;
+				continue;
+			}
+		}
+
+		r.push_back(src[i]);
+	}
+
+	return r;
+}
+
+inline bool has_path_pattern(std::filesystem::path const & pattern, char spec)
+{
+	return expand_path_pattern(pattern, spec, 0) != expand_path_pattern(pattern, spec, 1);
+}
+
+// Writes each interface into its own file, named by substituting
+// the OS interface index for `%i` in the pattern.
+//
+// Every file has its own writer with its own buffers and a background
+// I/O thread, so the files can be written to in parallel, possibly
+// to different disks.
+struct per_interface_writer final
+	: packet_sink
+{
+	explicit per_interface_writer(std::filesystem::path pattern, size_t write_behind_depth = 4)
+		: _pattern(std::move(pattern)), _write_behind_depth(write_behind_depth)
+	{
+	}
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		auto w = std::make_unique<pcapng_writer>(expand_path_pattern(_pattern, 'i', intf.index),
+			pcapng_writer::default_buffer_size, _write_behind_depth);
+		w->add_interface(intf);
+
+		_writers.push_back(std::move(w));
+		return (uint32_t)(_writers.size() - 1);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) override
+	{
+		_writers[ifidx]->add_packet(0, timestamp, payload, full_length, flags);
+	}
+
+	void flush() override
+	{
+		for (auto & w: _writers)
+			w->flush();
+	}
+
+	void tick() override
+	{
+		for (auto & w: _writers)
+			w->tick();
+	}
+
+private:
+	std::filesystem::path _pattern;
+	size_t _write_behind_depth;
+	std::vector<std::unique_ptr<pcapng_writer>> _writers;
+};
+
+// The Toeplitz hash used by RSS over the addresses and ports of a packet.
+//
+// The key is 0x6d5a repeated, which makes the hash symmetric: swapping
+// the source and destination, which moves the fields by an even number
+// of bytes, doesn't change the result, so both directions of a flow hash
+// alike. The key also repeats every two bytes, so the contribution
+// of an input byte only depends on its value and the parity of its
+// position, which makes for two 256-entry tables.
+//
+// Fragments are hashed by their addresses only, since only the first
+// fragment carries the ports. Packets other than IP hash to zero.
+struct symmetric_flow_hash
+{
+	uint32_t operator()(decoded_packet const & pkt) const noexcept
+	{
+		size_t addr_len = pkt.ip_addr_size();
+		if (addr_len == 0)
+			return 0;
+
+		uint32_t h = 0;
+		size_t pos = 0;
+		auto feed = [&](uint8_t const * p, size_t len) {
+			for (size_t i = 0; i != len; ++i)
+				h ^= _table[pos++ & 1][p[i]];
+		};
+
+		feed(pkt.src_ip.data(), addr_len);
+		feed(pkt.dst_ip.data(), addr_len);
+		if (!pkt.ip_fragment && pkt.l4_offset != decoded_packet::npos
+			&& (pkt.ip_proto == ip_proto_tcp || pkt.ip_proto == ip_proto_udp))
+		{
+			uint8_t const ports[4] = {
+				(uint8_t)(pkt.src_port >> 8), (uint8_t)pkt.src_port,
+				(uint8_t)(pkt.dst_port >> 8), (uint8_t)pkt.dst_port,
+			};
+			feed(ports, sizeof ports);
+		}
+
+		return h;
+	}
+
+	// The symmetric key has little entropy; the bits of the hash should be
+	// mixed before it is reduced to a smaller range.
+	static uint32_t mix(uint32_t h) noexcept
+	{
+		h ^= h >> 16;
+		h *= 0x85ebca6bu;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35u;
+		h ^= h >> 16;
+		return h;
+	}
+
+private:
+	static constexpr std::array<std::array<uint32_t, 256>, 2> _table = [] {
+		std::array<std::array<uint32_t, 256>, 2> r = {};
+		for (size_t parity = 0; parity != 2; ++parity)
+		{
+			for (size_t b = 0; b != 256; ++b)
+			{
+				// Each set input bit contributes the 32 key bits starting at its position.
+				uint32_t v = 0;
+				for (size_t bit = 0; bit != 8; ++bit)
+				{
+					if (b & (0x80 >> bit))
+					{
+						unsigned shift = (unsigned)((parity * 8 + bit) % 16);
+						v ^= shift == 0? 0x6d5a6d5au: (0x6d5a6d5au << shift) | (0x6d5a6d5au >> (32 - shift));
+					}
+				}
+
+				r[parity][b] = v;
+			}
+		}
+
+		return r;
+	}();
+};
+
+// Spreads the packets over `count` files by their symmetric flow hash,
+// so that all packets of a flow, in both directions, end up in the same
+// file. The files are named by substituting the file number for `%h`
+// in the pattern. Every file has its own writer and background I/O thread,
+// and gets all the interfaces.
+struct flow_hash_writer final
+	: packet_sink
+{
+	flow_hash_writer(std::filesystem::path const & pattern, size_t count, size_t write_behind_depth = 4)
+	{
+		for (size_t i = 0; i != count; ++i)
+		{
+			_writers.push_back(std::make_unique<pcapng_writer>(expand_path_pattern(pattern, 'h', i),
+				pcapng_writer::default_buffer_size, write_behind_depth));
+		}
+	}
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		uint32_t r = 0;
+		for (auto & w: _writers)
+			r = w->add_interface(intf);
+
+		_if_types.push_back(intf.link_type);
+		return r;
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) override
+	{
+		decode_packet(_if_types[ifidx], payload, _pkt);
+		uint32_t h = symmetric_flow_hash::mix(_hash(_pkt));
+		_writers[((uint64_t)h * _writers.size()) >> 32]->add_packet(ifidx, timestamp, payload, full_length, flags);
+	}
+
+	void flush() override
+	{
+		for (auto & w: _writers)
+			w->flush();
+	}
+
+	void tick() override
+	{
+		for (auto & w: _writers)
+			w->tick();
+	}
+
+private:
+	std::vector<std::unique_ptr<pcapng_writer>> _writers;
+	std::vector<uint16_t> _if_types;
+	symmetric_flow_hash _hash;
+	decoded_packet _pkt;
+};
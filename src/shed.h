@@ -0,0 +1,280 @@
+#pragma once
+#include "packet.h"
+#include "packet_sink.h"
+#include "pcapng.h"
+#include "shard.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The ways of reducing the load on a writer that falls behind.
+enum class shed_step
+{
+	// Truncate the packets to their headers.
+	headers,
+
+	// Only keep the packets of a sample of the flows.
+	sample,
+
+	// Drop all packets.
+	drop,
+};
+
+// Parses a comma-separated list of `headers`, `sample` and `drop`.
+inline std::vector<shed_step> parse_shed_steps(std::string_view list)
+{
+	std::vector<shed_step> r;
+	while (!list.empty())
+	{
+		size_t comma = list.find(',');
+		std::string_view name = list.substr(0, comma);
+		list = comma == std::string_view::npos? std::string_view{}: list.substr(comma + 1);
+
+		if (name == "headers")
+			r.push_back(shed_step::headers);
+		else if (name == "sample")
+			r.push_back(shed_step::sample);
+		else if (name == "drop")
+			r.push_back(shed_step::drop);
+		else
+			throw std::runtime_error("invalid shedding step, expected headers, sample or drop");
+	}
+
+	return r;
+}
+
+// Sheds load in front of a writer that can't keep up, so that it's
+// the policy that decides what is lost rather than the ETW buffers.
+//
+// Every `interval` microseconds of capture time, the writer's pressure is
+// checked. If the capture thread spent more than a tenth of the interval
+// waiting for the output, or the write-behind queue is full, the next step
+// is enabled, in the configured order. Once the queue stayed empty and
+// the waits stayed under a hundredth for ten intervals, the last step
+// is disabled again.
+// The flow sample is halved under pressure and doubled when the pressure
+// is gone, so it settles on what the output can take before moving on
+// to the next step.
+//
+// With a loss target below one, the sample moves by quarters instead, and
+// a calm interval in which more than that fraction of the packets was shed
+// backs off right away rather than after ten. The shedding then hovers at
+// the least the output can take, or under the target if the output can
+// take that; `--benchmark-shed` shows it against a slow output.
+//
+// Each change is recorded in the capture as an interface statistics block
+// with a comment, counting the packets dropped by the shedding.
+struct load_shedder final
+	: packet_sink
+{
+	static constexpr uint64_t default_interval = 100'000;
+
+	load_shedder(std::shared_ptr<pcapng_writer> writer, std::vector<shed_step> steps, double loss_target = 1,
+		uint64_t interval = default_interval)
+		: _writer(std::move(writer)), _steps(std::move(steps)), _loss_target(loss_target),
+		_interval(interval ? interval : default_interval)
+	{
+	}
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		_if_types.push_back(intf.link_type);
+		_stats.push_back({});
+		return _writer->add_interface(intf);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) override
+	{
+		++_stats[ifidx].received;
+		++_interval_received;
+		if (timestamp >= _next_check)
+			this->_check(timestamp);
+
+		if (_level != 0)
+		{
+			decode_packet(_if_types[ifidx], payload, _pkt);
+			for (size_t i = 0; i != _level; ++i)
+			{
+				switch (_steps[i])
+				{
+				case shed_step::headers:
+					payload = payload.first(_pkt.header_length());
+					break;
+
+				case shed_step::sample:
+					if ((symmetric_flow_hash::mix(_hash(_pkt)) >> 16) >= _sample)
+					{
+						++_stats[ifidx].dropped;
+						++_interval_shed;
+						return;
+					}
+					break;
+
+				case shed_step::drop:
+					++_stats[ifidx].dropped;
+					++_interval_shed;
+					return;
+				}
+			}
+		}
+
+		_writer->add_packet(ifidx, timestamp, payload, full_length, flags);
+	}
+
+	void flush() override
+	{
+		_writer->flush();
+	}
+
+	void tick() override
+	{
+		_writer->tick();
+	}
+
+	// The number of enabled steps.
+	size_t level() const noexcept
+	{
+		return _level;
+	}
+
+	// The fraction of the flows kept by the `sample` step, if enabled.
+	double sample() const noexcept
+	{
+		return (double)_sample / _full_sample;
+	}
+
+	// The counters of each interface, as recorded in the capture.
+	std::span<interface_statistics const> statistics() const noexcept
+	{
+		return _stats;
+	}
+
+private:
+	// The flow sample is kept as the number of 16-bit hash values that pass.
+	static constexpr uint32_t _full_sample = 0x10000;
+	static constexpr uint32_t _min_sample = _full_sample / 64;
+
+	// The number of calm intervals before backing off a step.
+	static constexpr size_t _calm_intervals = 10;
+
+	bool _steered() const noexcept
+	{
+		return _loss_target < 1;
+	}
+
+	void _check(uint64_t timestamp)
+	{
+		writer_pressure p = _writer->pressure();
+		uint64_t stalled = p.stall_us - _last_stall_us;
+		_last_stall_us = p.stall_us;
+		_next_check = timestamp + _interval;
+
+		bool high = stalled * 10 > _interval || (p.depth != 0 && p.queued == p.depth);
+		// The buffer being written out counts as queued.
+		bool low = stalled * 100 < _interval && p.queued <= 1;
+		_calm = low? _calm + 1: 0;
+
+		bool over_target = (double)_interval_shed > _loss_target * (double)_interval_received;
+		_interval_received = 0;
+		_interval_shed = 0;
+
+		bool sampling = _level != 0 && _steps[_level - 1] == shed_step::sample;
+		if (high)
+		{
+			if (sampling && _sample > _min_sample)
+			{
+				_sample = (std::max)(this->_steered()? _sample - _sample / 4: _sample / 2, _min_sample);
+			}
+			else if (_level != _steps.size())
+			{
+				if (_steps[_level++] == shed_step::sample)
+					_sample = this->_steered()? _full_sample - _full_sample / 4: _full_sample / 2;
+			}
+			else
+			{
+				return;
+			}
+		}
+		else if (over_target && low && _level != 0)
+		{
+			_calm = 0;
+			if (sampling && _sample < _full_sample)
+				_sample = (std::min)(_sample + _sample / 4, _full_sample);
+			else
+				--_level;
+		}
+		else if (_calm >= _calm_intervals && _level != 0)
+		{
+			_calm = 0;
+			if (sampling && _sample < _full_sample / 2)
+				_sample = (std::min)(_sample * 2, _full_sample / 2);
+			else
+				--_level;
+		}
+		else
+		{
+			return;
+		}
+
+		this->_record(timestamp);
+	}
+
+	void _record(uint64_t timestamp)
+	{
+		std::string comment = "load shedding:";
+		if (_level == 0)
+			comment += " off";
+
+		for (size_t i = 0; i != _level; ++i)
+		{
+			switch (_steps[i])
+			{
+			case shed_step::headers:
+				comment += " headers only";
+				break;
+			case shed_step::sample:
+			{
+				char pct[16];
+				snprintf(pct, sizeof pct, "%.1f%%", 100.0 * _sample / _full_sample);
+				comment += " sampling ";
+				comment += pct;
+				comment += " of flows";
+				break;
+			}
+			case shed_step::drop:
+				comment += " dropping all packets";
+				break;
+			}
+
+			if (i + 1 != _level)
+				comment += ",";
+		}
+
+		for (size_t i = 0; i != _stats.size(); ++i)
+			_writer->add_statistics((uint32_t)i, timestamp, _stats[i], comment);
+	}
+
+	std::shared_ptr<pcapng_writer> _writer;
+	std::vector<shed_step> _steps;
+	double _loss_target;
+	uint64_t _interval;
+
+	size_t _level = 0;
+	uint32_t _sample = _full_sample;
+	uint64_t _next_check = 0;
+	uint64_t _last_stall_us = 0;
+	size_t _calm = 0;
+	uint64_t _interval_received = 0;
+	uint64_t _interval_shed = 0;
+
+	std::vector<uint16_t> _if_types;
+	std::vector<interface_statistics> _stats;
+	symmetric_flow_hash _hash;
+	decoded_packet _pkt;
+};
@@ -3,7 +3,16 @@
 #include <system_error>
 #include <utility>
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <signal.h>
+#include <thread>
+#include <unistd.h>
+#endif
 
 struct sigint_handler
 {
@@ -18,13 +27,7 @@ struct sigint_handler
 		_cb_iter = std::prev(_cbs.end());
 
 		if (need_handlers)
-		{
-			if (!SetConsoleCtrlHandler(&console_ctrl_handler, TRUE))
-			{
-				DWORD err = GetLastError();
-				throw std::system_error(err, std::system_category());
-			}
-		}
+			_install();
 	}
 
 	~sigint_handler()
@@ -37,20 +40,87 @@ struct sigint_handler
 	sigint_handler & operator=(sigint_handler const &) = delete;
 
 private:
+#ifdef _WIN32
 	static BOOL WINAPI console_ctrl_handler(DWORD dwCtrlType)
 	{
 		if (dwCtrlType != CTRL_C_EVENT)
 			return FALSE;
 
+		return _fire();
+	}
+
+	static void _install()
+	{
+		if (!SetConsoleCtrlHandler(&console_ctrl_handler, TRUE))
+		{
+			DWORD err = GetLastError();
+			throw std::system_error(err, std::system_category());
+		}
+	}
+
+	static void _uninstall() noexcept
+	{
+		SetConsoleCtrlHandler(&console_ctrl_handler, FALSE);
+	}
+#else
+	// A signal handler can't take locks, so SIGINT and SIGTERM are passed
+	// through a pipe to a thread that runs the callbacks.
+	static void _signal_handler(int)
+	{
+		int saved_errno = errno;
+		char ch = 0;
+		(void)!::write(_pipe[1], &ch, 1);
+		errno = saved_errno;
+	}
+
+	static void _install()
+	{
+		if (_pipe[0] < 0)
+		{
+			if (pipe2(_pipe, O_CLOEXEC) != 0)
+				throw std::system_error(errno, std::system_category());
+
+			std::thread([] {
+				for (;;)
+				{
+					char ch;
+					ssize_t r = ::read(_pipe[0], &ch, 1);
+					if (r == 1)
+						_fire();
+					else if (r == 0 || errno != EINTR)
+						return;
+				}
+			}).detach();
+		}
+
+		struct sigaction sa = {};
+		sa.sa_handler = &_signal_handler;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		if (sigaction(SIGINT, &sa, nullptr) != 0 || sigaction(SIGTERM, &sa, nullptr) != 0)
+			throw std::system_error(errno, std::system_category());
+	}
+
+	static void _uninstall() noexcept
+	{
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+	}
+
+	inline static int _pipe[2] = { -1, -1 };
+#endif
+
+	static bool _fire()
+	{
 		_lock_t lock;
 		if (_cbs.empty())
-			return FALSE;
+			return false;
 
 		sigint_handler * h = _cbs.front();
 
 		h->_disarm_locked();
 		h->_cb();
-		return TRUE;
+		return true;
 	}
 
 	void _disarm_locked()
@@ -62,7 +132,7 @@ private:
 		}
 
 		if (_cbs.empty())
-			SetConsoleCtrlHandler(&console_ctrl_handler, FALSE);
+			_uninstall();
 	}
 
 	std::function<void()> _cb;
@@ -70,6 +140,7 @@ private:
 	bool _is_armed;
 	std::list<sigint_handler *>::iterator _cb_iter;
 
+#ifdef _WIN32
 	struct _lock_t
 	{
 		_lock_t()
@@ -84,6 +155,22 @@ private:
 	};
 
 	inline static SRWLOCK _cbs_mutex = {};
+#else
+	struct _lock_t
+	{
+		_lock_t()
+		{
+			_cbs_mutex.lock();
+		}
+
+		~_lock_t()
+		{
+			_cbs_mutex.unlock();
+		}
+	};
+
+	inline static std::mutex _cbs_mutex;
+#endif
 	inline static std::list<sigint_handler *> _cbs = {};
 };
 
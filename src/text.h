@@ -0,0 +1,456 @@
+#pragma once
+#include "output.h"
+#include "packet.h"
+#include "packet_sink.h"
+
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Prints a tcpdump-style summary line for each packet.
+//
+// The lines are formatted with `std::to_chars` into a large buffer,
+// which is handed over to a background thread for writing once full or
+// on the next tick, so printing never blocks the capture on the console
+// or the disk, and lines show up within a tick.
+struct text_printer final
+	: packet_sink
+{
+	static constexpr size_t buffer_size = 1 << 20;
+
+	// With `link_header`, the Ethernet header is printed too (tcpdump -e).
+	// With `quiet`, less protocol information is printed (tcpdump -q).
+	text_printer(std::shared_ptr<byte_output> out, bool link_header, bool quiet)
+		: _io(std::move(out)), _buf(buffer_size), _link_header(link_header), _quiet(quiet)
+	{
+	}
+
+	~text_printer()
+	{
+		try
+		{
+			this->flush();
+		}
+		catch (...)
+		{
+		}
+	}
+
+	text_printer(text_printer const &) = delete;
+	text_printer & operator=(text_printer const &) = delete;
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		_if_types.push_back(intf.link_type);
+		return (uint32_t)(_if_types.size() - 1);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t /*flags*/) override
+	{
+		if (_buf.size() - _size < _max_line)
+			this->_flush_buffer();
+
+		decoded_packet pkt;
+		decode_packet(_if_types[ifidx], payload, pkt);
+
+		this->_time(timestamp);
+		if (_link_header && pkt.l2_offset != decoded_packet::npos)
+			this->_ether(pkt, full_length);
+
+		this->_summary(pkt, full_length);
+		this->_put('\n');
+	}
+
+	void flush() override
+	{
+		this->_flush_buffer();
+		_io.wait();
+	}
+
+	// Shows what was printed since the last tick, so that a quiet
+	// capture doesn't keep its last lines in the buffer.
+	void tick() override
+	{
+		this->_flush_buffer();
+	}
+
+private:
+	// Long enough for an -e line with two IPv6 addresses.
+	static constexpr size_t _max_line = 512;
+
+	void _flush_buffer()
+	{
+		if (_size == 0)
+			return;
+
+		_buf = _io.submit(std::move(_buf), _size);
+		if (_buf.size() < buffer_size)
+			_buf.resize(buffer_size);
+		_size = 0;
+	}
+
+	void _put(char ch) noexcept
+	{
+		_buf[_size++] = (std::byte)ch;
+	}
+
+	void _put(std::string_view s) noexcept
+	{
+		memcpy(_buf.data() + _size, s.data(), s.size());
+		_size += s.size();
+	}
+
+	void _num(uint64_t v) noexcept
+	{
+		char * p = (char *)_buf.data() + _size;
+		_size = std::to_chars(p, p + 20, v).ptr - (char *)_buf.data();
+	}
+
+	void _num_padded(uint64_t v, size_t width) noexcept
+	{
+		char * p = (char *)_buf.data() + _size + width;
+		for (size_t i = 0; i != width; ++i)
+		{
+			*--p = (char)('0' + v % 10);
+			v /= 10;
+		}
+		_size += width;
+	}
+
+	void _hex(uint8_t v) noexcept
+	{
+		static constexpr char digits[] = "0123456789abcdef";
+		_put(digits[v >> 4]);
+		_put(digits[v & 0xf]);
+	}
+
+	void _hex16(uint16_t v) noexcept
+	{
+		char * p = (char *)_buf.data() + _size;
+		_size = std::to_chars(p, p + 4, v, 16).ptr - (char *)_buf.data();
+	}
+
+	// Prints the local time of day, recomputing the UTC offset hourly.
+	void _time(uint64_t timestamp) noexcept
+	{
+		uint64_t seconds = timestamp / 1'000'000;
+		if (seconds / 3600 != _offset_hour)
+		{
+			_offset_hour = seconds / 3600;
+
+			time_t t = (time_t)seconds;
+			tm local;
+#ifdef _WIN32
+			localtime_s(&local, &t);
+#else
+			localtime_r(&t, &local);
+#endif
+			int64_t local_sod = local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+			_utc_offset = (local_sod - (int64_t)(seconds % 86400) + 86400) % 86400;
+		}
+
+		uint64_t sod = (seconds + _utc_offset) % 86400;
+		_num_padded(sod / 3600, 2);
+		_put(':');
+		_num_padded(sod / 60 % 60, 2);
+		_put(':');
+		_num_padded(sod % 60, 2);
+		_put('.');
+		_num_padded(timestamp % 1'000'000, 6);
+		_put(' ');
+	}
+
+	void _mac(std::array<uint8_t, 6> const & mac) noexcept
+	{
+		for (size_t i = 0; i != 6; ++i)
+		{
+			if (i != 0)
+				_put(':');
+			_hex(mac[i]);
+		}
+	}
+
+	void _ethertype_name(uint16_t ethertype) noexcept
+	{
+		switch (ethertype)
+		{
+		case ethertype_ipv4:
+			_put("IPv4");
+			break;
+		case ethertype_ipv6:
+			_put("IPv6");
+			break;
+		case ethertype_arp:
+			_put("ARP");
+			break;
+		default:
+			_put("Unknown");
+			break;
+		}
+
+		_put(" (0x");
+		_hex((uint8_t)(ethertype >> 8));
+		_hex((uint8_t)ethertype);
+		_put(')');
+	}
+
+	void _ether(decoded_packet const & pkt, size_t full_length) noexcept
+	{
+		_mac(pkt.src_mac);
+		_put(" > ");
+		_mac(pkt.dst_mac);
+		_put(", ");
+		if (pkt.has_vlan)
+		{
+			_put("ethertype 802.1Q (0x8100), length ");
+			_num(full_length);
+			_put(": vlan ");
+			_num(pkt.vlan_id);
+			_put(", ");
+		}
+
+		_put("ethertype ");
+		_ethertype_name(pkt.ethertype);
+		_put(", length ");
+		_num(full_length);
+		_put(": ");
+	}
+
+	void _ip(decoded_packet const & pkt, std::array<uint8_t, 16> const & addr) noexcept
+	{
+		if (pkt.ip_version == 4)
+		{
+			for (size_t i = 0; i != 4; ++i)
+			{
+				if (i != 0)
+					_put('.');
+				_num(addr[i]);
+			}
+
+			return;
+		}
+
+		uint16_t groups[8];
+		for (size_t i = 0; i != 8; ++i)
+			groups[i] = (uint16_t)((addr[i * 2] << 8) | addr[i * 2 + 1]);
+
+		// Compress the longest run of at least two zero groups.
+		size_t best = 8, best_len = 1;
+		for (size_t i = 0; i != 8;)
+		{
+			if (groups[i] != 0)
+			{
+				++i;
+				continue;
+			}
+
+			size_t j = i;
+			while (j != 8 && groups[j] == 0)
+				++j;
+			if (j - i > best_len)
+			{
+				best = i;
+				best_len = j - i;
+			}
+			i = j;
+		}
+
+		for (size_t i = 0; i != 8; ++i)
+		{
+			if (i == best)
+			{
+				_put("::");
+				i += best_len - 1;
+				continue;
+			}
+
+			if (i != 0 && i != best + best_len)
+				_put(':');
+			_hex16(groups[i]);
+		}
+	}
+
+	void _endpoint(decoded_packet const & pkt, std::array<uint8_t, 16> const & addr, uint16_t port) noexcept
+	{
+		_ip(pkt, addr);
+		_put('.');
+		_num(port);
+	}
+
+	// The length of the IP payload past `offset` according to the IP header,
+	// so that it is right for truncated packets too.
+	static size_t _ip_length_from(decoded_packet const & pkt, size_t offset) noexcept
+	{
+		if (offset == decoded_packet::npos)
+			return 0;
+
+		std::byte const * ip = pkt.data.data() + pkt.l3_offset;
+		size_t ip_end = pkt.ip_version == 4
+			? pkt.l3_offset + load_be16(ip + 2)
+			: pkt.l3_offset + 40 + load_be16(ip + 4);
+		return ip_end > offset? ip_end - offset: 0;
+	}
+
+	void _tcp_flags(uint8_t flags) noexcept
+	{
+		_put('[');
+		if (flags & tcp_fin)
+			_put('F');
+		if (flags & tcp_syn)
+			_put('S');
+		if (flags & tcp_rst)
+			_put('R');
+		if (flags & tcp_push)
+			_put('P');
+		if (flags & tcp_urg)
+			_put('U');
+		if (flags & tcp_ece)
+			_put('E');
+		if (flags & tcp_cwr)
+			_put('W');
+		if (flags & tcp_ack)
+			_put('.');
+		if (flags == 0)
+			_put("none");
+		_put(']');
+	}
+
+	void _summary(decoded_packet const & pkt, size_t full_length) noexcept
+	{
+		if (pkt.l3_offset == decoded_packet::npos)
+		{
+			_put("unknown link type, length ");
+			_num(full_length);
+			return;
+		}
+
+		if (pkt.ip_version == 0)
+		{
+			if (pkt.ethertype == ethertype_arp)
+			{
+				_put("ARP, length ");
+			}
+			else
+			{
+				_put("ethertype ");
+				_ethertype_name(pkt.ethertype);
+				_put(", length ");
+			}
+
+			_num(full_length);
+			return;
+		}
+
+		_put(pkt.ip_version == 4? "IP ": "IP6 ");
+
+		bool has_ports = pkt.l4_offset != decoded_packet::npos
+			&& (pkt.ip_proto == ip_proto_tcp || pkt.ip_proto == ip_proto_udp);
+		if (has_ports)
+		{
+			_endpoint(pkt, pkt.src_ip, pkt.src_port);
+			_put(" > ");
+			_endpoint(pkt, pkt.dst_ip, pkt.dst_port);
+		}
+		else
+		{
+			_ip(pkt, pkt.src_ip);
+			_put(" > ");
+			_ip(pkt, pkt.dst_ip);
+		}
+
+		_put(": ");
+
+		if (pkt.l4_offset == decoded_packet::npos)
+		{
+			_put(pkt.ip_fragment? "ip-fragment": "truncated-ip");
+			_put(", length ");
+			_num(full_length);
+			return;
+		}
+
+		size_t length = _ip_length_from(pkt, pkt.payload_offset);
+		switch (pkt.ip_proto)
+		{
+		case ip_proto_tcp:
+			if (_quiet)
+			{
+				_put("tcp ");
+				_num(length);
+				return;
+			}
+
+			_put("Flags ");
+			_tcp_flags(pkt.tcp_flags);
+			_put(", seq ");
+			_num(pkt.tcp_seq);
+			if (pkt.tcp_flags & tcp_ack)
+			{
+				_put(", ack ");
+				_num(pkt.tcp_ack);
+			}
+			_put(", win ");
+			_num(pkt.tcp_window);
+			_put(", length ");
+			_num(length);
+			return;
+
+		case ip_proto_udp:
+			_put(_quiet? "udp ": "UDP, length ");
+			_num(length);
+			return;
+
+		case ip_proto_icmp:
+		case ip_proto_icmpv6:
+		{
+			bool v6 = pkt.ip_proto == ip_proto_icmpv6;
+			_put(v6? "ICMP6": "ICMP");
+			if (!_quiet)
+			{
+				uint8_t echo_request = v6? 128: 8;
+				uint8_t echo_reply = v6? 129: 0;
+				if (pkt.icmp_type == echo_request)
+				{
+					_put(" echo request");
+				}
+				else if (pkt.icmp_type == echo_reply)
+				{
+					_put(" echo reply");
+				}
+				else
+				{
+					_put(" type ");
+					_num(pkt.icmp_type);
+					_put(" code ");
+					_num(pkt.icmp_code);
+				}
+			}
+
+			_put(", length ");
+			_num(_ip_length_from(pkt, pkt.l4_offset));
+			return;
+		}
+
+		default:
+			_put("ip-proto-");
+			_num(pkt.ip_proto);
+			_put(' ');
+			_num(full_length);
+			return;
+		}
+	}
+
+	write_behind _io;
+	std::vector<std::byte> _buf;
+	size_t _size = 0;
+
+	bool _link_header;
+	bool _quiet;
+	std::vector<uint16_t> _if_types;
+
+	uint64_t _offset_hour = ~(uint64_t)0;
+	int64_t _utc_offset = 0;
+};
@@ -1,21 +1,56 @@
+#pragma once
 #include <string>
 #include <string_view>
 #include <system_error>
 
+#ifdef _WIN32
 #include <windows.h>
 
-std::string to_utf8(std::wstring_view s)
+// The conversions fail with zero, which is also what an empty string
+// would return, so that is handled first.
+inline std::string to_utf8(std::wstring_view s)
 {
+	if (s.empty())
+		return {};
+
 	int r = WideCharToMultiByte(CP_UTF8, 0, s.data(), (int)s.size(), nullptr, 0, nullptr, nullptr);
-	if (r < 0)
+	if (r == 0)
 		throw std::system_error(GetLastError(), std::system_category());
 	std::string ss;
 	ss.resize(r + 1);
 	r = WideCharToMultiByte(CP_UTF8, 0, s.data(), (int)s.size(), ss.data(), (int)ss.size(), nullptr, nullptr);
-	if (r < 0)
+	if (r == 0)
 		throw std::system_error(GetLastError(), std::system_category());
 	ss.resize(r);
 	return ss;
 }
 
-#pragma once
+
+inline std::wstring from_utf8(std::string_view s)
+{
+	if (s.empty())
+		return {};
+
+	int r = MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), nullptr, 0);
+	if (r == 0)
+		throw std::system_error(GetLastError(), std::system_category());
+	std::wstring ss;
+	ss.resize(r + 1);
+	r = MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), ss.data(), (int)ss.size());
+	if (r == 0)
+		throw std::system_error(GetLastError(), std::system_category());
+	ss.resize(r);
+	return ss;
+}
+#else
+// Elsewhere, strings and paths are already in UTF-8.
+inline std::string to_utf8(std::string_view s)
+{
+	return std::string(s);
+}
+
+inline std::string from_utf8(std::string_view s)
+{
+	return std::string(s);
+}
+#endif
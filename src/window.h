@@ -0,0 +1,112 @@
+#pragma once
+#include "filter.h"
+#include "packet_sink.h"
+#include "pcapng.h"
+#include "ring.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// Only lets through the packets in windows around trigger packets.
+//
+// Packets are held in a bounded pre-roll ring until a packet matches
+// the start filter. The window then opens with the last `pre_roll`
+// microseconds of packets and stays open until `post_roll` microseconds
+// after the last matching packet, so overlapping windows merge. A packet
+// matching the stop filter closes the window early.
+struct trigger_window final
+	: packet_sink
+{
+	trigger_window(std::shared_ptr<pcapng_writer> writer, packet_filter start, packet_filter stop,
+		uint64_t pre_roll, uint64_t post_roll, size_t pre_roll_capacity)
+		: _writer(std::move(writer)), _start(std::move(start)), _stop(std::move(stop)),
+		_pre_roll(pre_roll), _post_roll(post_roll), _ring(pre_roll_capacity, pre_roll)
+	{
+	}
+
+	uint32_t add_interface(capture_interface const & intf) override
+	{
+		_link_types.push_back(intf.link_type);
+		return _writer->add_interface(intf);
+	}
+
+	void add_packet(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload, size_t full_length, uint32_t flags) override
+	{
+		decoded_packet pkt;
+		decode_packet(_link_types[ifidx], payload, pkt);
+
+		bool is_open = _open && timestamp <= _window_end;
+		if (_start.match(pkt, full_length))
+		{
+			if (is_open)
+			{
+				_window_end = (std::max)(_window_end, timestamp + _post_roll);
+			}
+			else
+			{
+				this->_flush_pre_roll(timestamp);
+				_window_end = timestamp + _post_roll;
+				_open = true;
+				is_open = true;
+				++_windows;
+			}
+		}
+		else if (is_open && !_stop.empty() && _stop.match(pkt, full_length))
+		{
+			_writer->add_packet(ifidx, timestamp, payload, full_length, flags);
+			_open = false;
+			return;
+		}
+
+		if (is_open)
+		{
+			_writer->add_packet(ifidx, timestamp, payload, full_length, flags);
+		}
+		else
+		{
+			_open = false;
+			_ring.push(ifidx, timestamp, payload, full_length, flags);
+		}
+	}
+
+	void flush() override
+	{
+		_writer->flush();
+	}
+
+	void tick() override
+	{
+		_writer->tick();
+	}
+
+	uint64_t window_count() const noexcept
+	{
+		return _windows;
+	}
+
+private:
+	void _flush_pre_roll(uint64_t timestamp)
+	{
+		if (timestamp > _pre_roll)
+			_ring.evict_before(timestamp - _pre_roll);
+
+		_ring.for_each([&](std::span<std::byte const> block, uint64_t) {
+			_writer->add_block(block);
+		});
+		_ring.clear();
+	}
+
+	std::shared_ptr<pcapng_writer> _writer;
+	packet_filter _start;
+	packet_filter _stop;
+	uint64_t _pre_roll;
+	uint64_t _post_roll;
+
+	packet_ring _ring;
+	std::vector<uint16_t> _link_types;
+
+	bool _open = false;
+	uint64_t _window_end = 0;
+	uint64_t _windows = 0;
+};
@@ -0,0 +1,181 @@
+#include "fanout.h"
+#include "filter.h"
+#include "packets.h"
+#include "pcapng.h"
+#include "pipeline.h"
+#include "test.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// The per-packet path must not allocate, so every allocation of the
+// process is counted while `_counting` is set, on any thread.
+static std::atomic<bool> _counting = false;
+static std::atomic<size_t> _allocations = 0;
+
+void * operator new(size_t size)
+{
+	if (_counting.load(std::memory_order_relaxed))
+		_allocations.fetch_add(1, std::memory_order_relaxed);
+
+	if (void * p = malloc(size? size: 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+	free(p);
+}
+
+namespace {
+
+struct _alloc_counter
+{
+	_alloc_counter()
+	{
+		_allocations.store(0);
+		_counting.store(true);
+	}
+
+	~_alloc_counter()
+	{
+		_counting.store(false);
+	}
+
+	size_t count() const noexcept
+	{
+		return _allocations.load();
+	}
+};
+
+// Frames of a few sizes, one of them at the snaplen, some with flags.
+struct _traffic
+{
+	static constexpr size_t snaplen = 1514;
+
+	_traffic()
+	{
+		for (size_t size: { (size_t)0, (size_t)100, snaplen - 42 })
+		{
+			test_packet p;
+			p.payload.resize(size, std::byte{ 0x55 });
+			p.src_port = (uint16_t)(50000 + frames.size());
+			frames.push_back(p.frame());
+
+			p.proto = ip_proto_tcp;
+			p.payload.resize(size > 12? size - 12: size);
+			frames.push_back(p.frame());
+		}
+	}
+
+	void send(packet_sink & sink, uint32_t ifidx, size_t count)
+	{
+		for (size_t i = 0; i != count; ++i)
+		{
+			auto const & f = frames[i % frames.size()];
+			sink.add_packet(ifidx, ++timestamp, std::span(f).first((std::min)(f.size(), snaplen)), f.size(), (uint32_t)(i % 3));
+			if (i % 1000 == 0)
+				sink.tick();
+		}
+	}
+
+	capture_interface intf() const
+	{
+		return { .index = 1, .link_type = if_type_ethernet, .name = "eth0", .desc = {}, .snaplen = snaplen };
+	}
+
+	std::vector<std::vector<std::byte>> frames;
+	uint64_t timestamp = 0;
+};
+
+}
+
+TEST(alloc, counter)
+{
+	_alloc_counter c;
+	auto v = std::make_unique<std::vector<int>>(10);
+	CHECK(c.count() >= 2);
+}
+
+TEST(alloc, writer)
+{
+	// Once the interface is added, not even the first packets may allocate.
+	// Also with a buffer that only just fits a packet at the snaplen.
+	for (auto [buffer_size, depth]: { std::pair<size_t, size_t>{ 64 << 10, 0 }, { 64 << 10, 4 },
+		{ pcapng_writer::packet_block_size(_traffic::snaplen), 0 } })
+	{
+		auto out = std::make_shared<null_output>();
+		auto w = std::make_shared<pcapng_writer>(out, buffer_size, depth);
+		_traffic t;
+		uint32_t ifidx = w->add_interface(t.intf());
+
+		size_t allocations;
+		{
+			_alloc_counter c;
+			t.send(*w, ifidx, 100000);
+			allocations = c.count();
+		}
+
+		CHECK(allocations == 0);
+		w->flush();
+		CHECK(out->size() > 100000 * 28);
+	}
+}
+
+TEST(alloc, pipeline)
+{
+	for (size_t depth: { 0, 4 })
+	{
+		auto out = std::make_shared<null_output>();
+		auto w = std::make_shared<pcapng_writer>(out, pcapng_writer::default_buffer_size, depth);
+		packet_pipeline p(w, 3, packet_filter::compile("udp or tcp port 80"));
+		_traffic t;
+		uint32_t ifidx = p.add_interface(t.intf());
+		t.send(p, ifidx, 20000);
+
+		size_t allocations;
+		{
+			_alloc_counter c;
+			t.send(p, ifidx, 200000);
+			allocations = c.count();
+		}
+
+		CHECK(allocations == 0);
+		p.flush();
+	}
+}
+
+TEST(alloc, fanout)
+{
+	auto all = std::make_shared<pcapng_writer>(std::make_shared<null_output>(), 64 << 10);
+	auto tcp = std::make_shared<pcapng_writer>(std::make_shared<null_output>(), 64 << 10);
+
+	std::vector<fanout_output> outputs;
+	outputs.push_back({ .sink = all });
+	outputs.push_back({ .sink = tcp, .filter = packet_filter::compile("tcp"), .snaplen = 200, .headers_only = true });
+	packet_fanout f(packet_filter::compile("ip"), std::move(outputs));
+
+	_traffic t;
+	uint32_t ifidx = f.add_interface(t.intf());
+	t.send(f, ifidx, 10000);
+
+	size_t allocations;
+	{
+		_alloc_counter c;
+		t.send(f, ifidx, 100000);
+		allocations = c.count();
+	}
+
+	CHECK(allocations == 0);
+	f.flush();
+}
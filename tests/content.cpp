@@ -0,0 +1,189 @@
+#include "content.h"
+#include "packets.h"
+#include "test.h"
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool _naive_match(std::vector<std::string> const & patterns, std::string_view data)
+{
+	for (auto const & p: patterns)
+	{
+		if (data.find(p) != std::string_view::npos)
+			return true;
+	}
+	return false;
+}
+
+bool _match(content_matcher const & m, std::string_view data)
+{
+	return m.match(std::as_bytes(std::span(data)));
+}
+
+// Compares the matcher, with and without the prefilter, against a naive
+// search over random buffers that have the patterns planted in some of them.
+void _check_random(std::vector<std::string> const & patterns, std::string_view alphabet, uint32_t seed)
+{
+	content_matcher with(patterns);
+	content_matcher without(patterns, false);
+	CHECK(!without.prefiltered());
+
+	std::mt19937 rng(seed);
+	size_t mismatches = 0;
+	size_t matches = 0;
+	for (size_t i = 0; i != 5000; ++i)
+	{
+		std::string data(rng() % 200, '\0');
+		for (char & c: data)
+			c = alphabet[rng() % alphabet.size()];
+
+		// Plant a pattern, possibly cut off by the end of the buffer.
+		if (!data.empty() && rng() % 2 == 0)
+		{
+			std::string const & p = patterns[rng() % patterns.size()];
+			size_t at = rng() % data.size();
+			data.replace(at, (std::min)(p.size(), data.size() - at), p.substr(0, data.size() - at));
+		}
+
+		bool want = _naive_match(patterns, data);
+		matches += want;
+		mismatches += _match(with, data) != want;
+		mismatches += _match(without, data) != want;
+	}
+
+	CHECK(mismatches == 0);
+	CHECK(matches != 0);
+}
+
+}
+
+TEST(content, parse_pattern)
+{
+	CHECK(parse_content_pattern("GET /") == "GET /");
+	CHECK(parse_content_pattern("\\x00\\xfF\\\\x") == std::string("\x00\xff\\x", 4));
+	CHECK_THROWS(parse_content_pattern(""));
+	CHECK_THROWS(parse_content_pattern("\\x0"));
+	CHECK_THROWS(parse_content_pattern("\\xzz"));
+	CHECK_THROWS(parse_content_pattern("\\n"));
+}
+
+TEST(content, basic)
+{
+	content_matcher m({ "he", "she", "his", "hers" });
+	CHECK(_match(m, "ushers"));
+	CHECK(_match(m, "this"));
+	CHECK(_match(m, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxhe"));
+	CHECK(!_match(m, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxh"));
+	CHECK(!_match(m, "hi s"));
+	CHECK(!_match(m, ""));
+
+	content_matcher empty;
+	CHECK(empty.empty());
+	CHECK(!_match(empty, "anything"));
+}
+
+TEST(content, binary)
+{
+	std::string nul("\0\0\x01", 3);
+	content_matcher m({ nul, "\xff\xfe" });
+	CHECK(_match(m, std::string("abc\0\0\x01zz", 8)));
+	CHECK(_match(m, "....\xff\xfe"));
+	CHECK(!_match(m, std::string("abc\0\0\x02zz", 8)));
+}
+
+// A few long patterns, which the prefilter handles.
+TEST(content, few_long)
+{
+	_check_random({ "GET /index.html", "POST /login", "User-Agent: curl", "\x16\x03\x01" }, "GETPOST /inx.hmlUA:cr\x16\x03\x01 ", 1);
+}
+
+// Patterns of one and two bytes, for the shorter prefilter masks.
+TEST(content, short)
+{
+	_check_random({ "q" }, "abcdefghijklmnopq", 2);
+	_check_random({ "zq", "xy" }, "qxyz", 3);
+	_check_random({ "abc", "z", "ccc" }, "abcz", 4);
+}
+
+// Many diverse patterns, for which the prefilter is left out.
+TEST(content, many)
+{
+	std::mt19937 rng(5);
+	std::vector<std::string> patterns;
+	for (size_t i = 0; i != 300; ++i)
+	{
+		std::string p(2 + rng() % 6, '\0');
+		for (char & c: p)
+			c = (char)('a' + rng() % 8);
+		patterns.push_back(p);
+	}
+
+	_check_random(patterns, "abcdefghij", 6);
+}
+
+namespace {
+
+struct _recording_sink final
+	: packet_sink
+{
+	uint32_t add_interface(capture_interface const &) override
+	{
+		return 0;
+	}
+
+	void add_packet(uint32_t, uint64_t timestamp, std::span<std::byte const>, size_t, uint32_t) override
+	{
+		timestamps.push_back(timestamp);
+	}
+
+	void flush() override
+	{
+	}
+
+	std::vector<uint64_t> timestamps;
+};
+
+}
+
+TEST(content, filter_whole_flows)
+{
+	for (bool whole_flows: { false, true })
+	{
+		auto sink = std::make_shared<_recording_sink>();
+		content_filter f(sink, content_matcher({ "secret" }), whole_flows);
+		f.add_interface({ .index = 1, .link_type = if_type_ethernet, .name = "eth0", .desc = {}, .snaplen = 65535 });
+
+		test_packet a;
+		a.proto = ip_proto_tcp;
+		test_packet reply = a;
+		std::swap(reply.src_ip, reply.dst_ip);
+		std::swap(reply.src_port, reply.dst_port);
+		test_packet other = a;
+		other.src_port = 50001;
+
+		auto send = [&](test_packet p, std::string_view text, uint64_t ts) {
+			p.payload = test_bytes(text);
+			auto frame = p.frame();
+			f.add_packet(0, ts, frame, frame.size(), 0);
+		};
+
+		send(a, "hello", 1);
+		send(a, "the secret word", 2);
+		send(reply, "ok", 3);
+		send(a, "bye", 4);
+		send(other, "nothing", 5);
+
+		// After a minute without packets, the flow is forgotten.
+		send(a, "again", 4 + content_filter::flow_idle_timeout + 2'000'000);
+
+		if (whole_flows)
+			CHECK(sink->timestamps == std::vector<uint64_t>{ 2, 3, 4 });
+		else
+			CHECK(sink->timestamps == std::vector<uint64_t>{ 2 });
+	}
+}
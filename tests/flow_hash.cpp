@@ -0,0 +1,167 @@
+#include "packets.h"
+#include "shard.h"
+#include "test.h"
+
+#include <algorithm>
+#include <random>
+#include <utility>
+
+namespace {
+
+decoded_packet _flow(uint8_t ip_version, uint8_t proto, std::mt19937 & rng)
+{
+	decoded_packet pkt;
+	pkt.ip_version = ip_version;
+	pkt.ip_proto = proto;
+	pkt.l4_offset = 34;
+	for (size_t i = 0; i != pkt.ip_addr_size(); ++i)
+	{
+		pkt.src_ip[i] = (uint8_t)rng();
+		pkt.dst_ip[i] = (uint8_t)rng();
+	}
+	pkt.src_port = (uint16_t)rng();
+	pkt.dst_port = (uint16_t)rng();
+	return pkt;
+}
+
+decoded_packet _reversed(decoded_packet pkt)
+{
+	std::swap(pkt.src_ip, pkt.dst_ip);
+	std::swap(pkt.src_port, pkt.dst_port);
+	return pkt;
+}
+
+// The hash computed bit by bit: each set bit of the addresses and ports
+// contributes the key rotated by its position modulo 16.
+uint32_t _reference_hash(decoded_packet const & pkt, bool ports)
+{
+	std::vector<uint8_t> in;
+	in.insert(in.end(), pkt.src_ip.begin(), pkt.src_ip.begin() + pkt.ip_addr_size());
+	in.insert(in.end(), pkt.dst_ip.begin(), pkt.dst_ip.begin() + pkt.ip_addr_size());
+	if (ports)
+	{
+		uint8_t const p[4] = { (uint8_t)(pkt.src_port >> 8), (uint8_t)pkt.src_port, (uint8_t)(pkt.dst_port >> 8), (uint8_t)pkt.dst_port };
+		in.insert(in.end(), p, p + 4);
+	}
+
+	uint32_t const key = 0x6d5a6d5a;
+	uint32_t h = 0;
+	for (size_t i = 0; i != in.size() * 8; ++i)
+	{
+		if (in[i / 8] & (0x80 >> (i % 8)))
+		{
+			unsigned shift = (unsigned)(i % 16);
+			h ^= shift == 0? key: (key << shift) | (key >> (32 - shift));
+		}
+	}
+	return h;
+}
+
+}
+
+TEST(flow_hash, symmetric)
+{
+	std::mt19937 rng(1);
+	symmetric_flow_hash hash;
+	for (uint8_t v: { 4, 6 })
+	{
+		for (uint8_t proto: { ip_proto_tcp, ip_proto_udp, ip_proto_icmp })
+		{
+			for (size_t i = 0; i != 1000; ++i)
+			{
+				decoded_packet pkt = _flow(v, proto, rng);
+				CHECK(hash(pkt) == hash(_reversed(pkt)));
+			}
+		}
+	}
+}
+
+TEST(flow_hash, matches_reference)
+{
+	std::mt19937 rng(2);
+	symmetric_flow_hash hash;
+	for (uint8_t v: { 4, 6 })
+	{
+		for (size_t i = 0; i != 1000; ++i)
+		{
+			decoded_packet tcp = _flow(v, ip_proto_tcp, rng);
+			CHECK(hash(tcp) == _reference_hash(tcp, true));
+
+			decoded_packet icmp = _flow(v, ip_proto_icmp, rng);
+			CHECK(hash(icmp) == _reference_hash(icmp, false));
+		}
+	}
+}
+
+TEST(flow_hash, fragments_by_address)
+{
+	std::mt19937 rng(3);
+	symmetric_flow_hash hash;
+	decoded_packet first = _flow(4, ip_proto_udp, rng);
+	first.ip_fragment = true;
+
+	// Later fragments have no ports.
+	decoded_packet later = first;
+	later.l4_offset = decoded_packet::npos;
+	later.src_port = later.dst_port = 0;
+
+	CHECK(hash(first) == hash(later));
+	CHECK(hash(first) == _reference_hash(first, false));
+}
+
+TEST(flow_hash, non_ip)
+{
+	decoded_packet pkt;
+	pkt.ethertype = ethertype_arp;
+	CHECK(symmetric_flow_hash()(pkt) == 0);
+}
+
+TEST(flow_hash, decoded_frames)
+{
+	test_packet p;
+	p.proto = ip_proto_tcp;
+	p.payload = test_bytes("GET / HTTP/1.1\r\n");
+
+	test_packet r = p;
+	std::swap(r.src_ip, r.dst_ip);
+	std::swap(r.src_port, r.dst_port);
+
+	decoded_packet a, b;
+	auto fa = p.frame();
+	auto fb = r.frame();
+	decode_packet(if_type_ethernet, fa, a);
+	decode_packet(if_type_ethernet, fb, b);
+
+	symmetric_flow_hash hash;
+	CHECK(hash(a) != 0);
+	CHECK(hash(a) == hash(b));
+}
+
+// After mixing, the flows spread evenly over the files.
+TEST(flow_hash, spread)
+{
+	std::mt19937 rng(4);
+	symmetric_flow_hash hash;
+
+	size_t const files = 8;
+	size_t const flows = 80000;
+	size_t counts[files] = {};
+	for (size_t i = 0; i != flows; ++i)
+	{
+		// Flows that only differ in the client port, as from a single host.
+		decoded_packet pkt = _flow(4, ip_proto_tcp, rng);
+		pkt.src_ip = {};
+		pkt.dst_ip = {};
+		pkt.src_ip[0] = 10;
+		pkt.dst_ip[0] = 10;
+		pkt.dst_ip[3] = 1;
+		pkt.dst_port = 443;
+		pkt.src_port = (uint16_t)(1024 + i % 60000);
+
+		uint32_t h = symmetric_flow_hash::mix(hash(pkt));
+		++counts[((uint64_t)h * files) >> 32];
+	}
+
+	for (size_t c: counts)
+		CHECK(c > flows / files * 8 / 10 && c < flows / files * 12 / 10);
+}
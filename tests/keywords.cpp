@@ -0,0 +1,86 @@
+#include "keywords.h"
+#include "test.h"
+
+namespace {
+
+uint64_t const _eth_in = ndis_keyword::ethernet | ndis_keyword::receive_path | ndis_keyword::packet_start | ndis_keyword::packet_end;
+uint64_t const _eth_out = ndis_keyword::ethernet | ndis_keyword::send_path | ndis_keyword::packet_start | ndis_keyword::packet_end;
+uint64_t const _wwan_in = ndis_keyword::wireless_wan | ndis_keyword::receive_path | ndis_keyword::packet_start;
+uint64_t const _tunnel_out = ndis_keyword::tunnel | ndis_keyword::send_path | ndis_keyword::packet_start;
+
+capture_selection _selection(char const * dir, char const * media)
+{
+	capture_selection r;
+	r.set_direction(dir);
+	r.set_media(media);
+	return r;
+}
+
+}
+
+TEST(keywords, everything_by_default)
+{
+	capture_selection s;
+	CHECK(s.match_any_keyword() == ~(uint64_t)0);
+	CHECK(s.match_all_keyword() == 0);
+	for (uint64_t k: { _eth_in, _eth_out, _wwan_in, _tunnel_out, (uint64_t)0 })
+		CHECK(s.match(k));
+}
+
+TEST(keywords, direction_only)
+{
+	capture_selection s = _selection("in", "");
+	CHECK(s.match_any_keyword() == ndis_keyword::receive_path);
+	CHECK(s.match_all_keyword() == 0);
+	CHECK(s.match(_eth_in));
+	CHECK(s.match(_wwan_in));
+	CHECK(!s.match(_eth_out));
+	CHECK(!s.match(_tunnel_out));
+
+	s.set_direction("out");
+	CHECK(!s.match(_eth_in));
+	CHECK(s.match(_tunnel_out));
+
+	s.set_direction("inout");
+	CHECK(s.match(_eth_in) && s.match(_eth_out));
+}
+
+TEST(keywords, media_only)
+{
+	capture_selection s = _selection("inout", "ethernet,tunnel");
+	CHECK(s.match_any_keyword() == (ndis_keyword::ethernet | ndis_keyword::tunnel));
+	CHECK(s.match_all_keyword() == 0);
+	CHECK(s.match(_eth_in));
+	CHECK(s.match(_eth_out));
+	CHECK(s.match(_tunnel_out));
+	CHECK(!s.match(_wwan_in));
+}
+
+TEST(keywords, media_and_direction)
+{
+	capture_selection s = _selection("out", "ethernet,wwan");
+	CHECK(s.match_any_keyword() == (ndis_keyword::ethernet | ndis_keyword::wireless_wan));
+	CHECK(s.match_all_keyword() == ndis_keyword::send_path);
+	CHECK(s.match(_eth_out));
+	CHECK(!s.match(_eth_in));
+	CHECK(!s.match(_wwan_in));
+	CHECK(!s.match(_tunnel_out));
+
+	// Events without keywords are always delivered.
+	CHECK(s.match(0));
+}
+
+TEST(keywords, invalid)
+{
+	capture_selection s;
+	CHECK_THROWS(s.set_direction("both"));
+	CHECK_THROWS(s.set_media("ethernet,wifi"));
+}
+
+TEST(keywords, epb_direction)
+{
+	CHECK(capture_selection::epb_direction(_eth_in) == epb_inbound);
+	CHECK(capture_selection::epb_direction(_eth_out) == epb_outbound);
+	CHECK(capture_selection::epb_direction(ndis_keyword::ethernet) == 0);
+	CHECK(capture_selection::epb_direction(ndis_keyword::send_path | ndis_keyword::receive_path) == 0);
+}
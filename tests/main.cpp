@@ -0,0 +1,46 @@
+#include "test.h"
+
+#include <cstdio>
+#include <cstring>
+#include <exception>
+
+// Runs the test cases of the suites named on the command line, or all of them.
+int main(int argc, char * argv[])
+{
+	size_t run = 0;
+	for (test_case const & tc: test_cases())
+	{
+		bool selected = argc < 2;
+		for (int i = 1; i < argc; ++i)
+			selected = selected || strcmp(argv[i], tc.suite) == 0;
+		if (!selected)
+			continue;
+
+		size_t failures = test_failures();
+		try
+		{
+			tc.fn();
+		}
+		catch (test_abort const &)
+		{
+		}
+		catch (std::exception const & e)
+		{
+			fprintf(stderr, "%s.%s: unexpected exception: %s\n", tc.suite, tc.name, e.what());
+			++test_failures();
+		}
+
+		++run;
+		if (test_failures() != failures)
+			fprintf(stderr, "%s.%s: FAILED\n", tc.suite, tc.name);
+	}
+
+	if (run == 0)
+	{
+		fprintf(stderr, "no test cases were run\n");
+		return 1;
+	}
+
+	printf("%zu test cases, %zu failed checks\n", run, test_failures());
+	return test_failures() == 0? 0: 1;
+}
@@ -0,0 +1,186 @@
+#include "index.h"
+#include "merge.h"
+#include "packets.h"
+#include "pcapng.h"
+#include "pcapng_files.h"
+#include "repair.h"
+#include "test.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+TEST(merge, loser_tree)
+{
+	std::mt19937 rng(1);
+	for (size_t count = 1; count != 20; ++count)
+	{
+		// Sorted lists of keys, merged by repeatedly taking the winner.
+		std::vector<std::vector<uint32_t>> lists(count);
+		std::vector<uint32_t> all;
+		for (auto & l: lists)
+		{
+			l.resize(rng() % 50);
+			for (auto & k: l)
+				k = rng() % 100;
+			std::sort(l.begin(), l.end());
+			all.insert(all.end(), l.begin(), l.end());
+		}
+		std::sort(all.begin(), all.end());
+
+		std::vector<size_t> pos(count);
+		auto done = [&](size_t i) { return pos[i] == lists[i].size(); };
+		loser_tree tree(count, [&](size_t a, size_t b) {
+			if (done(a) != done(b))
+				return done(b);
+			if (done(a))
+				return a < b;
+			return lists[a][pos[a]] < lists[b][pos[b]] || (lists[a][pos[a]] == lists[b][pos[b]] && a < b);
+		});
+
+		std::vector<uint32_t> merged;
+		size_t last_list = 0;
+		bool stable = true;
+		for (;;)
+		{
+			size_t w = tree.winner();
+			if (done(w))
+				break;
+
+			// Equal keys come in the order of the lists.
+			if (!merged.empty() && merged.back() == lists[w][pos[w]] && w < last_list)
+				stable = false;
+
+			merged.push_back(lists[w][pos[w]++]);
+			last_list = w;
+			tree.replay();
+		}
+
+		CHECK(merged == all);
+		CHECK(stable);
+	}
+}
+
+namespace {
+
+uint64_t const _base_us = 1'700'000'000'000'000;
+
+// Writes a capture with an Ethernet interface in microseconds, with a packet
+// every millisecond, and one in nanoseconds, half a millisecond later.
+void _write_inputs(temp_directory const & dir)
+{
+	test_packet p;
+	p.payload.resize(20);
+	std::vector<std::byte> frame = p.frame();
+
+	pcapng_writer us(dir / "us.pcapng");
+	us.add_interface({ .index = 1, .link_type = if_type_ethernet, .name = "us", .desc = {}, .snaplen = 65535 });
+	for (uint64_t i = 0; i != 100; ++i)
+		us.add_packet(0, _base_us + i * 1000, frame, frame.size(), 0);
+	us.flush();
+
+	pcapng_writer ns(dir / "ns.pcapng");
+	ns.add_block(test_interface_block(9));
+	for (uint64_t i = 0; i != 100; ++i)
+		ns.add_block(test_packet_block(0, (_base_us + i * 1000 + 500) * 1000, frame));
+	ns.flush();
+}
+
+struct _block_collector
+{
+	void add_block(std::span<std::byte const> block)
+	{
+		data.insert(data.end(), block.begin(), block.end());
+	}
+
+	std::vector<std::byte> data;
+};
+
+}
+
+TEST(merge, timestamp_resolutions)
+{
+	temp_directory dir;
+	_write_inputs(dir);
+
+	auto out_path = dir / "merged.pcapng";
+	auto index_path = dir / "merged.pcapng.idx";
+	merge_stats stats;
+	{
+		capture_merger merger({ dir / "us.pcapng", dir / "ns.pcapng" });
+		pcapng_writer w(out_path);
+		w.enable_index(index_path);
+		stats = merger.merge(w);
+		w.flush();
+	}
+
+	CHECK(stats.packets == 200);
+	CHECK(stats.interfaces == 2);
+	CHECK(stats.truncated.empty());
+
+	// The packets alternate between the inputs.
+	auto blocks = test_read_blocks(read_file(out_path));
+	REQUIRE(blocks.size() == 200);
+	for (size_t i = 0; i != blocks.size(); ++i)
+		CHECK(blocks[i].intf == i % 2);
+
+	// The index finds the nanosecond packets by their time in microseconds.
+	_block_collector c;
+	auto ex = extract_indexed(out_path, index_path, c, _base_us + 10'000, _base_us + 19'999, packet_filter{});
+	CHECK(ex.packets == 20);
+
+	auto got = test_read_blocks(c.data);
+	CHECK(got.size() == 20);
+	CHECK(std::count_if(got.begin(), got.end(), [](test_block const & b) { return b.intf == 1; }) == 10);
+
+	// And so does an index rebuilt by --repair.
+	std::filesystem::remove(index_path);
+	auto rs = repair_capture(out_path, {}, true);
+	CHECK(rs.index_rebuilt);
+
+	_block_collector c2;
+	ex = extract_indexed(out_path, index_path, c2, _base_us + 50'000, _base_us + 50'999, packet_filter{});
+	CHECK(ex.packets == 2);
+}
+
+TEST(merge, truncated_input)
+{
+	temp_directory dir;
+	_write_inputs(dir);
+
+	// Cut off in the middle of the last block, and followed by zeros.
+	auto us = read_file(dir / "us.pcapng");
+	write_file(dir / "cut.pcapng", std::span(us).first(us.size() - 30));
+	auto ns = read_file(dir / "ns.pcapng");
+	ns.resize(ns.size() + 4096);
+	write_file(dir / "zeros.pcapng", ns);
+
+	capture_merger merger({ dir / "cut.pcapng", dir / "zeros.pcapng" });
+	pcapng_writer w(dir / "merged.pcapng");
+	merge_stats stats = merger.merge(w);
+	w.flush();
+
+	CHECK(stats.packets == 199);
+	REQUIRE(stats.truncated.size() == 2);
+	CHECK(stats.truncated[0].first == dir / "cut.pcapng");
+	CHECK(stats.truncated[0].second == us.size() - pcapng_writer::packet_block_size(20 + 42));
+	CHECK(stats.truncated[1].second == ns.size() - 4096);
+	CHECK(test_read_blocks(read_file(dir / "merged.pcapng")).size() == 199);
+}
+
+TEST(merge, corrupt_input)
+{
+	temp_directory dir;
+	_write_inputs(dir);
+
+	// A bad length in the middle is still an error.
+	auto us = read_file(dir / "us.pcapng");
+	size_t block = us.size() - 10 * pcapng_writer::packet_block_size(20 + 42);
+	uint32_t bad = 13;
+	memcpy(us.data() + block + 4, &bad, 4);
+	write_file(dir / "bad.pcapng", us);
+
+	capture_merger merger({ dir / "bad.pcapng", dir / "ns.pcapng" });
+	pcapng_writer w(dir / "merged.pcapng");
+	CHECK_THROWS(merger.merge(w));
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include "packet.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <span>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+// Synthetic Ethernet frames for the tests.
+struct test_packet
+{
+	uint8_t proto = ip_proto_udp;
+	uint32_t src_ip = 0x0a000001;
+	uint32_t dst_ip = 0x0a000002;
+	uint16_t src_port = 50000;
+	uint16_t dst_port = 80;
+
+	// For TCP.
+	uint32_t seq = 0;
+	uint8_t tcp_flags = tcp_ack;
+
+	std::vector<std::byte> payload;
+
+	// The frame, with an IPv4 header and a UDP or TCP header.
+	std::vector<std::byte> frame() const
+	{
+		size_t l4_size = proto == ip_proto_tcp? 20: 8;
+		std::vector<std::byte> r(14 + 20 + l4_size + payload.size());
+		std::byte * p = r.data();
+
+		auto be16 = [](std::byte * p, uint16_t v) {
+			p[0] = (std::byte)(v >> 8);
+			p[1] = (std::byte)v;
+		};
+		auto be32 = [&](std::byte * p, uint32_t v) {
+			be16(p, (uint16_t)(v >> 16));
+			be16(p + 2, (uint16_t)v);
+		};
+
+		p[0] = (std::byte)0x02;
+		p[6] = (std::byte)0x02;
+		p[11] = (std::byte)1;
+		be16(p + 12, ethertype_ipv4);
+
+		std::byte * ip = p + 14;
+		ip[0] = (std::byte)0x45;
+		be16(ip + 2, (uint16_t)(r.size() - 14));
+		ip[8] = (std::byte)64;
+		ip[9] = (std::byte)proto;
+		be32(ip + 12, src_ip);
+		be32(ip + 16, dst_ip);
+
+		std::byte * l4 = ip + 20;
+		be16(l4, src_port);
+		be16(l4 + 2, dst_port);
+		if (proto == ip_proto_tcp)
+		{
+			be32(l4 + 4, seq);
+			l4[12] = (std::byte)0x50;
+			l4[13] = (std::byte)tcp_flags;
+			be16(l4 + 14, 0xffff);
+		}
+		else
+		{
+			be16(l4 + 4, (uint16_t)(l4_size + payload.size()));
+		}
+
+		std::copy(payload.begin(), payload.end(), l4 + l4_size);
+		return r;
+	}
+};
+
+inline std::vector<std::byte> test_bytes(std::string_view s)
+{
+	auto p = (std::byte const *)s.data();
+	return std::vector<std::byte>(p, p + s.size());
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include "pcapng.h"
+
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <stdint.h>
+#include <vector>
+
+// Encoded pcapng blocks, for writing test captures block by block.
+
+inline std::vector<std::byte> test_section_block()
+{
+	uint32_t const words[7] = { 0x0a0d0d0a, 28, 0x1a2b3c4d, 1, 0xffffffff, 0xffffffff, 28 };
+	std::vector<std::byte> r(sizeof words);
+	memcpy(r.data(), words, sizeof words);
+	return r;
+}
+
+// An Ethernet interface with its timestamps in 10^-`tsresol` seconds.
+inline std::vector<std::byte> test_interface_block(uint8_t tsresol = 6)
+{
+	uint32_t const words[8] = { 1, 32, 1, 0xffff, 0x00010009, tsresol, 0, 32 };
+	std::vector<std::byte> r(sizeof words);
+	memcpy(r.data(), words, sizeof words);
+	return r;
+}
+
+inline std::vector<std::byte> test_packet_block(uint32_t ifidx, uint64_t timestamp, std::span<std::byte const> payload)
+{
+	std::vector<std::byte> r(pcapng_writer::packet_block_size(payload.size()));
+	pcapng_writer::encode_packet(r, ifidx, timestamp, payload, payload.size());
+	return r;
+}
+
+// A packet or interface statistics block of a capture.
+struct test_block
+{
+	uint32_t type;
+	uint32_t intf;
+	uint64_t timestamp;
+};
+
+// The packet and statistics blocks of a capture, in file order.
+inline std::vector<test_block> test_read_blocks(std::span<std::byte const> data)
+{
+	std::vector<test_block> r;
+	for (size_t pos = 0; pos + 12 <= data.size();)
+	{
+		uint32_t type, len;
+		memcpy(&type, data.data() + pos, 4);
+		memcpy(&len, data.data() + pos + 4, 4);
+		if (len < 12 || pos + len > data.size())
+			break;
+
+		if (type == 5 || type == 6)
+		{
+			uint32_t intf, ts_hi, ts_lo;
+			memcpy(&intf, data.data() + pos + 8, 4);
+			memcpy(&ts_hi, data.data() + pos + 12, 4);
+			memcpy(&ts_lo, data.data() + pos + 16, 4);
+			r.push_back({ type, intf, ((uint64_t)ts_hi << 32) | ts_lo });
+		}
+
+		pos += len;
+	}
+	return r;
+}
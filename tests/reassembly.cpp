@@ -0,0 +1,334 @@
+#include "reassembly.h"
+#include "test.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+// Runs a reassembler over synthetic segments of a single connection,
+// keeping each direction's output in memory.
+struct _harness
+{
+	explicit _harness(size_t budget = tcp_reassembler::default_budget, size_t flow_budget = tcp_reassembler::default_flow_budget,
+		size_t max_open = tcp_reassembler::default_max_open)
+		: r([this](tcp_flow_key const & key) { return this->_open(key); }, budget, flow_budget,
+			tcp_reassembler::default_idle_timeout, max_open)
+	{
+		client.ip_version = 4;
+		client.src_ip[0] = 10;
+		client.src_ip[3] = 1;
+		client.dst_ip[0] = 10;
+		client.dst_ip[3] = 2;
+		client.src_port = 51000;
+		client.dst_port = 80;
+	}
+
+	// Sends `size` bytes of the client's stream at `offset`, with
+	// the stream starting after a SYN with sequence number `isn`.
+	void send(uint64_t offset, size_t size, uint8_t flags = tcp_ack)
+	{
+		this->send(client, offset, size, flags);
+	}
+
+	void send(tcp_flow_key const & key, uint64_t offset, size_t size, uint8_t flags = tcp_ack)
+	{
+		std::vector<std::byte> data(size);
+		for (size_t i = 0; i != size; ++i)
+			data[i] = stream_byte(offset + i);
+		r.add_segment(key, ++timestamp, (uint32_t)(isn + 1 + offset), flags, data, size);
+	}
+
+	void send_text(uint32_t seq, std::string_view text, uint8_t flags = tcp_ack)
+	{
+		r.add_segment(client, ++timestamp, seq, flags, std::as_bytes(std::span(text)), text.size());
+	}
+
+	void syn(uint32_t new_isn)
+	{
+		isn = new_isn;
+		r.add_segment(client, ++timestamp, isn, tcp_syn, {}, 0);
+	}
+
+	static std::byte stream_byte(uint64_t pos)
+	{
+		return (std::byte)(pos * 7 + pos / 251);
+	}
+
+	// The client's stream from `from` to `to`.
+	static std::vector<std::byte> expected(uint64_t from, uint64_t to)
+	{
+		std::vector<std::byte> r;
+		for (uint64_t i = from; i != to; ++i)
+			r.push_back(stream_byte(i));
+		return r;
+	}
+
+	std::vector<std::byte> output(tcp_flow_key const & key) const
+	{
+		auto it = outputs.find(tcp_stream_file_name(key));
+		return it == outputs.end()? std::vector<std::byte>{}: it->second->data();
+	}
+
+	std::string text(tcp_flow_key const & key) const
+	{
+		auto it = outputs.find(tcp_stream_file_name(key));
+		return it == outputs.end()? std::string{}: it->second->str();
+	}
+
+	tcp_reassembly_stats const & stats() const noexcept
+	{
+		return r.stats();
+	}
+
+	tcp_reassembler r;
+	tcp_flow_key client;
+	uint32_t isn = 0;
+	uint64_t timestamp = 1'000'000;
+
+	// The outputs by file name; opening one again appends to it.
+	std::map<std::string, std::shared_ptr<memory_output>> outputs;
+	size_t opens = 0;
+	bool fail_opens = false;
+
+private:
+	std::shared_ptr<byte_output> _open(tcp_flow_key const & key)
+	{
+		if (fail_opens)
+			throw std::system_error(std::make_error_code(std::errc::too_many_files_open));
+
+		++opens;
+		auto & out = outputs[tcp_stream_file_name(key)];
+		if (!out)
+			out = std::make_shared<memory_output>();
+		return out;
+	}
+};
+
+}
+
+TEST(reassembly, in_order)
+{
+	_harness h;
+	h.syn(1000);
+	h.send(0, 100);
+	h.send(100, 1400);
+	h.send(1500, 10);
+	h.r.flush();
+
+	CHECK(h.output(h.client) == _harness::expected(0, 1510));
+	CHECK(h.stats().streams == 1);
+	CHECK(h.stats().bytes == 1510);
+	CHECK(h.stats().lost_bytes == 0);
+	CHECK(h.stats().duplicate_bytes == 0);
+}
+
+TEST(reassembly, out_of_order)
+{
+	_harness h;
+	h.syn(0xfffffff0);
+
+	// The sequence numbers also wrap around.
+	h.send(3000, 1000);
+	h.send(1000, 1000);
+	h.send(2000, 1000);
+	CHECK(h.output(h.client).empty());
+
+	h.send(0, 1000);
+	CHECK(h.output(h.client) == _harness::expected(0, 4000));
+	CHECK(h.stats().lost_bytes == 0);
+	CHECK(h.stats().duplicate_bytes == 0);
+}
+
+TEST(reassembly, retransmissions)
+{
+	_harness h;
+	h.syn(1);
+	h.send(0, 500);
+	h.send(0, 500);
+	h.send(1000, 500);
+	h.send(1000, 500);
+	h.send(500, 500);
+	h.send(0, 1500);
+	h.r.flush();
+
+	CHECK(h.output(h.client) == _harness::expected(0, 1500));
+	CHECK(h.stats().duplicate_bytes == 500 + 500 + 1500);
+	CHECK(h.stats().lost_bytes == 0);
+}
+
+TEST(reassembly, overlaps)
+{
+	_harness h;
+	h.syn(100);
+
+	// Overlapping the written data.
+	h.send_text(101, "hello wor");
+	h.send_text(107, "world");
+
+	// Overlapping held data, and held data overlapping each other.
+	h.send_text(119, "ghij");
+	h.send_text(117, "efgh");
+	h.send_text(112, "!abcdef");
+	h.r.flush();
+
+	CHECK(h.text(h.client) == "hello world!abcdefghij");
+	CHECK(h.stats().duplicate_bytes == 3 + 2 + 2);
+	CHECK(h.stats().lost_bytes == 0);
+}
+
+TEST(reassembly, joined_midway)
+{
+	_harness h;
+	h.send_text(5000, "abc");
+	h.send_text(5003, "def");
+	h.send_text(4990, "0123456789abc");
+	h.r.flush();
+
+	CHECK(h.text(h.client) == "abcdef");
+	CHECK(h.stats().duplicate_bytes == 3);
+}
+
+TEST(reassembly, new_isn)
+{
+	_harness h;
+	h.syn(1000);
+	h.send_text(1001, "first");
+
+	// Held behind a hole that the new connection gives up on.
+	h.send_text(1010, "late");
+
+	// The same SYN again doesn't start over.
+	h.syn(1000);
+	CHECK(h.text(h.client) == "first");
+
+	h.syn(7000);
+	h.send_text(7001, ", second");
+
+	// Data of the old connection is out of the new one's window.
+	h.send_text(1014, "stale");
+	h.r.flush();
+
+	CHECK(h.text(h.client) == "firstlate, second");
+	CHECK(h.stats().streams == 2);
+	CHECK(h.stats().lost_bytes == 4);
+}
+
+TEST(reassembly, both_directions)
+{
+	_harness h;
+	tcp_flow_key server = h.client.reversed();
+	h.syn(0);
+	h.send(0, 100);
+	h.send(server, 0, 200);
+	h.send(100, 100, tcp_ack | tcp_fin);
+
+	// After the FIN, the direction is done.
+	h.send(200, 100);
+	h.r.flush();
+
+	CHECK(h.output(h.client) == _harness::expected(0, 200));
+	CHECK(h.output(server) == _harness::expected(0, 200));
+	CHECK(h.stats().streams == 2);
+	CHECK(h.stats().duplicate_bytes == 100);
+}
+
+// When the direction's budget runs out, the first hole is given up on
+// and the held data behind it is written out.
+TEST(reassembly, out_of_budget)
+{
+	// Four blocks of 2048 bytes for a direction.
+	_harness h(tcp_reassembler::default_budget, 4 * segment_pool::block_size);
+	h.syn(0);
+	h.send(0, 100);
+	for (uint64_t off = 1000; off != 5000; off += 1000)
+		h.send(off, 1000);
+	CHECK(h.output(h.client).size() == 100);
+
+	h.send(6000, 1000);
+	h.r.flush();
+
+	std::vector<std::byte> want = _harness::expected(0, 100);
+	std::vector<std::byte> rest = _harness::expected(1000, 5000);
+	want.insert(want.end(), rest.begin(), rest.end());
+	rest = _harness::expected(6000, 7000);
+	want.insert(want.end(), rest.begin(), rest.end());
+	CHECK(h.output(h.client) == want);
+	CHECK(h.stats().lost_bytes == 900 + 1000);
+	CHECK(h.stats().duplicate_bytes == 0);
+}
+
+// A segment that doesn't fit and starts before the held data
+// is written from its start, not from the held data.
+TEST(reassembly, out_of_budget_before_held)
+{
+	_harness h(tcp_reassembler::default_budget, 4 * segment_pool::block_size);
+	h.syn(0);
+	for (uint64_t off = 1000; off != 5000; off += 1000)
+		h.send(off, 1000);
+
+	h.send(500, 1000);
+	h.r.flush();
+
+	CHECK(h.output(h.client) == _harness::expected(500, 5000));
+	CHECK(h.stats().lost_bytes == 500);
+	CHECK(h.stats().duplicate_bytes == 500);
+}
+
+// When the whole pool runs out, the connection table and the other
+// directions' holes give way too.
+TEST(reassembly, out_of_pool)
+{
+	_harness h(8 * segment_pool::block_size, 8 * segment_pool::block_size);
+	tcp_flow_key other = h.client;
+	other.src_port = 51001;
+
+	h.syn(0);
+	for (uint64_t off = 1000; off != 6000; off += 1000)
+		h.send(off, 1000);
+
+	// The new connection makes room by giving up the first one's hole.
+	h.r.add_segment(other, ++h.timestamp, 0, tcp_syn, {}, 0);
+	h.send(other, 0, 100);
+	h.r.flush();
+
+	CHECK(h.output(h.client) == _harness::expected(1000, 6000));
+	CHECK(h.output(other) == _harness::expected(0, 100));
+	CHECK(h.stats().lost_bytes == 1000);
+}
+
+TEST(reassembly, reopens_and_appends)
+{
+	_harness h(tcp_reassembler::default_budget, tcp_reassembler::default_flow_budget, 1);
+	tcp_flow_key server = h.client.reversed();
+	h.syn(0);
+	h.send(0, 100);
+	h.send(server, 0, 100);
+	h.send(100, 100);
+	h.send(server, 100, 100);
+	h.r.flush();
+
+	CHECK(h.output(h.client) == _harness::expected(0, 200));
+	CHECK(h.output(server) == _harness::expected(0, 200));
+	CHECK(h.opens == 4);
+	CHECK(h.stats().streams == 2);
+}
+
+TEST(reassembly, open_failure)
+{
+	_harness h;
+	h.fail_opens = true;
+	h.syn(0);
+	h.send(0, 100);
+	h.send(300, 100);
+	h.send(100, 100);
+	h.r.flush();
+
+	CHECK(h.outputs.empty());
+	CHECK(h.stats().dropped_streams == 1);
+	CHECK(h.stats().streams == 0);
+	CHECK(h.stats().lost_bytes == 300);
+}
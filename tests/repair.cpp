@@ -0,0 +1,248 @@
+#include "packets.h"
+#include "pcapng_files.h"
+#include "repair.h"
+#include "test.h"
+
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// A capture assembled from blocks, remembering where each one starts.
+struct _capture
+{
+	void add(std::vector<std::byte> const & block)
+	{
+		offsets.push_back(data.size());
+		data.insert(data.end(), block.begin(), block.end());
+	}
+
+	void add_packets(uint32_t ifidx, size_t count, size_t size = 60)
+	{
+		for (size_t i = 0; i != count; ++i)
+		{
+			std::vector<std::byte> payload(size, (std::byte)i);
+			this->add(test_packet_block(ifidx, 1'000'000 * ++timestamp, payload));
+		}
+	}
+
+	// Overwrites blocks `first` to `last` (inclusive) with random bytes
+	// that don't look like blocks.
+	void damage(size_t first, size_t last, uint32_t seed = 1)
+	{
+		std::mt19937 rng(seed);
+		size_t end = last + 1 == offsets.size()? data.size(): offsets[last + 1];
+		for (size_t i = offsets[first]; i != end; ++i)
+			data[i] = (std::byte)(0x80 | rng());
+	}
+
+	std::pair<uint64_t, uint64_t> range(size_t first, size_t last) const
+	{
+		size_t end = last + 1 == offsets.size()? data.size(): offsets[last + 1];
+		return { offsets[first], end - offsets[first] };
+	}
+
+	repair_stats scan(temp_directory const & dir) const
+	{
+		auto path = dir / "scan.pcapng";
+		write_file(path, data);
+		mapped_file file(path);
+		return pcapng_scanner(file).scan([](uint64_t, std::span<std::byte const>) {});
+	}
+
+	std::vector<std::byte> data;
+	std::vector<size_t> offsets;
+	uint64_t timestamp = 0;
+};
+
+_capture _two_interfaces()
+{
+	_capture c;
+	c.add(test_section_block());
+	c.add(test_interface_block());
+	c.add_packets(0, 3);
+	c.add(test_interface_block());
+	c.add_packets(1, 3);
+	c.add_packets(0, 3);
+	return c;
+}
+
+}
+
+TEST(repair, clean)
+{
+	temp_directory dir;
+	_capture c = _two_interfaces();
+	auto stats = c.scan(dir);
+	CHECK(stats.blocks == 12);
+	CHECK(stats.packets == 9);
+	CHECK(stats.damaged.empty());
+	CHECK(stats.lost_bytes == 0);
+}
+
+// The scan resumes right at the next block after damage anywhere,
+// including close to the end, where the vector loop doesn't reach.
+TEST(repair, resync)
+{
+	temp_directory dir;
+	_capture base = _two_interfaces();
+	for (size_t i = 2; i != base.offsets.size(); ++i)
+	{
+		if (i == 5)
+			continue;
+
+		_capture c = base;
+		c.damage(i, i, (uint32_t)i);
+		auto stats = c.scan(dir);
+		REQUIRE(stats.damaged.size() == 1);
+		CHECK(stats.damaged[0] == c.range(i, i));
+		CHECK(stats.blocks == 11);
+		CHECK(stats.lost_bytes == c.range(i, i).second);
+	}
+
+	// A partial block at the end.
+	_capture c = base;
+	c.data.resize(c.data.size() - 10);
+	auto stats = c.scan(dir);
+	REQUIRE(stats.damaged.size() == 1);
+	CHECK(stats.damaged[0].first == c.offsets.back());
+	CHECK(stats.blocks == 11);
+}
+
+// Packets of interfaces that weren't described are damage too.
+TEST(repair, unknown_interface)
+{
+	temp_directory dir;
+	_capture c;
+	c.add(test_section_block());
+	c.add(test_interface_block());
+	c.add_packets(0, 2);
+	c.add_packets(1, 1);
+	c.add_packets(0, 2);
+
+	auto stats = c.scan(dir);
+	REQUIRE(stats.damaged.size() == 1);
+	CHECK(stats.damaged[0] == c.range(4, 4));
+	CHECK(stats.packets == 4);
+}
+
+TEST(repair, truncate_in_place)
+{
+	temp_directory dir;
+	_capture c = _two_interfaces();
+	auto path = dir / "cut.pcapng";
+	write_file(path, std::span(c.data).first(c.data.size() - 10));
+
+	auto stats = repair_capture(path, {}, true);
+	CHECK(stats.repaired);
+	CHECK(stats.index_rebuilt);
+	CHECK(stats.lost_bytes == c.range(11, 11).second - 10);
+	CHECK(read_file(path) == std::vector<std::byte>(c.data.begin(), c.data.begin() + (ptrdiff_t)c.offsets.back()));
+
+	auto index = path;
+	index += ".idx";
+	CHECK(std::filesystem::exists(index));
+}
+
+// Damage before the end can't be repaired in place.
+TEST(repair, damage_in_place)
+{
+	temp_directory dir;
+	_capture c = _two_interfaces();
+	c.damage(3, 3);
+	auto path = dir / "bad.pcapng";
+	write_file(path, c.data);
+
+	auto stats = repair_capture(path, {}, false);
+	CHECK(!stats.repaired);
+	CHECK(read_file(path) == c.data);
+}
+
+// Damage inside a section could have hidden an interface block, so the
+// interfaces described after it are dropped along with their packets.
+TEST(repair, salvage)
+{
+	temp_directory dir;
+	_capture c = _two_interfaces();
+	c.damage(3, 3);
+	write_file(dir / "bad.pcapng", c.data);
+
+	auto stats = repair_capture(dir / "bad.pcapng", dir / "out.pcapng", true);
+	CHECK(stats.repaired);
+	CHECK(stats.orphaned_blocks == 1 + 3);
+
+	auto out = read_file(dir / "out.pcapng");
+	auto blocks = test_read_blocks(out);
+	CHECK(blocks.size() == 5);
+	for (auto const & b: blocks)
+		CHECK(b.intf == 0);
+
+	// The section length is left unspecified.
+	int64_t section_length;
+	memcpy(&section_length, out.data() + 16, sizeof section_length);
+	CHECK(section_length == -1);
+
+	// The salvaged copy scans clean.
+	_capture copy;
+	copy.data = out;
+	auto rescan = copy.scan(dir);
+	CHECK(rescan.damaged.empty());
+	CHECK(rescan.packets == 5);
+
+	CHECK_THROWS(repair_capture(dir / "bad.pcapng", dir / "out.pcapng", false));
+}
+
+// Without its section header, the capture gets a new one.
+TEST(repair, salvage_lost_section_header)
+{
+	temp_directory dir;
+	_capture c = _two_interfaces();
+	c.damage(0, 0);
+	write_file(dir / "bad.pcapng", c.data);
+
+	auto stats = repair_capture(dir / "bad.pcapng", dir / "out.pcapng", false);
+	CHECK(stats.orphaned_blocks == 0);
+
+	_capture copy;
+	copy.data = read_file(dir / "out.pcapng");
+	CHECK(copy.data.size() == c.data.size());
+	auto rescan = copy.scan(dir);
+	CHECK(rescan.damaged.empty());
+	CHECK(rescan.packets == 9);
+}
+
+// After an interface is lost, the ones that follow it in the section can't
+// be numbered, so they and their packets are dropped until the next section.
+TEST(repair, salvage_lost_interface)
+{
+	temp_directory dir;
+	_capture c;
+	c.add(test_section_block());
+	c.add(test_interface_block());
+	c.add(test_interface_block());
+	c.add_packets(0, 2);
+	c.add(test_interface_block());
+	c.add_packets(1, 2);
+	c.add_packets(2, 2);
+	c.add_packets(0, 2);
+
+	// A new section starts over.
+	c.add(test_section_block());
+	c.add(test_interface_block());
+	c.add_packets(0, 2);
+
+	c.damage(2, 2);
+	write_file(dir / "bad.pcapng", c.data);
+	auto stats = repair_capture(dir / "bad.pcapng", dir / "out.pcapng", false);
+
+	// The scan only saw two interfaces, so the packets of interface 2
+	// are damage to it rather than orphans.
+	CHECK(stats.orphaned_blocks == 1 + 2);
+	CHECK(stats.damaged.size() == 2);
+
+	auto blocks = test_read_blocks(read_file(dir / "out.pcapng"));
+	CHECK(blocks.size() == 2 + 2 + 2);
+	for (auto const & b: blocks)
+		CHECK(b.intf == 0);
+}
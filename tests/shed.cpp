@@ -0,0 +1,109 @@
+#include "output.h"
+#include "packets.h"
+#include "pcapng.h"
+#include "shed.h"
+#include "test.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+TEST(shed, parse_steps)
+{
+	auto steps = parse_shed_steps("headers,sample,drop");
+	REQUIRE(steps.size() == 3);
+	CHECK(steps[0] == shed_step::headers);
+	CHECK(steps[1] == shed_step::sample);
+	CHECK(steps[2] == shed_step::drop);
+
+	CHECK(parse_shed_steps("drop") == std::vector<shed_step>{ shed_step::drop });
+	CHECK(parse_shed_steps("").empty());
+	CHECK_THROWS(parse_shed_steps("sample,truncate"));
+	CHECK_THROWS(parse_shed_steps("sample,,drop"));
+}
+
+namespace {
+
+struct _replay_result
+{
+	uint64_t received = 0;
+	uint64_t shed = 0;
+
+	// The packets that came more than 50 ms late, which the capture would have lost.
+	uint64_t late = 0;
+};
+
+// Replays `seconds` of 1000-byte UDP packets at `packet_rate` per second,
+// over 4096 flows and in real time, through the load shedder into `out`.
+// Only the last two seconds are counted, after the shedding has settled.
+_replay_result _replay(std::shared_ptr<byte_output> out, std::vector<shed_step> steps, double loss_target,
+	uint64_t packet_rate, uint64_t seconds)
+{
+	constexpr uint64_t max_lag_us = 50'000;
+
+	auto writer = std::make_shared<pcapng_writer>(std::move(out), pcapng_writer::default_buffer_size, 4);
+	load_shedder shedder(writer, std::move(steps), loss_target);
+
+	test_packet p;
+	p.payload.resize(1000 - 42);
+	std::vector<std::byte> frame = p.frame();
+	shedder.add_interface({ .index = 1, .link_type = if_type_ethernet, .name = "test", .desc = {}, .snaplen = frame.size() });
+
+	_replay_result r;
+	uint64_t counted_from = (seconds - 2) * packet_rate;
+	uint64_t shed_before = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i != seconds * packet_rate; ++i)
+	{
+		uint64_t due_us = i * 1'000'000 / packet_rate;
+		uint64_t now_us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		if (due_us > now_us + 1000)
+			std::this_thread::sleep_for(std::chrono::microseconds(due_us - now_us));
+
+		if (i == counted_from)
+			shed_before = shedder.statistics()[0].dropped;
+
+		if (now_us > due_us + max_lag_us)
+		{
+			if (i >= counted_from)
+				++r.late;
+			continue;
+		}
+
+		uint16_t sport = (uint16_t)(1024 + i % 4096);
+		frame[34] = (std::byte)(sport >> 8);
+		frame[35] = (std::byte)sport;
+		shedder.add_packet(0, 1'000'000'000'000'000 + due_us, frame, frame.size(), 0);
+
+		if (i >= counted_from)
+			++r.received;
+	}
+
+	r.shed = shedder.statistics()[0].dropped - shed_before;
+	shedder.flush();
+	return r;
+}
+
+}
+
+// An output that keeps up is never shed for.
+TEST(shed, fast_output)
+{
+	auto r = _replay(std::make_shared<null_output>(), { shed_step::sample, shed_step::drop }, 0.4, 20'000, 2);
+	CHECK(r.shed == 0);
+	CHECK(r.late == 0);
+}
+
+// An output that takes about 70% of the packets needs the rest to be shed,
+// but no more than the 40% target, and without packets coming late.
+TEST(shed, loss_target)
+{
+	auto r = _replay(std::make_shared<throttled_output>(14e6), { shed_step::sample, shed_step::drop }, 0.4, 20'000, 4);
+	REQUIRE(r.received != 0);
+
+	double shed = (double)r.shed / (double)r.received;
+	CHECK(r.shed != 0);
+	CHECK(shed <= 0.4);
+	CHECK(r.late * 100 <= r.received);
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include "output.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+// A minimal test runner, so that the tests don't need a framework.
+//
+// `TEST(suite, name)` defines a test case. `CHECK(cond)` reports a failed
+// condition and carries on; `REQUIRE(cond)` ends the test case instead.
+// `CHECK_THROWS(expr)` checks that evaluating `expr` throws.
+struct test_case
+{
+	char const * suite;
+	char const * name;
+	void (*fn)();
+};
+
+inline std::vector<test_case> & test_cases()
+{
+	static std::vector<test_case> r;
+	return r;
+}
+
+struct test_registrar
+{
+	test_registrar(char const * suite, char const * name, void (*fn)())
+	{
+		test_cases().push_back({ suite, name, fn });
+	}
+};
+
+inline size_t & test_failures()
+{
+	static size_t r = 0;
+	return r;
+}
+
+struct test_abort
+{
+};
+
+inline bool test_check(bool ok, char const * file, int line, char const * expr)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+		++test_failures();
+	}
+	return ok;
+}
+
+#define TEST(suite, name) \
+	static void test_##suite##_##name(); \
+	static test_registrar const test_##suite##_##name##_registrar(#suite, #name, &test_##suite##_##name); \
+	static void test_##suite##_##name()
+
+// Variadic, so that the conditions may contain braced lists.
+#define CHECK(...) test_check(!!(__VA_ARGS__), __FILE__, __LINE__, #__VA_ARGS__)
+#define REQUIRE(...) (CHECK(__VA_ARGS__)? (void)0: throw test_abort{})
+#define CHECK_THROWS(...) test_check([&] { try { (void)(__VA_ARGS__); } catch (...) { return true; } return false; }(), \
+	__FILE__, __LINE__, "throws: " #__VA_ARGS__)
+
+// Keeps what is written to it in memory.
+struct memory_output final
+	: byte_output
+{
+	void write(std::span<std::byte const> data) override
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_data.insert(_data.end(), data.begin(), data.end());
+	}
+
+	void sync() override
+	{
+		++_syncs;
+	}
+
+	std::vector<std::byte> data() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _data;
+	}
+
+	std::string str() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return std::string((char const *)_data.data(), _data.size());
+	}
+
+	size_t syncs() const noexcept
+	{
+		return _syncs;
+	}
+
+private:
+	mutable std::mutex _mutex;
+	std::vector<std::byte> _data;
+	size_t _syncs = 0;
+};
+
+// Discards what is written to it, counting the bytes.
+struct null_output final
+	: byte_output
+{
+	void write(std::span<std::byte const> data) override
+	{
+		_size += data.size();
+	}
+
+	void sync() override
+	{
+	}
+
+	uint64_t size() const noexcept
+	{
+		return _size;
+	}
+
+private:
+	uint64_t _size = 0;
+};
+
+// A fresh directory for the files of a test, removed afterwards.
+struct temp_directory
+{
+	temp_directory()
+	{
+		static std::atomic<unsigned> counter = 0;
+		auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+		_path = std::filesystem::temp_directory_path()
+			/ ("ndisdump-test-" + std::to_string(now) + "-" + std::to_string(counter++));
+		std::filesystem::create_directories(_path);
+	}
+
+	~temp_directory()
+	{
+		std::error_code ec;
+		std::filesystem::remove_all(_path, ec);
+	}
+
+	temp_directory(temp_directory const &) = delete;
+	temp_directory & operator=(temp_directory const &) = delete;
+
+	std::filesystem::path operator/(std::string_view name) const
+	{
+		return _path / name;
+	}
+
+private:
+	std::filesystem::path _path;
+};
+
+inline std::vector<std::byte> read_file(std::filesystem::path const & path)
+{
+	std::ifstream f(path, std::ios::binary);
+	std::vector<char> data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+	auto p = (std::byte const *)data.data();
+	return std::vector<std::byte>(p, p + data.size());
+}
+
+inline void write_file(std::filesystem::path const & path, std::span<std::byte const> data)
+{
+	std::ofstream f(path, std::ios::binary | std::ios::trunc);
+	f.write((char const *)data.data(), (std::streamsize)data.size());
+}